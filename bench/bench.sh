@@ -0,0 +1,47 @@
+#!/bin/sh
+# End to end benchmark: seeds a database with a synthetic site, starts
+# ccms on it and drives a mix of content pages, static resources and
+# API GETs at it, then prints the load generator's JSON: requests per
+# second and latency percentiles, overall and for each path.
+# Usage: bench/bench.sh [seconds]
+# Set CONNECTIONS, THREADS (ccms'), LOADGEN_THREADS, PAGES, PORT, CCMS_ARGS
+# or CORPUS_ARGS (e.g. "-s 10 -l 3") to change the setup, and OUT to also
+# write the JSON to a file.
+set -e
+
+SECONDS_TO_RUN=${1:-10}
+PORT=${PORT:-8089}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-0}
+LOADGEN_THREADS=${LOADGEN_THREADS:-0}
+PAGES=${PAGES:-200}
+DIR=$(mktemp -d)
+DB=$DIR/bench.db
+
+bin/corpus -d "$DB" -n "$PAGES" $CORPUS_ARGS > /dev/null
+# No access log, so the log writer isn't what's being measured
+bin/ccms -d "$DB" -p "$PORT" -t "$THREADS" -L 0 $CCMS_ARGS > /dev/null &
+PID=$!
+
+# Mostly pages, spread over the site, then the rest
+PATHS="-u /"
+for N in 1 2 3 5 8 13 21 34 55 89 144; do
+	if [ "$N" -le "$PAGES" ]; then
+		PATHS="$PATHS -u /page-$N"
+	fi
+done
+PATHS="$PATHS -u /static/main.css -u /api/server -u /api/page"
+
+# loadgen waits for ccms to start listening
+RESULT=$(bin/loadgen -p "$PORT" -H "localhost:8000" -c "$CONNECTIONS" -t "$LOADGEN_THREADS" \
+	-d "$SECONDS_TO_RUN" $PATHS) || STATUS=$?
+kill "$PID"
+wait "$PID" 2> /dev/null || true
+rm -rf "$DIR"
+if [ -n "$STATUS" ]; then
+	exit "$STATUS"
+fi
+echo "$RESULT"
+if [ -n "$OUT" ]; then
+	echo "$RESULT" > "$OUT"
+fi
@@ -0,0 +1,355 @@
+/*
+ * Fills a ccms database with a synthetic site for benchmarking and
+ * scaling tests. The same options and seed always give the same data,
+ * so results can be compared.
+ *
+ * Server 1 is the default, localhost:8000, and the rest are
+ * site-2.localhost:8000 and so on. Each server's pages are served at
+ * /page-1, /page-2 and so on, and form a tree through parent_page_id
+ * for the navigation. Every page has content in every language.
+ * Usage: corpus -d <database> [options]
+ */
+#define CCMS_NO_MAIN
+#include "../src/main.c"
+
+static const char* words[] = {
+	"the", "of", "and", "a", "to", "in", "is", "you", "that", "it",
+	"server", "page", "content", "theme", "cache", "request", "response", "database",
+	"quickly", "render", "markdown", "template", "static", "resource", "language",
+	"navigation", "benchmark", "latency", "throughput", "connection", "thread",
+	"while", "because", "without", "between", "through", "whatever", "however",
+};
+
+/*
+ * xorshift64*, so the site only depends on the seed
+ */
+static uint64_t rng_state;
+
+uint64_t rng_next() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ * A number from low to high inclusive
+ */
+int rng_between(int low, int high) {
+	return low + rng_next() % (high - low + 1);
+}
+
+/*
+ * Appends a sentence of random words
+ */
+void append_sentence(Text* t, int min_words, int max_words) {
+	int count = rng_between(min_words, max_words);
+	for (int i = 0; i < count; i++) {
+		const char* word = words[rng_next() % (sizeof(words) / sizeof(words[0]))];
+		if (i == 0) {
+			text_printf(t, "%c%s", toupper((unsigned char)word[0]), word + 1);
+		} else {
+			text_printf(t, " %s", word);
+		}
+	}
+}
+
+/*
+ * Markdown of around the given size: headings, paragraphs,
+ * lists, code blocks and links to the server's other pages
+ */
+char* make_markdown(size_t size, int pages) {
+	Text t = {0};
+	while (t.length < size) {
+		text_printf(&t, "## ");
+		append_sentence(&t, 2, 6);
+		text_printf(&t, "\n\n");
+		int paragraphs = rng_between(1, 4);
+		for (int p = 0; p < paragraphs; p++) {
+			int sentences = rng_between(2, 6);
+			for (int s = 0; s < sentences; s++) {
+				append_sentence(&t, 5, 20);
+				text_printf(&t, rng_between(0, 9) == 0 ? ", with _emphasis_ & **more**. " : ". ");
+			}
+			int link = rng_between(1, pages);
+			text_printf(&t, "See [page %d](/page-%d).\n\n", link, link);
+		}
+		switch (rng_between(0, 2)) {
+		case 0:
+			for (int i = rng_between(2, 6); i > 0; i--) {
+				text_printf(&t, "- ");
+				append_sentence(&t, 3, 10);
+				text_printf(&t, "\n");
+			}
+			text_printf(&t, "\n");
+			break;
+		case 1:
+			text_printf(&t, "```\nfor (int i = 0; i < n; i++) {\n\tif (a[i] < b) { b = a[i]; }\n}\n```\n\n");
+			break;
+		default:
+			break;
+		}
+	}
+	return t.data;
+}
+
+/*
+ * A content size, skewed like a real site's: mostly a few
+ * kilobytes, some longer articles, and the odd very long page
+ */
+size_t content_size() {
+	int r = rng_between(0, 99);
+	if (r < 70) {
+		return rng_between(1000, 5000);
+	} else if (r < 95) {
+		return rng_between(5000, 20000);
+	} else {
+		return rng_between(20000, 100000);
+	}
+}
+
+static const char* languages[] = {
+	"en", "fr", "de", "es", "it", "nl", "pt", "sv", "pl", "ja", "zh", "ko",
+};
+
+typedef struct {
+	const char* extension;
+	const char* content_type;
+	bool binary;
+} ResourceType;
+
+static const ResourceType resource_types[] = {
+	{"css", "text/css", false},
+	{"js", "text/javascript", false},
+	{"svg", "image/svg+xml", false},
+	{"png", "image/png", true},
+	{"woff2", "font/woff2", true},
+};
+
+/*
+ * Runs an insert, which must succeed, and resets it for the next
+ */
+void insert(sqlite3_stmt* stmt) {
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		sqlite_check(db, sqlite3_errcode(db));
+	}
+	sqlite3_reset(stmt);
+}
+
+sqlite3_stmt* prepare(const char* sql) {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
+	return stmt;
+}
+
+/*
+ * Adds a page's content in every language
+ */
+void add_content(sqlite3_stmt* content, sqlite3_int64 page_id, int pages, int language_count) {
+	size_t size = content_size();
+	for (int l = 0; l < language_count; l++) {
+		Text title = {0};
+		append_sentence(&title, 2, 5);
+		// Translations run to about the same length
+		char* markdown = make_markdown(size * rng_between(90, 110) / 100, pages);
+		sqlite_check(db, sqlite3_bind_int64(content, 1, page_id));
+		sqlite_check(db, sqlite3_bind_text(content, 2, languages[l], -1, SQLITE_STATIC));
+		sqlite_check(db, sqlite3_bind_text(content, 3, title.data, -1, SQLITE_STATIC));
+		sqlite_check(db, sqlite3_bind_text(content, 4, markdown, -1, SQLITE_STATIC));
+		insert(content);
+		free(title.data);
+		free(markdown);
+	}
+}
+
+/*
+ * Adds pages to a server, each with content in every language.
+ * Each page's parent is an earlier page, or none for about
+ * one in ten, so the tree is a few levels deep. Servers other
+ * than the first get a home page too, which the schema's seed
+ * data only gives the first.
+ */
+void add_pages(int server_id, int pages, int language_count) {
+	sqlite3_stmt* page = prepare("insert into page (server_id, parent_page_id, relative_path) "
+			"values (?1, ?2, ?3)");
+	sqlite3_stmt* content = prepare("insert into page_content "
+			"(page_id, language, title, content, content_html) "
+			"values (?1, ?2, ?3, ?4, markdown_to_html(?4))");
+	if (server_id > 1) {
+		sqlite_check(db, sqlite3_bind_int(page, 1, server_id));
+		sqlite_check(db, sqlite3_bind_null(page, 2));
+		sqlite_check(db, sqlite3_bind_text(page, 3, "/", -1, SQLITE_STATIC));
+		insert(page);
+		add_content(content, sqlite3_last_insert_rowid(db), pages, language_count);
+	}
+	sqlite3_int64* ids = malloc(sizeof(sqlite3_int64) * pages);
+	for (int i = 0; i < pages; i++) {
+		char path[32];
+		snprintf(path, sizeof(path), "/page-%d", i + 1);
+		sqlite_check(db, sqlite3_bind_int(page, 1, server_id));
+		if (i == 0 || rng_between(0, 9) == 0) {
+			sqlite_check(db, sqlite3_bind_null(page, 2));
+		} else {
+			// Favour recent pages, so branches grow deeper
+			int parent = i - 1 - (int)(rng_next() % (i < 20 ? i : 20));
+			sqlite_check(db, sqlite3_bind_int64(page, 2, ids[parent]));
+		}
+		sqlite_check(db, sqlite3_bind_text(page, 3, path, -1, SQLITE_STATIC));
+		insert(page);
+		ids[i] = sqlite3_last_insert_rowid(db);
+		add_content(content, ids[i], pages, language_count);
+	}
+	free(ids);
+	sqlite3_finalize(page);
+	sqlite3_finalize(content);
+}
+
+/*
+ * Adds static resources to a server, from a few hundred bytes to a
+ * megabyte, spread evenly over the orders of magnitude
+ */
+void add_static_resources(int server_id, int count) {
+	sqlite3_stmt* resource = prepare("insert into static_resources "
+			"(server_id, key, value, content_type) values (?1, ?2, ?3, ?4)");
+	for (int i = 0; i < count; i++) {
+		const ResourceType* type = &resource_types[rng_next() % (sizeof(resource_types) / sizeof(resource_types[0]))];
+		size_t size = 256;
+		for (int doublings = rng_between(0, 12); doublings > 0; doublings--) {
+			size *= 2;
+		}
+		size += rng_next() % size;
+		unsigned char* value = malloc(size);
+		for (size_t b = 0; b < size; b++) {
+			value[b] = type->binary ? rng_next() : " \nabcdefghijklmnopqrstuvwxyz{};:"[rng_next() % 32];
+		}
+		char key[32];
+		snprintf(key, sizeof(key), "resource-%d.%s", i + 1, type->extension);
+		sqlite_check(db, sqlite3_bind_int(resource, 1, server_id));
+		sqlite_check(db, sqlite3_bind_text(resource, 2, key, -1, SQLITE_STATIC));
+		sqlite_check(db, sqlite3_bind_blob(resource, 3, value, size, SQLITE_STATIC));
+		sqlite_check(db, sqlite3_bind_text(resource, 4, type->content_type, -1, SQLITE_STATIC));
+		insert(resource);
+		free(value);
+	}
+	sqlite3_finalize(resource);
+}
+
+/*
+ * Adds theme content for the default theme in each language: the
+ * keys its template uses (English already has them), and extra
+ * ones, which are loaded with the rest
+ */
+void add_theme_content(int keys, int language_count) {
+	sqlite3_stmt* item = prepare("insert into theme_content (theme_id, language, key, value) "
+			"values (1, ?1, ?2, ?3)");
+	for (int l = 0; l < language_count; l++) {
+		for (int k = 0; k < keys + 2; k++) {
+			char key[32];
+			if (k == 0) {
+				snprintf(key, sizeof(key), "tagline");
+			} else if (k == 1) {
+				snprintf(key, sizeof(key), "blogname");
+			} else {
+				snprintf(key, sizeof(key), "key-%d", k - 1);
+			}
+			if (l == 0 && k < 2) {
+				continue;
+			}
+			Text value = {0};
+			append_sentence(&value, 1, 12);
+			sqlite_check(db, sqlite3_bind_text(item, 1, languages[l], -1, SQLITE_STATIC));
+			sqlite_check(db, sqlite3_bind_text(item, 2, key, -1, SQLITE_STATIC));
+			sqlite_check(db, sqlite3_bind_text(item, 3, value.data, -1, SQLITE_STATIC));
+			insert(item);
+			free(value.data);
+		}
+	}
+	sqlite3_finalize(item);
+}
+
+void corpus_usage(const char* program) {
+	fprintf(stderr, "Usage: %s -d <database> [options]\n"
+			"  -s <n>      servers (default 1)\n"
+			"  -n <n>      pages per server (default 200)\n"
+			"  -l <n>      languages of content for each page, at most %d (default 1)\n"
+			"  -k <n>      extra theme content keys per language (default 4)\n"
+			"  -f <n>      static resources per server (default 10)\n"
+			"  -r <seed>   seed (default 1)\n",
+			program,
+			(int)(sizeof(languages) / sizeof(languages[0])));
+}
+
+int main(int argc, char** argv) {
+	const char* database_path = NULL;
+	int servers = 1;
+	int pages = 200;
+	int language_count = 1;
+	int keys = 4;
+	int resources = 10;
+	rng_state = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:s:n:l:k:f:r:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			database_path = optarg;
+			break;
+		case 's':
+			servers = atoi(optarg);
+			break;
+		case 'n':
+			pages = atoi(optarg);
+			break;
+		case 'l':
+			language_count = atoi(optarg);
+			break;
+		case 'k':
+			keys = atoi(optarg);
+			break;
+		case 'f':
+			resources = atoi(optarg);
+			break;
+		case 'r':
+			rng_state = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			corpus_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (database_path == NULL || servers < 1 || pages < 0 || resources < 0 || keys < 0
+			|| language_count < 1 || language_count > (int)(sizeof(languages) / sizeof(languages[0]))) {
+		corpus_usage(argv[0]);
+		return 1;
+	}
+	// xorshift never leaves 0
+	if (rng_state == 0) {
+		rng_state = 1;
+	}
+	config.database_path = database_path;
+	config.checkpoint_pages = 0;
+	initialize_database(database_path);
+
+	sqlite_check(db, sqlite3_exec(db, "begin", NULL, NULL, NULL));
+	sqlite3_stmt* server = prepare("insert into server (id, hostname, default_language, theme_id) "
+			"values (?1, ?2, 'en', 1)");
+	for (int s = 1; s <= servers; s++) {
+		if (s > 1) {
+			char hostname[64];
+			snprintf(hostname, sizeof(hostname), "site-%d.localhost:8000", s);
+			sqlite_check(db, sqlite3_bind_int(server, 1, s));
+			sqlite_check(db, sqlite3_bind_text(server, 2, hostname, -1, SQLITE_STATIC));
+			insert(server);
+		}
+		add_pages(s, pages, language_count);
+		add_static_resources(s, resources);
+	}
+	sqlite3_finalize(server);
+	add_theme_content(keys, language_count);
+	// Adding content stamps pages with the time, which would make
+	// every run's ETags and Last-Modified headers different
+	sqlite_check(db, sqlite3_exec(db,
+				"update page set last_modified = 1700000000 + id", NULL, NULL, NULL));
+	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+	close_database();
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Microbenchmark for find_page_data, which runs for every page
+ * that isn't in the page cache. Measures it with statements prepared
+ * on every call, as they used to be, and with the statement cache.
+ * Usage: bench_find_page_data [iterations]
+ */
+#define CCMS_NO_MAIN
+#include "../src/main.c"
+
+double elapsed_ns(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * Returns the average ns per call.
+ */
+double run(int iterations, bool cache_statements) {
+	int server_id = find_server_id("localhost:8000");
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < iterations; i++) {
+		PageData pd = find_page_data(server_id, "/", "en");
+		free_page_data(pd);
+		if (!cache_statements) {
+			clear_statement_cache(connection);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return elapsed_ns(start, end) / iterations;
+}
+
+int main(int argc, char** argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+	char database_path[64];
+	snprintf(database_path, sizeof(database_path), "/tmp/ccms-bench-%d.db", (int)getpid());
+	config.database_path = database_path;
+	config.threads = 1;
+
+	// Keep database setup messages out of the results
+	FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+
+	initialize_database(database_path);
+	connection = NULL;
+	db = NULL;
+	acquire_reader();
+	// Warm up sqlite's page cache
+	run(iterations / 10 + 1, true);
+	double uncached = run(iterations, false);
+	double cached = run(iterations, true);
+	release_reader();
+	close_database();
+	unlink(database_path);
+
+	fprintf(out, "find_page_data, prepared every call: %8.0f ns/op\n", uncached);
+	fprintf(out, "find_page_data, cached statements:   %8.0f ns/op\n", cached);
+	fprintf(out, "speedup: %.2fx\n", uncached / cached);
+	fclose(out);
+	return 0;
+}
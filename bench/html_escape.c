@@ -0,0 +1,178 @@
+/*
+ * Microbenchmark for HTML escaping. Compares the character at a time
+ * loop escaping used to be with each of the versions html_escape
+ * picks between, on a title, on prose and on markup heavy text.
+ * Checks they all agree before timing anything.
+ * Usage: bench_html_escape [iterations]
+ */
+#define CCMS_NO_MAIN
+#include "../src/main.c"
+
+double elapsed_ns(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * How escaping worked before html_escape, a switch for every character
+ */
+size_t escape_per_character(char* out, const char* text, size_t length) {
+	size_t n = 0;
+	for (size_t i = 0; i < length; i++) {
+		const char* entity;
+		switch (text[i]) {
+		case '<':
+			entity = "&lt;";
+			break;
+		case '>':
+			entity = "&gt;";
+			break;
+		case '&':
+			entity = "&amp;";
+			break;
+		case '"':
+			entity = "&quot;";
+			break;
+		case '\'':
+			entity = "&#39;";
+			break;
+		default:
+			entity = NULL;
+		}
+		if (entity == NULL) {
+			out[n++] = text[i];
+		} else {
+			size_t l = strlen(entity);
+			memcpy(out + n, entity, l);
+			n += l;
+		}
+	}
+	return n;
+}
+
+typedef struct {
+	const char* name;
+	size_t (*escape)(char* out, const char* text, size_t length);
+	bool supported;
+} Escaper;
+
+typedef struct {
+	const char* name;
+	char* text;
+	size_t length;
+} Input;
+
+/*
+ * Repeats pattern until the text is length bytes long
+ */
+Input make_input(const char* name, const char* pattern, size_t length) {
+	Input input = {.name = name, .text = malloc(length + 1), .length = length};
+	size_t pattern_length = strlen(pattern);
+	for (size_t i = 0; i < length; i++) {
+		input.text[i] = pattern[i % pattern_length];
+	}
+	input.text[length] = 0;
+	return input;
+}
+
+/*
+ * Returns the average ns per call.
+ */
+double run(Escaper e, Input input, char* out, int iterations) {
+	struct timespec start, end;
+	size_t total = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < iterations; i++) {
+		total += e.escape(out, input.text, input.length);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	// Keep the calls from being optimised away
+	if (total == 0 && input.length > 0) {
+		printf("nothing escaped\n");
+	}
+	return elapsed_ns(start, end) / iterations;
+}
+
+int main(int argc, char** argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+	Escaper escapers[] = {
+		{"per character", escape_per_character, true},
+		{"scalar", html_escape_scalar, true},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", html_escape_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", html_escape_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	size_t escaper_count = sizeof(escapers) / sizeof(escapers[0]);
+	Input inputs[] = {
+		make_input("title", "Fish & Chips", 12),
+		make_input("prose", "The quick brown fox jumps over the lazy dog, "
+			"then rests for a while in the shade of an old oak tree. "
+			"It's \"tired\" & hungry. ", 4096),
+		make_input("markup", "<p class=\"x\">a &amp; b</p>", 4096),
+	};
+	size_t input_count = sizeof(inputs) / sizeof(inputs[0]);
+
+	size_t max_length = 0;
+	for (size_t i = 0; i < input_count; i++) {
+		if (inputs[i].length > max_length) {
+			max_length = inputs[i].length;
+		}
+	}
+	char* expected = malloc(max_length * HTML_ESCAPE_MAX_EXPANSION);
+	char* out = malloc(max_length * HTML_ESCAPE_MAX_EXPANSION);
+
+	// Every escaper must agree with the old loop on every length and
+	// starting offset, so the vector loops' tails are exercised too
+	int failures = 0;
+	for (size_t e = 1; e < escaper_count; e++) {
+		if (!escapers[e].supported) {
+			continue;
+		}
+		for (size_t i = 0; i < input_count; i++) {
+			for (size_t offset = 0; offset < 40 && offset < inputs[i].length; offset++) {
+				for (size_t length = 0; length + offset <= inputs[i].length && length < 100; length++) {
+					const char* text = inputs[i].text + offset;
+					size_t n = escape_per_character(expected, text, length);
+					size_t m = escapers[e].escape(out, text, length);
+					if (n != m || memcmp(expected, out, n) != 0) {
+						if (failures++ < 10) {
+							printf("%s differs on %s at %zu+%zu\n",
+								escapers[e].name, inputs[i].name, offset, length);
+						}
+					}
+				}
+			}
+		}
+	}
+	if (failures > 0) {
+		printf("%d mismatches\n", failures);
+		return 1;
+	}
+
+	for (size_t i = 0; i < input_count; i++) {
+		printf("%s, %zu bytes\n", inputs[i].name, inputs[i].length);
+		int n = inputs[i].length > 1024 ? iterations / 10 + 1 : iterations;
+		double baseline = 0;
+		for (size_t e = 0; e < escaper_count; e++) {
+			if (!escapers[e].supported) {
+				printf("  %-14s unsupported on this CPU\n", escapers[e].name);
+				continue;
+			}
+			// Warm up
+			run(escapers[e], inputs[i], out, n / 10 + 1);
+			double ns = run(escapers[e], inputs[i], out, n);
+			if (e == 0) {
+				baseline = ns;
+			}
+			printf("  %-14s %9.1f ns/op %8.0f MB/s %6.2fx\n",
+				escapers[e].name, ns, inputs[i].length / ns * 1e3, baseline / ns);
+		}
+	}
+
+	for (size_t i = 0; i < input_count; i++) {
+		free(inputs[i].text);
+	}
+	free(expected);
+	free(out);
+	return 0;
+}
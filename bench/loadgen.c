@@ -0,0 +1,529 @@
+/*
+ * HTTP load generator for benchmarking ccms.
+ * Each thread runs an epoll loop over its share of the keep-alive
+ * connections, each of which sends GET requests back to back,
+ * cycling through the paths given. After a warm up, latencies are
+ * recorded for the duration, and throughput and latency percentiles
+ * are printed as JSON, overall and for each path.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_PATHS 64
+#define READ_BUFFER_SIZE 65536
+
+// Sixteen buckets for every doubling of microseconds, so percentiles
+// are within about 6%, up to about 17 minutes
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (27 * LATENCY_SUB_BUCKETS)
+
+typedef struct _LoadgenConfig {
+	const char* host;
+	const char* port;
+	// Sent as the Host header, which selects the ccms server
+	const char* host_header;
+	const char* paths[MAX_PATHS];
+	int path_count;
+	int connections;
+	int threads;
+	int seconds;
+	int warmup_seconds;
+} LoadgenConfig;
+
+/*
+ * Latency histogram with log-linear buckets, by microseconds
+ */
+typedef struct _Latencies {
+	unsigned long counts[LATENCY_BUCKETS + 1];
+	unsigned long requests;
+	unsigned long errors;
+	double sum_us;
+	double max_us;
+} Latencies;
+
+typedef enum {
+	READING_HEADERS,
+	READING_BODY,
+	READING_CHUNK_SIZE,
+	READING_CHUNK,
+	READING_TRAILERS,
+} ResponseState;
+
+/*
+ * A keep-alive connection with at most one request in flight
+ */
+typedef struct _Client {
+	int fd;
+	// Which path the request in flight is for
+	int path;
+	struct timespec sent;
+	ResponseState state;
+	int status;
+	// Bytes of the body, or of the current chunk and its CRLF, still to come
+	size_t remaining;
+	bool close_after;
+	char buf[READ_BUFFER_SIZE];
+	size_t have;
+} Client;
+
+typedef struct _Worker {
+	pthread_t thread;
+	int first_client;
+	int client_count;
+	Latencies* latencies;
+} Worker;
+
+static LoadgenConfig config = {
+	.host = "127.0.0.1",
+	.port = "8000",
+	.host_header = "localhost:8000",
+	.path_count = 0,
+	.connections = 16,
+	.threads = 0,
+	.seconds = 5,
+	.warmup_seconds = 1,
+};
+
+static volatile bool stopping = false;
+static volatile bool recording = false;
+
+// Requests, one per path, formatted up front
+static char* requests[MAX_PATHS];
+static size_t request_lengths[MAX_PATHS];
+
+int latency_bucket(unsigned long us) {
+	if (us < LATENCY_SUB_BUCKETS) {
+		return us;
+	}
+	int octave = 63 - __builtin_clzl(us);
+	int bucket = (octave - 3) * LATENCY_SUB_BUCKETS + ((us >> (octave - 4)) & (LATENCY_SUB_BUCKETS - 1));
+	return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS;
+}
+
+/*
+ * The microseconds the values in a bucket are below
+ */
+double latency_bucket_limit(int bucket) {
+	if (bucket < LATENCY_SUB_BUCKETS) {
+		return bucket + 1;
+	}
+	if (bucket >= LATENCY_BUCKETS) {
+		return 1e18;
+	}
+	int octave = bucket / LATENCY_SUB_BUCKETS + 3;
+	return (double)((unsigned long)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1) << (octave - 4));
+}
+
+void latencies_record(Latencies* l, double us) {
+	l->counts[latency_bucket((unsigned long)us)]++;
+	l->requests++;
+	l->sum_us += us;
+	if (us > l->max_us) {
+		l->max_us = us;
+	}
+}
+
+void latencies_add(Latencies* to, const Latencies* from) {
+	for (int i = 0; i <= LATENCY_BUCKETS; i++) {
+		to->counts[i] += from->counts[i];
+	}
+	to->requests += from->requests;
+	to->errors += from->errors;
+	to->sum_us += from->sum_us;
+	if (from->max_us > to->max_us) {
+		to->max_us = from->max_us;
+	}
+}
+
+/*
+ * The latency that fraction of requests were faster than,
+ * as the upper end of its bucket
+ */
+double latencies_percentile(const Latencies* l, double fraction) {
+	unsigned long target = (unsigned long)(l->requests * fraction);
+	unsigned long seen = 0;
+	for (int i = 0; i <= LATENCY_BUCKETS; i++) {
+		seen += l->counts[i];
+		if (seen > target) {
+			double limit = latency_bucket_limit(i);
+			return limit < l->max_us ? limit : l->max_us;
+		}
+	}
+	return l->max_us;
+}
+
+double elapsed_us(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+int connect_to_server() {
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* addrs;
+	if (getaddrinfo(config.host, config.port, &hints, &addrs) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo* a = addrs; a != NULL && fd < 0; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+/*
+ * Sends the client's next request, connecting first if need be.
+ * Requests are small, so they're written in one go.
+ * Returns false if that failed.
+ */
+bool send_request(Client* c, int epoll_fd) {
+	if (c->fd < 0) {
+		c->fd = connect_to_server();
+		if (c->fd < 0) {
+			return false;
+		}
+		struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+	}
+	c->path = (c->path + 1) % config.path_count;
+	c->state = READING_HEADERS;
+	c->have = 0;
+	c->close_after = false;
+	clock_gettime(CLOCK_MONOTONIC, &c->sent);
+	ssize_t n = write(c->fd, requests[c->path], request_lengths[c->path]);
+	return n == (ssize_t)request_lengths[c->path];
+}
+
+void disconnect(Client* c) {
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+/*
+ * Finds the first occurrence of what in data, or returns NULL
+ */
+char* find(char* data, size_t length, const char* what) {
+	size_t what_length = strlen(what);
+	for (size_t i = 0; i + what_length <= length; i++) {
+		if (memcmp(data + i, what, what_length) == 0) {
+			return data + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Parses the status line and headers, from start to end
+ */
+void parse_headers(Client* c, char* start, char* end) {
+	*end = '\0';
+	c->status = atoi(start + 9);
+	c->state = READING_BODY;
+	c->remaining = 0;
+	for (char* h = strstr(start, "\r\n"); h != NULL; h = strstr(h + 2, "\r\n")) {
+		if (strncasecmp(h + 2, "Content-Length:", 15) == 0) {
+			c->remaining = strtoul(h + 17, NULL, 10);
+		} else if (strncasecmp(h + 2, "Transfer-Encoding: chunked", 26) == 0) {
+			c->state = READING_CHUNK_SIZE;
+		} else if (strncasecmp(h + 2, "Connection: close", 17) == 0) {
+			c->close_after = true;
+		}
+	}
+}
+
+/*
+ * Consumes as much of the response in the client's buffer as it can.
+ * Returns true once the whole response has been read.
+ */
+bool parse_response(Client* c) {
+	size_t used = 0;
+	bool done = false;
+	while (!done) {
+		char* data = c->buf + used;
+		size_t length = c->have - used;
+		if (c->state == READING_HEADERS) {
+			char* end = find(data, length, "\r\n\r\n");
+			if (end == NULL) {
+				break;
+			}
+			used += end + 4 - data;
+			parse_headers(c, data, end);
+			done = c->state == READING_BODY && c->remaining == 0;
+		} else if (c->state == READING_CHUNK_SIZE || c->state == READING_TRAILERS) {
+			char* end = find(data, length, "\r\n");
+			if (end == NULL) {
+				break;
+			}
+			used += end + 2 - data;
+			if (c->state == READING_TRAILERS) {
+				// Until the blank line
+				done = end == data;
+			} else {
+				size_t size = strtoul(data, NULL, 16);
+				c->state = size == 0 ? READING_TRAILERS : READING_CHUNK;
+				// The chunk is followed by a CRLF
+				c->remaining = size + 2;
+			}
+		} else {
+			size_t n = length < c->remaining ? length : c->remaining;
+			used += n;
+			c->remaining -= n;
+			if (c->remaining > 0) {
+				break;
+			}
+			if (c->state == READING_BODY) {
+				done = true;
+			} else {
+				c->state = READING_CHUNK_SIZE;
+			}
+		}
+	}
+	memmove(c->buf, c->buf + used, c->have - used);
+	c->have -= used;
+	return done;
+}
+
+void* run_worker(void* arg) {
+	Worker* w = arg;
+	int epoll_fd = epoll_create1(0);
+	Client* clients = calloc(w->client_count, sizeof(Client));
+	for (int i = 0; i < w->client_count; i++) {
+		clients[i].fd = -1;
+		// Spread the connections over the paths
+		clients[i].path = (w->first_client + i) % config.path_count;
+		if (!send_request(&clients[i], epoll_fd)) {
+			disconnect(&clients[i]);
+		}
+	}
+	struct epoll_event events[64];
+	while (!stopping) {
+		int n = epoll_wait(epoll_fd, events, 64, 100);
+		for (int i = 0; i < n; i++) {
+			Client* c = events[i].data.ptr;
+			ssize_t r = read(c->fd, c->buf + c->have, sizeof(c->buf) - c->have);
+			if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+				continue;
+			}
+			bool failed = r <= 0;
+			bool done = false;
+			if (!failed) {
+				c->have += r;
+				done = parse_response(c);
+				// A header block that doesn't fit isn't something ccms sends
+				failed = !done && c->have == sizeof(c->buf);
+			}
+			if (done || failed) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (recording) {
+					Latencies* l = &w->latencies[c->path];
+					if (failed || c->status >= 400) {
+						l->errors++;
+					} else {
+						latencies_record(l, elapsed_us(c->sent, now));
+					}
+				}
+				if (failed || c->close_after) {
+					disconnect(c);
+				}
+				if (!send_request(c, epoll_fd)) {
+					disconnect(c);
+				}
+			}
+		}
+		// Retry any connections that failed
+		for (int i = 0; i < w->client_count; i++) {
+			if (clients[i].fd < 0 && !stopping) {
+				if (recording) {
+					w->latencies[clients[i].path].errors++;
+				}
+				if (!send_request(&clients[i], epoll_fd)) {
+					disconnect(&clients[i]);
+				}
+			}
+		}
+	}
+	for (int i = 0; i < w->client_count; i++) {
+		disconnect(&clients[i]);
+	}
+	free(clients);
+	close(epoll_fd);
+	return NULL;
+}
+
+void print_latencies(const Latencies* l) {
+	printf("\"requests\": %lu, \"errors\": %lu, \"rps\": %.1f, "
+			"\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p95\": %.1f, "
+			"\"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}",
+			l->requests,
+			l->errors,
+			(double)l->requests / config.seconds,
+			l->requests > 0 ? l->sum_us / l->requests : 0,
+			latencies_percentile(l, 0.5),
+			latencies_percentile(l, 0.95),
+			latencies_percentile(l, 0.99),
+			latencies_percentile(l, 0.999),
+			l->max_us);
+}
+
+void usage(const char* program) {
+	fprintf(stderr, "Usage: %s [options]\n"
+			"  -a <address>  server address (default %s)\n"
+			"  -p <port>     server port (default %s)\n"
+			"  -H <host>     Host header (default %s)\n"
+			"  -u <path>     path to request, can be given more than once\n"
+			"                to cycle through several (default /)\n"
+			"  -c <n>        connections (default %d)\n"
+			"  -t <n>        threads, 0 for one per CPU (default %d)\n"
+			"  -d <seconds>  duration (default %d)\n"
+			"  -w <seconds>  warm up before recording (default %d)\n",
+			program,
+			config.host,
+			config.port,
+			config.host_header,
+			config.connections,
+			config.threads,
+			config.seconds,
+			config.warmup_seconds);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:H:u:c:t:d:w:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			config.host = optarg;
+			break;
+		case 'p':
+			config.port = optarg;
+			break;
+		case 'H':
+			config.host_header = optarg;
+			break;
+		case 'u':
+			if (config.path_count == MAX_PATHS) {
+				fprintf(stderr, "At most %d paths\n", MAX_PATHS);
+				return 1;
+			}
+			config.paths[config.path_count++] = optarg;
+			break;
+		case 'c':
+			config.connections = atoi(optarg);
+			break;
+		case 't':
+			config.threads = atoi(optarg);
+			break;
+		case 'd':
+			config.seconds = atoi(optarg);
+			break;
+		case 'w':
+			config.warmup_seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (config.path_count == 0) {
+		config.paths[config.path_count++] = "/";
+	}
+	if (config.threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		config.threads = cpus > 0 ? cpus : 1;
+	}
+	if (config.threads > config.connections) {
+		config.threads = config.connections;
+	}
+	for (int i = 0; i < config.path_count; i++) {
+		char request[1024];
+		request_lengths[i] = snprintf(request, sizeof(request),
+				"GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", config.paths[i], config.host_header);
+		requests[i] = malloc(request_lengths[i] + 1);
+		memcpy(requests[i], request, request_lengths[i] + 1);
+	}
+
+	// Give the server a few seconds to start listening
+	int probe = -1;
+	for (int i = 0; i < 50 && probe < 0; i++) {
+		probe = connect_to_server();
+		if (probe < 0) {
+			struct timespec wait = {.tv_sec = 0, .tv_nsec = 100000000};
+			nanosleep(&wait, NULL);
+		}
+	}
+	if (probe < 0) {
+		fprintf(stderr, "Couldn't connect to %s:%s\n", config.host, config.port);
+		return 1;
+	}
+	close(probe);
+
+	Worker* workers = calloc(config.threads, sizeof(Worker));
+	int first_client = 0;
+	for (int i = 0; i < config.threads; i++) {
+		workers[i].first_client = first_client;
+		workers[i].client_count = config.connections / config.threads
+			+ (i < config.connections % config.threads ? 1 : 0);
+		workers[i].latencies = calloc(config.path_count, sizeof(Latencies));
+		first_client += workers[i].client_count;
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+	sleep(config.warmup_seconds);
+	recording = true;
+	sleep(config.seconds);
+	recording = false;
+	stopping = true;
+
+	Latencies* by_path = calloc(config.path_count, sizeof(Latencies));
+	Latencies* total = calloc(1, sizeof(Latencies));
+	for (int i = 0; i < config.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		for (int p = 0; p < config.path_count; p++) {
+			latencies_add(&by_path[p], &workers[i].latencies[p]);
+			latencies_add(total, &workers[i].latencies[p]);
+		}
+		free(workers[i].latencies);
+	}
+	printf("{\"connections\": %d, \"threads\": %d, \"seconds\": %d, ",
+			config.connections,
+			config.threads,
+			config.seconds);
+	print_latencies(total);
+	printf(", \"paths\": [");
+	for (int p = 0; p < config.path_count; p++) {
+		printf("%s{\"path\": \"%s\", ", p > 0 ? ", " : "", config.paths[p]);
+		print_latencies(&by_path[p]);
+		printf("}");
+	}
+	printf("]}\n");
+	for (int i = 0; i < config.path_count; i++) {
+		free(requests[i]);
+	}
+	free(by_path);
+	free(total);
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * Compares benchmark results against a baseline, and fails if any
+ * metric has got worse by more than its threshold.
+ *
+ * Results are JSON objects of numbers, nested to any depth, which are
+ * compared by their dotted paths, e.g. stages.find_page_data.ns_per_op.
+ * Arrays are skipped. The baseline holds the results it was made from,
+ * and the thresholds:
+ *
+ *   {"thresholds": {"default": 0.1, "ns_per_op": 0.15,
+ *                   "stages.markdown_1k.ns_per_op": 0.25},
+ *    "results": {...}}
+ *
+ * A threshold is the fraction a metric may get worse by, and is looked
+ * up by the metric's full path, then by shorter and shorter endings of
+ * it (find_page_data.ns_per_op, then ns_per_op), then "default". A
+ * null threshold leaves the metric out. Lower is better except for
+ * metrics named in higher_is_better below.
+ * A metric that has a threshold but is only in the baseline or only in
+ * the results fails the check too, as it can't be compared: either a
+ * benchmark didn't run, or the baseline was recorded before it existed
+ * and needs recording again.
+ *
+ * A baseline without results, such as the one checked in, which only
+ * sets thresholds, can't be checked against until they're recorded.
+ *
+ * Usage: perf_check [-u] <baseline.json> <results.json>
+ * With -u, the baseline's results are replaced with these ones instead,
+ * keeping its thresholds.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#define DG_DYNARR_IMPLEMENTATION
+#include <DG_dynarr.h>
+#include <json-c/json.h>
+
+typedef struct {
+	char* key;
+	double value;
+} Metric;
+
+DA_TYPEDEF(Metric, Metrics);
+
+static const char* higher_is_better[] = {
+	"rps",
+};
+
+// Allowed whatever the threshold, so allocation counts that were
+// averaged over the runs don't fail on rounding
+#define ABSOLUTE_SLACK 0.01
+
+/*
+ * Adds every number in a JSON object to metrics, keyed by its path
+ */
+void flatten(struct json_object* o, const char* prefix, Metrics* metrics) {
+	json_object_object_foreach(o, key, value) {
+		size_t length = strlen(prefix) + strlen(key) + 2;
+		char* path = malloc(length);
+		snprintf(path, length, "%s%s%s", prefix, prefix[0] != '\0' ? "." : "", key);
+		if (json_object_is_type(value, json_type_object)) {
+			flatten(value, path, metrics);
+			free(path);
+		} else if (json_object_is_type(value, json_type_double)
+				|| json_object_is_type(value, json_type_int)) {
+			Metric m = {
+				.key = path,
+				.value = json_object_get_double(value),
+			};
+			da_push(*metrics, m);
+		} else {
+			free(path);
+		}
+	}
+}
+
+void free_metrics(Metrics metrics) {
+	for (int i = 0; i < da_count(metrics); i++) {
+		free(da_get(metrics, i).key);
+	}
+	da_free(metrics);
+}
+
+Metric* find_metric(Metrics metrics, const char* key) {
+	for (int i = 0; i < da_count(metrics); i++) {
+		if (strcmp(da_get(metrics, i).key, key) == 0) {
+			return da_getptr(metrics, i);
+		}
+	}
+	return NULL;
+}
+
+const char* last_element(const char* key) {
+	const char* dot = strrchr(key, '.');
+	return dot == NULL ? key : dot + 1;
+}
+
+/*
+ * Finds the threshold for a metric. Returns false if it's to be left out.
+ */
+bool find_threshold(struct json_object* thresholds, const char* key, double* threshold) {
+	struct json_object* t;
+	const char* ending = key;
+	while (ending != NULL) {
+		if (json_object_object_get_ex(thresholds, ending, &t)) {
+			*threshold = json_object_get_double(t);
+			return t != NULL;
+		}
+		ending = strchr(ending, '.');
+		if (ending != NULL) {
+			ending++;
+		}
+	}
+	*threshold = json_object_object_get_ex(thresholds, "default", &t) ? json_object_get_double(t) : 0.1;
+	return true;
+}
+
+bool is_higher_better(const char* key) {
+	for (size_t i = 0; i < sizeof(higher_is_better) / sizeof(higher_is_better[0]); i++) {
+		if (strcmp(last_element(key), higher_is_better[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+struct json_object* read_json(const char* path) {
+	struct json_object* o = json_object_from_file(path);
+	if (o == NULL || !json_object_is_type(o, json_type_object)) {
+		fprintf(stderr, "Couldn't read %s: %s\n", path, json_util_get_last_err());
+		exit(2);
+	}
+	return o;
+}
+
+/*
+ * Prints a row for each metric and returns the number that regressed.
+ * Counts those that couldn't be compared in unchecked.
+ */
+int compare(Metrics baseline, Metrics current, struct json_object* thresholds, int* unchecked) {
+	int regressions = 0;
+	printf("%-52s %12s %12s %9s %7s\n", "metric", "baseline", "current", "change", "limit");
+	for (int i = 0; i < da_count(current); i++) {
+		Metric c = da_get(current, i);
+		double limit;
+		if (!find_threshold(thresholds, c.key, &limit)) {
+			continue;
+		}
+		Metric* b = find_metric(baseline, c.key);
+		if (b == NULL) {
+			printf("%-52s %12s %12.2f %9s %7s  NO BASELINE\n", c.key, "-", c.value, "", "");
+			(*unchecked)++;
+			continue;
+		}
+		bool higher_better = is_higher_better(c.key);
+		// Positive is worse
+		double worse_by = higher_better ? b->value - c.value : c.value - b->value;
+		double change = b->value != 0 ? (c.value - b->value) / b->value : 0;
+		bool regressed = worse_by > ABSOLUTE_SLACK
+			&& (b->value == 0 || worse_by / fabs(b->value) > limit);
+		char change_text[16] = "";
+		if (b->value != 0) {
+			snprintf(change_text, sizeof(change_text), "%+.1f%%", change * 100);
+		}
+		char limit_text[16];
+		snprintf(limit_text, sizeof(limit_text), "%c%.0f%%", higher_better ? '-' : '+', limit * 100);
+		printf("%-52s %12.2f %12.2f %9s %7s  %s\n",
+			c.key, b->value, c.value, change_text, limit_text,
+			regressed ? "REGRESSED" : "ok");
+		if (regressed) {
+			regressions++;
+		}
+	}
+	for (int i = 0; i < da_count(baseline); i++) {
+		Metric b = da_get(baseline, i);
+		double limit;
+		if (find_threshold(thresholds, b.key, &limit) && find_metric(current, b.key) == NULL) {
+			printf("%-52s %12.2f %12s %9s %7s  MISSING\n", b.key, b.value, "-", "", "");
+			(*unchecked)++;
+		}
+	}
+	return regressions;
+}
+
+void perf_check_usage(const char* program) {
+	fprintf(stderr, "Usage: %s [-u] <baseline.json> <results.json>\n", program);
+}
+
+int main(int argc, char** argv) {
+	bool update = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "uh")) != -1) {
+		switch (opt) {
+		case 'u':
+			update = true;
+			break;
+		default:
+			perf_check_usage(argv[0]);
+			return 2;
+		}
+	}
+	if (argc - optind != 2) {
+		perf_check_usage(argv[0]);
+		return 2;
+	}
+	const char* baseline_path = argv[optind];
+	struct json_object* baseline = read_json(baseline_path);
+	struct json_object* results = read_json(argv[optind + 1]);
+
+	if (update) {
+		json_object_object_add(baseline, "results", json_object_get(results));
+		if (json_object_to_file_ext(baseline_path, baseline, JSON_C_TO_STRING_PRETTY) != 0) {
+			fprintf(stderr, "Couldn't write %s: %s\n", baseline_path, json_util_get_last_err());
+			return 2;
+		}
+		printf("Updated %s\n", baseline_path);
+		json_object_put(baseline);
+		json_object_put(results);
+		return 0;
+	}
+
+	struct json_object* thresholds = NULL;
+	json_object_object_get_ex(baseline, "thresholds", &thresholds);
+	struct json_object* baseline_results = NULL;
+	if (!json_object_object_get_ex(baseline, "results", &baseline_results)
+			|| baseline_results == NULL) {
+		fprintf(stderr, "%s has no results to compare with yet, record them on this machine "
+				"with make perf-baseline first\n", baseline_path);
+		json_object_put(baseline);
+		json_object_put(results);
+		return 2;
+	}
+	Metrics baseline_metrics = {0};
+	Metrics current_metrics = {0};
+	flatten(baseline_results, "", &baseline_metrics);
+	flatten(results, "", &current_metrics);
+
+	int unchecked = 0;
+	int regressions = compare(baseline_metrics, current_metrics, thresholds, &unchecked);
+	if (regressions > 0 || unchecked > 0) {
+		printf("\n"
+			"****************************************************************\n");
+		if (regressions > 0) {
+			printf("  PERFORMANCE CHECK FAILED: %d metric%s regressed beyond %s threshold\n",
+				regressions, regressions == 1 ? "" : "s", regressions == 1 ? "its" : "their");
+		}
+		if (unchecked > 0) {
+			printf("  PERFORMANCE CHECK FAILED: %d metric%s couldn't be compared, record\n"
+				"  the baseline again with make perf-baseline if that's expected\n",
+				unchecked, unchecked == 1 ? "" : "s");
+		}
+		printf("****************************************************************\n");
+	} else {
+		printf("\nPerformance check passed\n");
+	}
+	free_metrics(baseline_metrics);
+	free_metrics(current_metrics);
+	json_object_put(baseline);
+	json_object_put(results);
+	return regressions > 0 || unchecked > 0 ? 1 : 0;
+}
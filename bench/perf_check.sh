@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs the stage microbenchmarks and the end to end benchmark on its
+# fixed corpus, and compares the results against bench/baseline.json,
+# failing with a table of what got worse if anything got worse by more
+# than its threshold. Everything runs locally, over loopback.
+# Usage: bench/perf_check.sh [-u]
+# With -u, records the results as the new baseline instead. Set
+# BASELINE to compare against another file, and SECONDS_TO_RUN to
+# change how long the end to end benchmark runs.
+set -e
+
+BASELINE=${BASELINE:-bench/baseline.json}
+SECONDS_TO_RUN=${SECONDS_TO_RUN:-10}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+echo "Running stage benchmarks..." >&2
+bin/bench_stages -j -r 7 > "$DIR/stages.json"
+echo "Running end to end benchmark for ${SECONDS_TO_RUN}s..." >&2
+OUT="$DIR/end_to_end.json" sh bench/bench.sh "$SECONDS_TO_RUN" > /dev/null
+
+printf '{"stages": %s, "end_to_end": %s}\n' \
+	"$(cat "$DIR/stages.json")" "$(cat "$DIR/end_to_end.json")" > "$DIR/results.json"
+bin/perf_check $1 "$BASELINE" "$DIR/results.json"
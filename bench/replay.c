@@ -0,0 +1,684 @@
+/*
+ * Replays requests captured with ccms -C against a server, at the rate
+ * they arrived, or faster or slower, and reports latency percentiles
+ * as JSON, overall and for each route.
+ * Each connection has its own thread and sends the next request due,
+ * waiting until it's due. Latency is measured from when a request was
+ * due rather than when it was sent, so a server that falls behind
+ * shows up as slower rather than as fewer requests being sent.
+ * Request bodies aren't captured, so only GET and HEAD requests are
+ * replayed.
+ * Usage: replay [options] <capture>
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CAPTURE_MAGIC "CCMSCAP1"
+#define READ_BUFFER_SIZE 65536
+#define MAX_ROUTES 64
+
+// Sixteen buckets for every doubling of microseconds, so percentiles
+// are within about 6%, up to about 17 minutes
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (27 * LATENCY_SUB_BUCKETS)
+
+typedef struct _ReplayConfig {
+	const char* host;
+	const char* port;
+	// Replaces the captured Host headers, if set
+	const char* host_header;
+	int connections;
+	// 1 for the rate requests were captured at, 2 for twice that,
+	// 0 for as fast as the connections allow
+	double speed;
+} ReplayConfig;
+
+/*
+ * Latency histogram with log-linear buckets, by microseconds
+ */
+typedef struct _Latencies {
+	unsigned long counts[LATENCY_BUCKETS + 1];
+	unsigned long requests;
+	unsigned long errors;
+	// Responses with a different status to the one captured
+	unsigned long changed_status;
+	double sum_us;
+	double max_us;
+} Latencies;
+
+/*
+ * A captured request, formatted ready to send
+ */
+typedef struct _Request {
+	unsigned long long arrival_us;
+	int route;
+	int status;
+	bool head;
+	char* text;
+	size_t length;
+} Request;
+
+typedef enum {
+	READING_HEADERS,
+	READING_BODY,
+	READING_CHUNK_SIZE,
+	READING_CHUNK,
+	READING_TRAILERS,
+} ResponseState;
+
+/*
+ * A keep-alive connection, and the response being read from it
+ */
+typedef struct _Client {
+	int fd;
+	bool head;
+	ResponseState state;
+	int status;
+	// Bytes of the body, or of the current chunk and its CRLF, still to come
+	size_t remaining;
+	bool close_after;
+	char buf[READ_BUFFER_SIZE];
+	size_t have;
+} Client;
+
+typedef struct _Worker {
+	pthread_t thread;
+	// By route
+	Latencies* latencies;
+} Worker;
+
+static ReplayConfig config = {
+	.host = "127.0.0.1",
+	.port = "8000",
+	.host_header = NULL,
+	.connections = 16,
+	.speed = 1,
+};
+
+static char* route_names[MAX_ROUTES];
+static int route_count;
+static Request* requests;
+static size_t request_count;
+static unsigned long skipped;
+// The next request to send, shared by the workers
+static size_t next_request;
+static struct timespec started;
+
+///////////// Capture /////////////////
+
+/*
+ * Reads captured data, checking there's enough of it left
+ */
+typedef struct _Reader {
+	const unsigned char* data;
+	size_t length;
+	size_t position;
+	bool failed;
+} Reader;
+
+unsigned long long read_number(Reader* r, int bytes) {
+	unsigned long long value = 0;
+	if (r->position + bytes > r->length) {
+		r->failed = true;
+		return 0;
+	}
+	for (int i = 0; i < bytes; i++) {
+		value |= (unsigned long long)r->data[r->position++] << (8 * i);
+	}
+	return value;
+}
+
+/*
+ * Returns a copy of the next string
+ */
+char* read_string(Reader* r) {
+	size_t n = read_number(r, 2);
+	if (r->failed || r->position + n > r->length) {
+		r->failed = true;
+		return NULL;
+	}
+	char* s = malloc(n + 1);
+	memcpy(s, r->data + r->position, n);
+	s[n] = '\0';
+	r->position += n;
+	return s;
+}
+
+/*
+ * Appends to a request being formatted, growing it as needed
+ */
+void append(Request* req, size_t* capacity, const char* a, const char* b, const char* c) {
+	size_t n = strlen(a) + strlen(b) + strlen(c);
+	if (req->length + n + 1 > *capacity) {
+		*capacity = (req->length + n + 1) * 2;
+		req->text = realloc(req->text, *capacity);
+	}
+	memcpy(req->text + req->length, a, strlen(a));
+	req->length += strlen(a);
+	memcpy(req->text + req->length, b, strlen(b));
+	req->length += strlen(b);
+	memcpy(req->text + req->length, c, strlen(c));
+	req->length += strlen(c);
+	req->text[req->length] = '\0';
+}
+
+/*
+ * Reads one request from the capture, see log_capture in ccms.
+ * Returns false if it's not to be replayed.
+ */
+bool read_request(Reader* r, Request* req) {
+	size_t length = read_number(r, 2);
+	size_t end = r->position + length;
+	req->arrival_us = read_number(r, 8);
+	read_number(r, 4);
+	req->status = read_number(r, 2);
+	req->route = read_number(r, 1);
+	int header_count = read_number(r, 1);
+	char* method = read_string(r);
+	char* host = read_string(r);
+	char* path = read_string(r);
+	req->text = NULL;
+	req->length = 0;
+	bool replayed = !r->failed && req->route < route_count
+		&& (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0);
+	size_t capacity = 0;
+	if (replayed) {
+		req->head = strcmp(method, "HEAD") == 0;
+		append(req, &capacity, method, " ", path);
+		append(req, &capacity, " HTTP/1.1\r\nHost: ",
+			config.host_header != NULL ? config.host_header : host, "\r\n");
+	}
+	for (int i = 0; i < header_count; i++) {
+		char* name = read_string(r);
+		char* value = read_string(r);
+		if (replayed && !r->failed) {
+			append(req, &capacity, name, ": ", value);
+			append(req, &capacity, "\r\n", "", "");
+		}
+		free(name);
+		free(value);
+	}
+	if (replayed) {
+		append(req, &capacity, "\r\n", "", "");
+	}
+	free(method);
+	free(host);
+	free(path);
+	// Skip anything added to the record after what's read above
+	r->position = end;
+	if (r->failed || !replayed) {
+		free(req->text);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Reads the capture file into requests
+ */
+bool read_capture(const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return false;
+	}
+	size_t capacity = 1 << 20;
+	unsigned char* data = malloc(capacity);
+	size_t length = 0;
+	size_t n;
+	while ((n = fread(data + length, 1, capacity - length, f)) > 0) {
+		length += n;
+		if (length == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+	}
+	fclose(f);
+	Reader r = {.data = data, .length = length, .position = 0, .failed = false};
+	if (length < strlen(CAPTURE_MAGIC) || memcmp(data, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+		fprintf(stderr, "%s isn't a ccms capture\n", path);
+		free(data);
+		return false;
+	}
+	r.position = strlen(CAPTURE_MAGIC);
+	read_number(&r, 8);
+	route_count = read_number(&r, 1);
+	for (int i = 0; i < route_count && i < MAX_ROUTES; i++) {
+		route_names[i] = read_string(&r);
+	}
+	if (r.failed || route_count > MAX_ROUTES) {
+		fprintf(stderr, "%s is damaged\n", path);
+		free(data);
+		return false;
+	}
+	size_t request_capacity = 1024;
+	requests = malloc(sizeof(Request) * request_capacity);
+	// A request cut short by the server stopping is left out
+	while (r.position < r.length && !r.failed) {
+		if (request_count == request_capacity) {
+			request_capacity *= 2;
+			requests = realloc(requests, sizeof(Request) * request_capacity);
+		}
+		if (read_request(&r, &requests[request_count])) {
+			request_count++;
+		} else if (!r.failed) {
+			skipped++;
+		}
+	}
+	free(data);
+	return true;
+}
+
+///////////// Latencies /////////////////
+
+int latency_bucket(unsigned long us) {
+	if (us < LATENCY_SUB_BUCKETS) {
+		return us;
+	}
+	int octave = 63 - __builtin_clzl(us);
+	int bucket = (octave - 3) * LATENCY_SUB_BUCKETS + ((us >> (octave - 4)) & (LATENCY_SUB_BUCKETS - 1));
+	return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS;
+}
+
+/*
+ * The microseconds the values in a bucket are below
+ */
+double latency_bucket_limit(int bucket) {
+	if (bucket < LATENCY_SUB_BUCKETS) {
+		return bucket + 1;
+	}
+	if (bucket >= LATENCY_BUCKETS) {
+		return 1e18;
+	}
+	int octave = bucket / LATENCY_SUB_BUCKETS + 3;
+	return (double)((unsigned long)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1) << (octave - 4));
+}
+
+void latencies_record(Latencies* l, double us) {
+	l->counts[latency_bucket((unsigned long)us)]++;
+	l->requests++;
+	l->sum_us += us;
+	if (us > l->max_us) {
+		l->max_us = us;
+	}
+}
+
+void latencies_add(Latencies* to, const Latencies* from) {
+	for (int i = 0; i <= LATENCY_BUCKETS; i++) {
+		to->counts[i] += from->counts[i];
+	}
+	to->requests += from->requests;
+	to->errors += from->errors;
+	to->changed_status += from->changed_status;
+	to->sum_us += from->sum_us;
+	if (from->max_us > to->max_us) {
+		to->max_us = from->max_us;
+	}
+}
+
+/*
+ * The latency that fraction of requests were faster than,
+ * as the upper end of its bucket
+ */
+double latencies_percentile(const Latencies* l, double fraction) {
+	unsigned long target = (unsigned long)(l->requests * fraction);
+	unsigned long seen = 0;
+	for (int i = 0; i <= LATENCY_BUCKETS; i++) {
+		seen += l->counts[i];
+		if (seen > target) {
+			double limit = latency_bucket_limit(i);
+			return limit < l->max_us ? limit : l->max_us;
+		}
+	}
+	return l->max_us;
+}
+
+double elapsed_us(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+///////////// Connections /////////////////
+
+int connect_to_server() {
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* addrs;
+	if (getaddrinfo(config.host, config.port, &hints, &addrs) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo* a = addrs; a != NULL && fd < 0; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+void disconnect(Client* c) {
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+/*
+ * Finds the first occurrence of what in data, or returns NULL
+ */
+char* find(char* data, size_t length, const char* what) {
+	size_t what_length = strlen(what);
+	for (size_t i = 0; i + what_length <= length; i++) {
+		if (memcmp(data + i, what, what_length) == 0) {
+			return data + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Parses the status line and headers, from start to end
+ */
+void parse_headers(Client* c, char* start, char* end) {
+	*end = '\0';
+	c->status = atoi(start + 9);
+	c->state = READING_BODY;
+	c->remaining = 0;
+	for (char* h = strstr(start, "\r\n"); h != NULL; h = strstr(h + 2, "\r\n")) {
+		if (strncasecmp(h + 2, "Content-Length:", 15) == 0) {
+			c->remaining = strtoul(h + 17, NULL, 10);
+		} else if (strncasecmp(h + 2, "Transfer-Encoding: chunked", 26) == 0) {
+			c->state = READING_CHUNK_SIZE;
+		} else if (strncasecmp(h + 2, "Connection: close", 17) == 0) {
+			c->close_after = true;
+		}
+	}
+	// No body follows, whatever the headers say
+	if (c->head || c->status == 304 || c->status == 204) {
+		c->state = READING_BODY;
+		c->remaining = 0;
+	}
+}
+
+/*
+ * Consumes as much of the response in the client's buffer as it can.
+ * Returns true once the whole response has been read.
+ */
+bool parse_response(Client* c) {
+	size_t used = 0;
+	bool done = false;
+	while (!done) {
+		char* data = c->buf + used;
+		size_t length = c->have - used;
+		if (c->state == READING_HEADERS) {
+			char* end = find(data, length, "\r\n\r\n");
+			if (end == NULL) {
+				break;
+			}
+			used += end + 4 - data;
+			parse_headers(c, data, end);
+			done = c->state == READING_BODY && c->remaining == 0;
+		} else if (c->state == READING_CHUNK_SIZE || c->state == READING_TRAILERS) {
+			char* end = find(data, length, "\r\n");
+			if (end == NULL) {
+				break;
+			}
+			used += end + 2 - data;
+			if (c->state == READING_TRAILERS) {
+				// Until the blank line
+				done = end == data;
+			} else {
+				size_t size = strtoul(data, NULL, 16);
+				c->state = size == 0 ? READING_TRAILERS : READING_CHUNK;
+				// The chunk is followed by a CRLF
+				c->remaining = size + 2;
+			}
+		} else {
+			size_t n = length < c->remaining ? length : c->remaining;
+			used += n;
+			c->remaining -= n;
+			if (c->remaining > 0) {
+				break;
+			}
+			if (c->state == READING_BODY) {
+				done = true;
+			} else {
+				c->state = READING_CHUNK_SIZE;
+			}
+		}
+	}
+	memmove(c->buf, c->buf + used, c->have - used);
+	c->have -= used;
+	return done;
+}
+
+/*
+ * Sends a request and reads the whole response, connecting first if
+ * need be. Returns false if that failed.
+ */
+bool exchange(Client* c, const Request* req) {
+	if (c->fd < 0) {
+		c->fd = connect_to_server();
+		if (c->fd < 0) {
+			return false;
+		}
+	}
+	c->head = req->head;
+	c->state = READING_HEADERS;
+	c->have = 0;
+	c->close_after = false;
+	if (write(c->fd, req->text, req->length) != (ssize_t)req->length) {
+		return false;
+	}
+	for (;;) {
+		ssize_t n = read(c->fd, c->buf + c->have, sizeof(c->buf) - c->have);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		c->have += n;
+		if (parse_response(c)) {
+			return true;
+		}
+		// A header block that doesn't fit isn't something ccms sends
+		if (c->have == sizeof(c->buf)) {
+			return false;
+		}
+	}
+}
+
+/*
+ * When a request is due, relative to the replay starting
+ */
+struct timespec due(const Request* req) {
+	unsigned long long us = req->arrival_us / config.speed;
+	struct timespec t = started;
+	t.tv_sec += us / 1000000;
+	t.tv_nsec += (us % 1000000) * 1000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+	return t;
+}
+
+void* run_worker(void* arg) {
+	Worker* w = arg;
+	Client* c = calloc(1, sizeof(Client));
+	c->fd = -1;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED);
+		if (i >= request_count) {
+			break;
+		}
+		const Request* req = &requests[i];
+		struct timespec from;
+		if (config.speed > 0) {
+			from = due(req);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &from, NULL) == EINTR) {
+			}
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &from);
+		}
+		bool ok = exchange(c, req);
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		Latencies* l = &w->latencies[req->route];
+		if (!ok || c->status >= 500) {
+			l->errors++;
+		} else {
+			latencies_record(l, elapsed_us(from, now));
+			if (c->status != req->status) {
+				l->changed_status++;
+			}
+		}
+		if (!ok || c->close_after) {
+			disconnect(c);
+		}
+	}
+	disconnect(c);
+	free(c);
+	return NULL;
+}
+
+///////////// Main /////////////////
+
+void print_latencies(const Latencies* l, double seconds) {
+	printf("\"requests\": %lu, \"errors\": %lu, \"changed_status\": %lu, \"rps\": %.1f, "
+			"\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p95\": %.1f, "
+			"\"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}",
+			l->requests,
+			l->errors,
+			l->changed_status,
+			seconds > 0 ? l->requests / seconds : 0,
+			l->requests > 0 ? l->sum_us / l->requests : 0,
+			latencies_percentile(l, 0.5),
+			latencies_percentile(l, 0.95),
+			latencies_percentile(l, 0.99),
+			latencies_percentile(l, 0.999),
+			l->max_us);
+}
+
+void usage(const char* program) {
+	fprintf(stderr, "Usage: %s [options] <capture>\n"
+			"  -a <address>  server address (default %s)\n"
+			"  -p <port>     server port (default %s)\n"
+			"  -H <host>     send this Host header instead of the captured ones\n"
+			"  -c <n>        connections (default %d)\n"
+			"  -s <speed>    rate relative to the capture, e.g. 2 for twice as fast,\n"
+			"                0 for as fast as the connections allow (default 1)\n",
+			program,
+			config.host,
+			config.port,
+			config.connections);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:H:c:s:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			config.host = optarg;
+			break;
+		case 'p':
+			config.port = optarg;
+			break;
+		case 'H':
+			config.host_header = optarg;
+			break;
+		case 'c':
+			config.connections = atoi(optarg);
+			break;
+		case 's':
+			config.speed = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || config.connections < 1 || config.speed < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!read_capture(argv[optind])) {
+		return 1;
+	}
+	if (request_count == 0) {
+		fprintf(stderr, "Nothing to replay\n");
+		return 1;
+	}
+
+	Worker* workers = calloc(config.connections, sizeof(Worker));
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	for (int i = 0; i < config.connections; i++) {
+		workers[i].latencies = calloc(route_count, sizeof(Latencies));
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+	Latencies* by_route = calloc(route_count, sizeof(Latencies));
+	Latencies* total = calloc(1, sizeof(Latencies));
+	for (int i = 0; i < config.connections; i++) {
+		pthread_join(workers[i].thread, NULL);
+		for (int r = 0; r < route_count; r++) {
+			latencies_add(&by_route[r], &workers[i].latencies[r]);
+			latencies_add(total, &workers[i].latencies[r]);
+		}
+		free(workers[i].latencies);
+	}
+	struct timespec finished;
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	double seconds = elapsed_us(started, finished) / 1e6;
+
+	printf("{\"connections\": %d, \"speed\": %g, \"seconds\": %.2f, \"skipped\": %lu, ",
+			config.connections,
+			config.speed,
+			seconds,
+			skipped);
+	print_latencies(total, seconds);
+	printf(", \"routes\": [");
+	bool first = true;
+	for (int r = 0; r < route_count; r++) {
+		if (by_route[r].requests + by_route[r].errors == 0) {
+			continue;
+		}
+		printf("%s{\"route\": \"%s\", ", first ? "" : ", ", route_names[r]);
+		print_latencies(&by_route[r], seconds);
+		printf("}");
+		first = false;
+	}
+	printf("]}\n");
+
+	for (size_t i = 0; i < request_count; i++) {
+		free(requests[i].text);
+	}
+	free(requests);
+	for (int r = 0; r < route_count; r++) {
+		free(route_names[r]);
+	}
+	free(by_route);
+	free(total);
+	free(workers);
+	return 0;
+}
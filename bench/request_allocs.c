@@ -0,0 +1,111 @@
+/*
+ * Counts the heap allocations made handling a request, once the server
+ * has warmed up: a page served from the page cache, and a conditional
+ * request for it answered with 304, should make none. Counts everything
+ * from routing to the response being ready to hand to MHD, including
+ * sqlite's allocations, but not MHD's own response object.
+ * Exits non-zero if any allocations were made.
+ * Usage: bench_request_allocs [iterations]
+ */
+#define CCMS_NO_MAIN
+#include "../src/main.c"
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+
+static bool counting;
+static unsigned long allocations;
+
+void* malloc(size_t size) {
+	if (counting) {
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	}
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	if (counting) {
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	}
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+	if (counting) {
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	}
+	return __libc_realloc(p, size);
+}
+
+/*
+ * Handles a request and lets go of the response, as handle_http and MHD would
+ */
+void request(const char* path, const char* if_none_match, int expected_status) {
+	HttpResponse r = handle_request("localhost:8000", path, "GET", NULL, if_none_match, NULL);
+	if (r.status_code != expected_status) {
+		fprintf(stderr, "%s: expected %d, got %d\n", path, expected_status, r.status_code);
+		exit(1);
+	}
+	if (r.shared != NULL) {
+		shared_buffer_release(r.shared);
+	} else {
+		free(r.content);
+	}
+	arena_reset(&request_arena);
+}
+
+/*
+ * Returns the allocations per request
+ */
+double run(int iterations, const char* path, const char* if_none_match, int expected_status) {
+	// Warm up the caches, pools and prepared statements
+	for (int i = 0; i < 10; i++) {
+		request(path, if_none_match, expected_status);
+	}
+	allocations = 0;
+	counting = true;
+	for (int i = 0; i < iterations; i++) {
+		request(path, if_none_match, expected_status);
+	}
+	counting = false;
+	return (double)allocations / iterations;
+}
+
+int main(int argc, char** argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+	char database_path[64];
+	snprintf(database_path, sizeof(database_path), "/tmp/ccms-bench-%d.db", (int)getpid());
+	config.database_path = database_path;
+	config.threads = 1;
+
+	// Keep database setup messages out of the results
+	FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+
+	page_cache_init(config.page_cache_bytes);
+	initialize_database(database_path);
+	load_theme_templates();
+	connection = NULL;
+	db = NULL;
+
+	HttpResponse first = handle_request("localhost:8000", "/", "GET", NULL, NULL, NULL);
+	char etag[128];
+	snprintf(etag, sizeof(etag), "%s", first.etag);
+	shared_buffer_release(first.shared);
+	arena_reset(&request_arena);
+
+	double cached = run(iterations, "/", NULL, 200);
+	double not_modified = run(iterations, "/", etag, 304);
+
+	close_database();
+	page_cache_free();
+	free_theme_templates();
+	arena_free(&request_arena);
+	unlink(database_path);
+
+	fprintf(out, "cached page:  %.2f allocs/request\n", cached);
+	fprintf(out, "304 response: %.2f allocs/request\n", not_modified);
+	fclose(out);
+	return cached == 0 && not_modified == 0 ? 0 : 1;
+}
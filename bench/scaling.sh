@@ -0,0 +1,35 @@
+#!/bin/sh
+# Measures throughput as the number of worker threads increases.
+# Each worker count is measured with the page cache on, and with it off
+# so that every request renders the page from the database.
+# Usage: bench/scaling.sh [max threads] [seconds per run]
+set -e
+
+MAX_THREADS=${1:-$(nproc)}
+SECONDS_PER_RUN=${2:-5}
+PORT=${PORT:-8089}
+CONNECTIONS=${CONNECTIONS:-64}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+DB=$DIR/bench.db
+
+run() {
+	# No access log, so the log writer isn't what's being measured
+	bin/ccms -d "$DB" -p "$PORT" -t "$1" -c "$2" -L 0 > /dev/null &
+	PID=$!
+	# loadgen waits for it to start listening
+	RESULT=$(bin/loadgen -p "$PORT" -H "localhost:8000" -c "$CONNECTIONS" -d "$SECONDS_PER_RUN")
+	kill "$PID"
+	wait "$PID" 2> /dev/null || true
+	# The first rps is the overall one, the rest are per path
+	echo "$RESULT" | sed 's/"paths".*//; s/.*"rps": \([0-9.]*\).*/\1/'
+}
+
+printf "%-8s %14s %14s\n" threads "rps (cached)" "rps (uncached)"
+THREADS=1
+while [ "$THREADS" -le "$MAX_THREADS" ]; do
+	CACHED=$(run "$THREADS" 16777216)
+	UNCACHED=$(run "$THREADS" 0)
+	printf "%-8s %14s %14s\n" "$THREADS" "$CACHED" "$UNCACHED"
+	THREADS=$((THREADS * 2))
+done
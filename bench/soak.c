@@ -0,0 +1,620 @@
+/*
+ * Soak test for ccms. Sends requests for every route over keep-alive
+ * connections for a long time, with a steady trickle of edits so that
+ * the caches keep being emptied and refilled, and samples the server's
+ * resident memory, heap and open file descriptors from its metrics.
+ * Fails if any of them grew by more than its limit between the end of
+ * the warm up and the end of the run, or if the server stopped
+ * answering or sent server errors.
+ * Memory is compared at the lowest it was over the last quarter of
+ * the run, so requests that happen to be in flight at the last
+ * sample don't count as growth, where a leak would.
+ * Usage: soak [options]
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_PATHS 64
+#define READ_BUFFER_SIZE 65536
+
+typedef struct _SoakConfig {
+	const char* host;
+	const char* port;
+	const char* host_header;
+	const char* paths[MAX_PATHS];
+	int path_count;
+	int connections;
+	int seconds;
+	int warmup_seconds;
+	int sample_seconds;
+	// Between edits, 0 for none
+	int write_ms;
+	// Allowed growth after the warm up
+	double max_rss_mb;
+	double max_heap_mb;
+	int max_fds;
+} SoakConfig;
+
+typedef enum {
+	READING_HEADERS,
+	READING_BODY,
+	READING_CHUNK_SIZE,
+	READING_CHUNK,
+	READING_TRAILERS,
+} ResponseState;
+
+/*
+ * A keep-alive connection, and the response being read from it
+ */
+typedef struct _Client {
+	int fd;
+	ResponseState state;
+	int status;
+	// Bytes of the body, or of the current chunk and its CRLF, still to come
+	size_t remaining;
+	bool close_after;
+	char buf[READ_BUFFER_SIZE];
+	size_t have;
+} Client;
+
+/*
+ * What the server reported about itself at one point in the run
+ */
+typedef struct _Sample {
+	double seconds;
+	unsigned long requests;
+	double rss_mb;
+	double heap_mb;
+	int fds;
+} Sample;
+
+static SoakConfig config = {
+	.host = "127.0.0.1",
+	.port = "8000",
+	.host_header = "localhost:8000",
+	.path_count = 0,
+	.connections = 8,
+	.seconds = 600,
+	.warmup_seconds = 60,
+	.sample_seconds = 10,
+	.write_ms = 200,
+	.max_rss_mb = 16,
+	.max_heap_mb = 8,
+	.max_fds = 4,
+};
+
+// Every route, and both sides of the ones that can miss
+static const char* default_paths[] = {
+	"/",
+	"/page-1",
+	"/page-2",
+	"/page-3",
+	"/no-such-page",
+	"/static/main.css",
+	"/static/no-such-resource",
+	"/api/page",
+	"/api/page_content",
+	"/api/server",
+	"/api/theme",
+	"/api/page_cache",
+	"/api/no-such-resource",
+	"/editor.html",
+	"/metrics",
+};
+
+static volatile bool stopping = false;
+static unsigned long requests_sent;
+static unsigned long server_errors;
+static unsigned long failures;
+
+double elapsed_s(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+///////////// Connections /////////////////
+
+int connect_to_server() {
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* addrs;
+	if (getaddrinfo(config.host, config.port, &hints, &addrs) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo* a = addrs; a != NULL && fd < 0; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+void disconnect(Client* c) {
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+/*
+ * Finds the first occurrence of what in data, or returns NULL
+ */
+char* find(char* data, size_t length, const char* what) {
+	size_t what_length = strlen(what);
+	for (size_t i = 0; i + what_length <= length; i++) {
+		if (memcmp(data + i, what, what_length) == 0) {
+			return data + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Parses the status line and headers, from start to end
+ */
+void parse_headers(Client* c, char* start, char* end) {
+	*end = '\0';
+	c->status = atoi(start + 9);
+	c->state = READING_BODY;
+	c->remaining = 0;
+	for (char* h = strstr(start, "\r\n"); h != NULL; h = strstr(h + 2, "\r\n")) {
+		if (strncasecmp(h + 2, "Content-Length:", 15) == 0) {
+			c->remaining = strtoul(h + 17, NULL, 10);
+		} else if (strncasecmp(h + 2, "Transfer-Encoding: chunked", 26) == 0) {
+			c->state = READING_CHUNK_SIZE;
+		} else if (strncasecmp(h + 2, "Connection: close", 17) == 0) {
+			c->close_after = true;
+		}
+	}
+	if (c->status == 304 || c->status == 204) {
+		c->state = READING_BODY;
+		c->remaining = 0;
+	}
+}
+
+/*
+ * Consumes as much of the response in the client's buffer as it can.
+ * Returns true once the whole response has been read.
+ */
+bool parse_response(Client* c) {
+	size_t used = 0;
+	bool done = false;
+	while (!done) {
+		char* data = c->buf + used;
+		size_t length = c->have - used;
+		if (c->state == READING_HEADERS) {
+			char* end = find(data, length, "\r\n\r\n");
+			if (end == NULL) {
+				break;
+			}
+			used += end + 4 - data;
+			parse_headers(c, data, end);
+			done = c->state == READING_BODY && c->remaining == 0;
+		} else if (c->state == READING_CHUNK_SIZE || c->state == READING_TRAILERS) {
+			char* end = find(data, length, "\r\n");
+			if (end == NULL) {
+				break;
+			}
+			used += end + 2 - data;
+			if (c->state == READING_TRAILERS) {
+				// Until the blank line
+				done = end == data;
+			} else {
+				size_t size = strtoul(data, NULL, 16);
+				c->state = size == 0 ? READING_TRAILERS : READING_CHUNK;
+				// The chunk is followed by a CRLF
+				c->remaining = size + 2;
+			}
+		} else {
+			size_t n = length < c->remaining ? length : c->remaining;
+			used += n;
+			c->remaining -= n;
+			if (c->remaining > 0) {
+				break;
+			}
+			if (c->state == READING_BODY) {
+				done = true;
+			} else {
+				c->state = READING_CHUNK_SIZE;
+			}
+		}
+	}
+	memmove(c->buf, c->buf + used, c->have - used);
+	c->have -= used;
+	return done;
+}
+
+/*
+ * Sends a request and reads the whole response, connecting first if
+ * need be, and counts it. Returns false if that failed.
+ */
+bool exchange(Client* c, const char* request, size_t length) {
+	if (c->fd < 0) {
+		c->fd = connect_to_server();
+		if (c->fd < 0) {
+			__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+	}
+	c->state = READING_HEADERS;
+	c->have = 0;
+	c->close_after = false;
+	bool ok = write(c->fd, request, length) == (ssize_t)length;
+	while (ok) {
+		ssize_t n = read(c->fd, c->buf + c->have, sizeof(c->buf) - c->have);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		ok = n > 0;
+		if (ok) {
+			c->have += n;
+			if (parse_response(c)) {
+				break;
+			}
+			// A header block that doesn't fit isn't something ccms sends
+			ok = c->have < sizeof(c->buf);
+		}
+	}
+	__atomic_add_fetch(&requests_sent, 1, __ATOMIC_RELAXED);
+	if (!ok) {
+		__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+	} else if (c->status >= 500) {
+		__atomic_add_fetch(&server_errors, 1, __ATOMIC_RELAXED);
+	}
+	if (!ok || c->close_after) {
+		disconnect(c);
+	}
+	return ok;
+}
+
+///////////// Load /////////////////
+
+/*
+ * Requests every path in turn, starting from a different one on each
+ * connection
+ */
+void* run_reader(void* arg) {
+	int path = (int)(long)arg % config.path_count;
+	Client* c = calloc(1, sizeof(Client));
+	c->fd = -1;
+	while (!stopping) {
+		char request[1024];
+		int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+				config.paths[path], config.host_header);
+		if (!exchange(c, request, length)) {
+			// Don't spin if the server's gone
+			struct timespec wait = {.tv_sec = 0, .tv_nsec = 10000000};
+			nanosleep(&wait, NULL);
+		}
+		path = (path + 1) % config.path_count;
+	}
+	disconnect(c);
+	free(c);
+	return NULL;
+}
+
+/*
+ * Edits the first page's content every write_ms, alternating between
+ * a short and a long version, which empties the page and navigation
+ * caches each time
+ */
+void* run_writer(void* arg) {
+	Client* c = calloc(1, sizeof(Client));
+	c->fd = -1;
+	char* long_content = malloc(8192);
+	size_t n = 0;
+	while (n < 8000) {
+		n += snprintf(long_content + n, 8192 - n, "Paragraph %zu, with _emphasis_. ", n);
+	}
+	for (int i = 0; !stopping; i++) {
+		char body[9000];
+		int body_length = snprintf(body, sizeof(body), "{\"content\": \"## Edit %d\\n\\n%s\"}",
+				i, i % 2 == 0 ? "Short." : long_content);
+		char request[10000];
+		int length = snprintf(request, sizeof(request),
+				"PATCH /api/page_content/1 HTTP/1.1\r\nHost: %s\r\n"
+				"Content-Type: application/json\r\nContent-Length: %d\r\n\r\n%s",
+				config.host_header, body_length, body);
+		exchange(c, request, length);
+		struct timespec wait = {
+			.tv_sec = config.write_ms / 1000,
+			.tv_nsec = (config.write_ms % 1000) * 1000000L,
+		};
+		nanosleep(&wait, NULL);
+	}
+	free(long_content);
+	disconnect(c);
+	free(c);
+	return NULL;
+}
+
+///////////// Sampling /////////////////
+
+/*
+ * Finds a metric's value in the metrics text, or returns -1
+ */
+double metric_value(const char* text, const char* name) {
+	size_t name_length = strlen(name);
+	for (const char* line = text; line != NULL; line = strchr(line, '\n')) {
+		if (*line == '\n') {
+			line++;
+		}
+		if (strncmp(line, name, name_length) == 0 && line[name_length] == ' ') {
+			return atof(line + name_length + 1);
+		}
+	}
+	return -1;
+}
+
+/*
+ * Fetches the server's metrics on a connection of its own.
+ * Returns false if the server didn't answer.
+ */
+bool take_sample(Sample* s) {
+	int fd = connect_to_server();
+	if (fd < 0) {
+		return false;
+	}
+	char request[256];
+	int length = snprintf(request, sizeof(request),
+			"GET /metrics HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", config.host_header);
+	size_t capacity = 1 << 17;
+	char* text = malloc(capacity);
+	size_t have = 0;
+	bool ok = write(fd, request, length) == length;
+	while (ok) {
+		if (have + 1 == capacity) {
+			capacity *= 2;
+			text = realloc(text, capacity);
+		}
+		ssize_t n = read(fd, text + have, capacity - have - 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		have += n;
+	}
+	close(fd);
+	text[have] = '\0';
+	ok = ok && strncmp(text, "HTTP/1.1 200", 12) == 0;
+	if (ok) {
+		s->rss_mb = metric_value(text, "process_resident_memory_bytes") / (1024 * 1024);
+		s->heap_mb = metric_value(text, "ccms_heap_allocated_bytes") / (1024 * 1024);
+		s->fds = (int)metric_value(text, "process_open_fds");
+	}
+	free(text);
+	return ok;
+}
+
+/*
+ * Prints how much a measure grew, and returns whether that's within its limit
+ */
+bool check_growth(const char* name, double before, double after, double limit) {
+	if (before < 0 || after < 0) {
+		printf("%-9s not reported by the server, not checked\n", name);
+		return true;
+	}
+	double growth = after - before;
+	bool ok = growth <= limit;
+	printf("%-9s %8.1f -> %8.1f, grew by %6.1f, limit %6.1f  %s\n",
+			name, before, after, growth, limit, ok ? "ok" : "GREW TOO MUCH");
+	return ok;
+}
+
+void usage(const char* program) {
+	fprintf(stderr, "Usage: %s [options]\n"
+			"  -a <address>  server address (default %s)\n"
+			"  -p <port>     server port (default %s)\n"
+			"  -H <host>     Host header (default %s)\n"
+			"  -u <path>     path to request, can be given more than once\n"
+			"                (default every route)\n"
+			"  -c <n>        connections (default %d)\n"
+			"  -d <seconds>  duration, including the warm up (default %d)\n"
+			"  -w <seconds>  warm up, after which memory mustn't grow (default %d)\n"
+			"  -i <seconds>  between samples (default %d)\n"
+			"  -W <ms>       between edits, 0 for none (default %d)\n"
+			"  -r <MiB>      allowed resident memory growth (default %g)\n"
+			"  -m <MiB>      allowed heap growth (default %g)\n"
+			"  -f <n>        allowed growth in open file descriptors (default %d)\n",
+			program,
+			config.host,
+			config.port,
+			config.host_header,
+			config.connections,
+			config.seconds,
+			config.warmup_seconds,
+			config.sample_seconds,
+			config.write_ms,
+			config.max_rss_mb,
+			config.max_heap_mb,
+			config.max_fds);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:H:u:c:d:w:i:W:r:m:f:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			config.host = optarg;
+			break;
+		case 'p':
+			config.port = optarg;
+			break;
+		case 'H':
+			config.host_header = optarg;
+			break;
+		case 'u':
+			if (config.path_count == MAX_PATHS) {
+				fprintf(stderr, "At most %d paths\n", MAX_PATHS);
+				return 1;
+			}
+			config.paths[config.path_count++] = optarg;
+			break;
+		case 'c':
+			config.connections = atoi(optarg);
+			break;
+		case 'd':
+			config.seconds = atoi(optarg);
+			break;
+		case 'w':
+			config.warmup_seconds = atoi(optarg);
+			break;
+		case 'i':
+			config.sample_seconds = atoi(optarg);
+			break;
+		case 'W':
+			config.write_ms = atoi(optarg);
+			break;
+		case 'r':
+			config.max_rss_mb = atof(optarg);
+			break;
+		case 'm':
+			config.max_heap_mb = atof(optarg);
+			break;
+		case 'f':
+			config.max_fds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (config.connections < 1 || config.sample_seconds < 1
+			|| config.seconds <= config.warmup_seconds) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (config.path_count == 0) {
+		for (size_t i = 0; i < sizeof(default_paths) / sizeof(default_paths[0]); i++) {
+			config.paths[config.path_count++] = default_paths[i];
+		}
+	}
+
+	// Give the server a few seconds to start listening
+	Sample first;
+	bool up = false;
+	for (int i = 0; i < 50 && !up; i++) {
+		up = take_sample(&first);
+		if (!up) {
+			struct timespec wait = {.tv_sec = 0, .tv_nsec = 100000000};
+			nanosleep(&wait, NULL);
+		}
+	}
+	if (!up) {
+		fprintf(stderr, "Couldn't get metrics from %s:%s\n", config.host, config.port);
+		return 1;
+	}
+
+	pthread_t* readers = calloc(config.connections, sizeof(pthread_t));
+	for (int i = 0; i < config.connections; i++) {
+		pthread_create(&readers[i], NULL, run_reader, (void*)(long)i);
+	}
+	pthread_t writer;
+	if (config.write_ms > 0) {
+		pthread_create(&writer, NULL, run_writer, NULL);
+	}
+
+	int sample_count = config.seconds / config.sample_seconds + 1;
+	Sample* samples = calloc(sample_count, sizeof(Sample));
+	int taken = 0;
+	int warm = -1;
+	bool answered = true;
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	printf("%8s %12s %8s %8s %10s %6s\n", "seconds", "requests", "errors", "rss MiB", "heap MiB", "fds");
+	while (taken < sample_count && answered) {
+		sleep(config.sample_seconds);
+		Sample* s = &samples[taken];
+		answered = take_sample(s);
+		if (!answered) {
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		s->seconds = elapsed_s(start, now);
+		s->requests = __atomic_load_n(&requests_sent, __ATOMIC_RELAXED);
+		printf("%8.0f %12lu %8lu %8.1f %10.1f %6d%s\n", s->seconds, s->requests,
+				__atomic_load_n(&server_errors, __ATOMIC_RELAXED)
+					+ __atomic_load_n(&failures, __ATOMIC_RELAXED),
+				s->rss_mb, s->heap_mb, s->fds,
+				warm < 0 && s->seconds >= config.warmup_seconds ? "  (warmed up)" : "");
+		fflush(stdout);
+		if (warm < 0 && s->seconds >= config.warmup_seconds) {
+			warm = taken;
+		}
+		taken++;
+		if (s->seconds >= config.seconds) {
+			break;
+		}
+	}
+	stopping = true;
+	for (int i = 0; i < config.connections; i++) {
+		pthread_join(readers[i], NULL);
+	}
+	if (config.write_ms > 0) {
+		pthread_join(writer, NULL);
+	}
+
+	bool ok = true;
+	printf("\n");
+	if (!answered) {
+		printf("The server stopped answering after %d samples\n", taken);
+		ok = false;
+	}
+	if (server_errors > 0 || failures > 0) {
+		printf("%lu server errors and %lu failed requests, out of %lu\n",
+				server_errors, failures, requests_sent);
+		ok = false;
+	}
+	if (warm < 0 || warm == taken - 1) {
+		printf("Not enough samples after the warm up to check growth\n");
+		ok = false;
+	} else {
+		// The lowest over the last quarter, see the top
+		int from = taken - (taken - warm) / 4 - 1;
+		if (from <= warm) {
+			from = warm + 1;
+		}
+		Sample last = samples[from];
+		for (int i = from; i < taken; i++) {
+			if (samples[i].rss_mb < last.rss_mb) {
+				last.rss_mb = samples[i].rss_mb;
+			}
+			if (samples[i].heap_mb < last.heap_mb) {
+				last.heap_mb = samples[i].heap_mb;
+			}
+			if (samples[i].fds < last.fds) {
+				last.fds = samples[i].fds;
+			}
+		}
+		Sample base = samples[warm];
+		ok = check_growth("rss MiB", base.rss_mb, last.rss_mb, config.max_rss_mb) && ok;
+		ok = check_growth("heap MiB", base.heap_mb, last.heap_mb, config.max_heap_mb) && ok;
+		ok = check_growth("fds", base.fds, last.fds, config.max_fds) && ok;
+	}
+	printf(ok ? "\nSoak test passed\n" : "\nSOAK TEST FAILED\n");
+	free(samples);
+	free(readers);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Soak test: seeds a database with a synthetic site, starts ccms on it
+# and runs bin/soak against it, which requests every route and edits a
+# page for the whole run, and fails if ccms' memory or open files kept
+# growing after the warm up, or if it stopped answering.
+# Usage: bench/soak.sh [seconds]
+# Set WARMUP (seconds), CONNECTIONS, PORT, CCMS_ARGS (e.g. "-c 0" to
+# soak the uncached path) or SOAK_ARGS (e.g. "-m 4" for a tighter heap
+# bound) to change the setup.
+set -e
+
+SECONDS_TO_RUN=${1:-600}
+WARMUP=${WARMUP:-60}
+PORT=${PORT:-8089}
+CONNECTIONS=${CONNECTIONS:-8}
+DIR=$(mktemp -d)
+DB=$DIR/soak.db
+
+bin/corpus -d "$DB" > /dev/null
+# No access log, so the log file isn't what grows
+bin/ccms -d "$DB" -p "$PORT" -L 0 $CCMS_ARGS > /dev/null &
+PID=$!
+
+# soak waits for ccms to start listening
+bin/soak -p "$PORT" -H "localhost:8000" -c "$CONNECTIONS" -d "$SECONDS_TO_RUN" \
+	-w "$WARMUP" $SOAK_ARGS || STATUS=$?
+kill "$PID"
+wait "$PID" 2> /dev/null || true
+rm -rf "$DIR"
+exit "${STATUS:-0}"
@@ -0,0 +1,394 @@
+/*
+ * Microbenchmarks for each stage of serving a request, against fixed
+ * fixtures, so a regression in the end to end numbers can be traced to
+ * a stage. Reports the median ns/op over several rounds, and the
+ * allocations per op, including sqlite's, cmark's and json-c's.
+ * Usage: bench_stages [-r rounds] [-t ms per round] [-j] [name...]
+ * With names, only the benchmarks whose names start with one of them
+ * are run. -j prints JSON instead of a table.
+ */
+#define CCMS_NO_MAIN
+#include "../src/main.c"
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+
+static bool counting;
+static unsigned long allocations;
+
+void* malloc(size_t size) {
+	if (counting) {
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	}
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	if (counting) {
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	}
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+	if (counting) {
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	}
+	return __libc_realloc(p, size);
+}
+
+double elapsed_ns(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+// Pages on the server with the large navigation
+#define LARGE_SITE_PAGES 500
+#define LARGE_RESOURCE_BYTES (256 * 1024)
+
+/*
+ * The fixtures, set up once before anything is timed
+ */
+static struct {
+	char* documents[3];
+	int small_server_id;
+	int large_server_id;
+	Template* template;
+	PageData small_page;
+	PageData large_page;
+	PageContents page_contents;
+} fixtures;
+
+///////////// Benchmarks /////////////////
+
+void bench_path_elements() {
+	Strings path_elements = get_path_elements("/api/page_content/12/title");
+	join_path_elements(path_elements);
+	arena_reset(&request_arena);
+}
+
+void bench_find_page_data() {
+	free_page_data(find_page_data(fixtures.small_server_id, "/", "en"));
+}
+
+void bench_find_page_data_large_nav() {
+	free_page_data(find_page_data(fixtures.large_server_id, "/page-250", "en"));
+}
+
+void bench_markdown_1k() {
+	free(render_markdown(fixtures.documents[0]));
+}
+
+void bench_markdown_16k() {
+	free(render_markdown(fixtures.documents[1]));
+}
+
+void bench_markdown_256k() {
+	free(render_markdown(fixtures.documents[2]));
+}
+
+void bench_template_small_nav() {
+	shared_buffer_release(template_render(fixtures.template, &fixtures.small_page));
+}
+
+void bench_template_large_nav() {
+	shared_buffer_release(template_render(fixtures.template, &fixtures.large_page));
+}
+
+void bench_page_content_json() {
+	struct json_object* json = page_contents_to_json(fixtures.page_contents);
+	HttpResponse r = http_json_response(json, 200);
+	json_object_put(json);
+	free(r.content);
+}
+
+void bench_static_resource() {
+	free_static_resource(find_static_resource("localhost:8000", "main.css"));
+}
+
+void bench_static_resource_256k() {
+	free_static_resource(find_static_resource("localhost:8000", "large.bin"));
+}
+
+typedef struct {
+	const char* name;
+	void (*op)();
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+	{"path_elements", bench_path_elements},
+	{"find_page_data", bench_find_page_data},
+	{"find_page_data_large_nav", bench_find_page_data_large_nav},
+	{"markdown_1k", bench_markdown_1k},
+	{"markdown_16k", bench_markdown_16k},
+	{"markdown_256k", bench_markdown_256k},
+	{"template_small_nav", bench_template_small_nav},
+	{"template_large_nav", bench_template_large_nav},
+	{"page_content_json", bench_page_content_json},
+	{"static_resource", bench_static_resource},
+	{"static_resource_256k", bench_static_resource_256k},
+};
+
+///////////// Fixtures /////////////////
+
+/*
+ * Markdown of the given size, made of the same few blocks over and
+ * over: headings, paragraphs with inline markup, lists, code and links
+ */
+char* make_document(size_t size) {
+	static const char* block =
+		"## A heading with `code`\n\n"
+		"Some text with _emphasis_, **strong** and a [link](/page-1 \"title\"). "
+		"It runs on for a while, as paragraphs do, with the odd & and < to escape.\n\n"
+		"- a list item\n"
+		"- another, with *more* text\n"
+		"  1. nested\n\n"
+		"> quoted text\n\n"
+		"```\nfor (int i = 0; i < n; i++) {\n\tprintf(\"%d\\n\", i);\n}\n```\n\n";
+	size_t block_length = strlen(block);
+	char* document = malloc(size + 1);
+	for (size_t i = 0; i < size; i++) {
+		document[i] = block[i % block_length];
+	}
+	document[size] = '\0';
+	return document;
+}
+
+void run_statement(sqlite3_stmt* stmt) {
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		sqlite_check(db, sqlite3_errcode(db));
+	}
+	sqlite3_reset(stmt);
+}
+
+/*
+ * Adds a second server with LARGE_SITE_PAGES pages, ten to a branch,
+ * each with some content, and a large static resource to the first
+ */
+void create_large_site() {
+	sqlite_check(db, sqlite3_exec(db, "begin;"
+		"insert into server (id, hostname, default_language, theme_id) "
+		"values (2, 'large.localhost:8000', 'en', 1);", NULL, NULL, NULL));
+	sqlite3_stmt* page;
+	sqlite_check(db, sqlite3_prepare_v2(db,
+		"insert into page (server_id, parent_page_id, relative_path) values (2, ?, ?)",
+		-1, &page, NULL));
+	sqlite3_stmt* content;
+	sqlite_check(db, sqlite3_prepare_v2(db,
+		"insert into page_content (page_id, language, title, content, content_html) "
+		"values (?1, 'en', ?2, ?3, markdown_to_html(?3))",
+		-1, &content, NULL));
+	sqlite3_int64 branch = 0;
+	for (int i = 0; i < LARGE_SITE_PAGES; i++) {
+		char path[32];
+		snprintf(path, sizeof(path), "/page-%d", i);
+		if (i % 10 == 0) {
+			sqlite_check(db, sqlite3_bind_null(page, 1));
+		} else {
+			sqlite_check(db, sqlite3_bind_int64(page, 1, branch));
+		}
+		sqlite_check(db, sqlite3_bind_text(page, 2, i == 0 ? "/" : path, -1, SQLITE_TRANSIENT));
+		run_statement(page);
+		sqlite3_int64 id = sqlite3_last_insert_rowid(db);
+		if (i % 10 == 0) {
+			branch = id;
+		}
+		char title[32];
+		snprintf(title, sizeof(title), "Page & title %d", i);
+		sqlite_check(db, sqlite3_bind_int64(content, 1, id));
+		sqlite_check(db, sqlite3_bind_text(content, 2, title, -1, SQLITE_TRANSIENT));
+		sqlite_check(db, sqlite3_bind_text(content, 3, fixtures.documents[0], -1, SQLITE_STATIC));
+		run_statement(content);
+	}
+	sqlite3_finalize(page);
+	sqlite3_finalize(content);
+
+	sqlite3_stmt* resource;
+	sqlite_check(db, sqlite3_prepare_v2(db,
+		"insert into static_resources (server_id, key, value, content_type) "
+		"values (1, 'large.bin', zeroblob(?), 'application/octet-stream')",
+		-1, &resource, NULL));
+	sqlite_check(db, sqlite3_bind_int(resource, 1, LARGE_RESOURCE_BYTES));
+	run_statement(resource);
+	sqlite3_finalize(resource);
+	sqlite_check(db, sqlite3_exec(db, "commit", NULL, NULL, NULL));
+}
+
+/*
+ * Loads a page as handle_content would, with its theme content
+ */
+PageData load_page(int server_id, const char* path) {
+	PageData pd = find_page_data(server_id, path, "en");
+	pd.theme_content = template_theme_content(fixtures.template, pd.theme_id, "en", pd.theme_revision);
+	return pd;
+}
+
+void setup_fixtures(const char* database_path) {
+	fixtures.documents[0] = make_document(1024);
+	fixtures.documents[1] = make_document(16 * 1024);
+	fixtures.documents[2] = make_document(256 * 1024);
+
+	initialize_database(database_path);
+	create_large_site();
+	load_theme_templates();
+	connection = NULL;
+	db = NULL;
+	acquire_reader();
+	fixtures.small_server_id = find_server_id("localhost:8000");
+	fixtures.large_server_id = find_server_id("large.localhost:8000");
+	PageData home = find_page_data(fixtures.small_server_id, "/", "en");
+	fixtures.template = find_theme_template(home.theme_id, home.theme_revision).template;
+	free_page_data(home);
+	if (fixtures.template == NULL) {
+		fprintf(stderr, "The default theme's template didn't compile\n");
+		exit(1);
+	}
+	fixtures.small_page = load_page(fixtures.small_server_id, "/");
+	fixtures.large_page = load_page(fixtures.large_server_id, "/page-250");
+	fixtures.page_contents = get_page_contents();
+}
+
+void free_fixtures() {
+	free_page_contents(fixtures.page_contents);
+	free_page_data(fixtures.small_page);
+	free_page_data(fixtures.large_page);
+	release_template(fixtures.template);
+	release_reader();
+	close_database();
+	free_theme_templates();
+	arena_free(&request_arena);
+	for (int i = 0; i < 3; i++) {
+		free(fixtures.documents[i]);
+	}
+}
+
+///////////// Running /////////////////
+
+typedef struct {
+	double ns_per_op;
+	double allocs_per_op;
+} Result;
+
+/*
+ * Returns the ns per op for a round of iterations.
+ */
+double run_round(const Benchmark* b, long iterations) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		b->op();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return elapsed_ns(start, end) / iterations;
+}
+
+int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Runs enough iterations for each round to take round_ms, after a warm
+ * up that also fills sqlite's and ccms' caches, and takes the median
+ * round, which isn't thrown by the odd slow one.
+ */
+Result run(const Benchmark* b, int rounds, int round_ms) {
+	long iterations = 1;
+	while (iterations < (1L << 30) && run_round(b, iterations) * iterations < round_ms * 1e6) {
+		iterations *= 2;
+	}
+	double ns[rounds];
+	allocations = 0;
+	counting = true;
+	for (int i = 0; i < rounds; i++) {
+		ns[i] = run_round(b, iterations);
+	}
+	counting = false;
+	qsort(ns, rounds, sizeof(double), compare_doubles);
+	Result r = {
+		.ns_per_op = ns[rounds / 2],
+		.allocs_per_op = (double)allocations / (iterations * rounds),
+	};
+	return r;
+}
+
+bool selected(const char* name, int argc, char** argv) {
+	if (optind == argc) {
+		return true;
+	}
+	for (int i = optind; i < argc; i++) {
+		if (strncmp(name, argv[i], strlen(argv[i])) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void stages_usage(const char* program) {
+	fprintf(stderr, "Usage: %s [-r rounds] [-t ms per round] [-j] [name...]\n", program);
+}
+
+int main(int argc, char** argv) {
+	int rounds = 5;
+	int round_ms = 50;
+	bool json = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:t:jh")) != -1) {
+		switch (opt) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 't':
+			round_ms = atoi(optarg);
+			break;
+		case 'j':
+			json = true;
+			break;
+		default:
+			stages_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (rounds < 1 || round_ms < 1) {
+		stages_usage(argv[0]);
+		return 1;
+	}
+	char database_path[64];
+	snprintf(database_path, sizeof(database_path), "/tmp/ccms-bench-%d.db", (int)getpid());
+	config.database_path = database_path;
+	config.threads = 1;
+
+	// Keep database setup messages out of the results
+	FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+
+	setup_fixtures(database_path);
+	size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	bool first = true;
+	if (json) {
+		fprintf(out, "{");
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (!selected(benchmarks[i].name, argc, argv)) {
+			continue;
+		}
+		Result r = run(&benchmarks[i], rounds, round_ms);
+		if (json) {
+			fprintf(out, "%s\n  \"%s\": {\"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}",
+				first ? "" : ",", benchmarks[i].name, r.ns_per_op, r.allocs_per_op);
+		} else {
+			fprintf(out, "%-26s %12.0f ns/op %10.2f allocs/op\n",
+				benchmarks[i].name, r.ns_per_op, r.allocs_per_op);
+		}
+		fflush(out);
+		first = false;
+	}
+	if (json) {
+		fprintf(out, "\n}\n");
+	}
+	free_fixtures();
+	unlink(database_path);
+	fclose(out);
+	return 0;
+}
@@ -48,7 +48,7 @@ create table if not exists page (
 	-- the user should be sent a http '410 Gone' response
 	purge int,
 	-- the last time this page was modified, as a unix timestamp
-	last_modified int not null default current_timestamp,
+	last_modified int not null default (cast(strftime('%s', 'now') as integer)),
 	foreign key (server_id) references server(id),
 	foreign key (parent_page_id) references page(id),
 	foreign key (replacement_page_id) references page(id)
@@ -2,15 +2,33 @@
 #define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+// mallinfo2, for the heap's size in the metrics
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+#ifdef CCMS_USDT
+#include <sys/sdt.h>
+#endif
 
 #define DG_DYNARR_IMPLEMENTATION
 #include <DG_dynarr.h>
 #include <microhttpd.h>
 #include <sqlite3.h>
-#include <mustach.h>
 #include <cmark.h>
 #include <json-c/json.h>
 
@@ -48,6 +66,30 @@
 	res; \
 })
 
+/*
+ * Logs a debug message, if debug logging is on. The arguments
+ * aren't evaluated when it's off, so it's free to leave these in.
+ */
+#define log_debug(...) do { \
+	if (__builtin_expect(config.log_level >= LOG_LEVEL_DEBUG, 0)) { \
+		log_message(LOG_LEVEL_DEBUG, __VA_ARGS__); \
+	} \
+} while (0)
+
+/*
+ * A USDT probe, ccms:name, for perf and bpftrace to attach to, taking
+ * up to a dozen integer or pointer arguments. Built with -DCCMS_USDT
+ * (make USDT=1, which needs systemtap's sys/sdt.h) each is a nop until
+ * something attaches to it, otherwise they're compiled out. The
+ * arguments are evaluated either way when built in, so only pass
+ * values that are already at hand.
+ */
+#ifdef CCMS_USDT
+#define PROBE(...) STAP_PROBEV(ccms, __VA_ARGS__)
+#else
+#define PROBE(...)
+#endif
+
 //////////// Structures /////////////
 
 /*
@@ -55,12 +97,40 @@
  */
 DA_TYPEDEF(char*, Strings);
 
+/*
+ * List of ints
+ */
+DA_TYPEDEF(int, Ints);
+
+/*
+ * A statement kept prepared for the life of its connection,
+ * keyed by the address of its SQL.
+ */
+typedef struct _CachedStatement {
+	const char* sql;
+	sqlite3_stmt* stmt;
+	// When it was last handed out, for the SQL stage timing
+	struct timespec started;
+} CachedStatement;
+DA_TYPEDEF(CachedStatement, CachedStatements);
+
+/*
+ * A database connection, and the statements prepared on it.
+ */
+typedef struct _Connection {
+	sqlite3* db;
+	CachedStatements statements;
+} Connection;
+DA_TYPEDEF(Connection*, Connections);
+
 /*
  * Structure representing a single navigation item
  */
 typedef struct _NavItem {
 	char* title;
 	char* url;
+	// How many parent pages the page has, as text for templates
+	char depth[12];
 } NavItem;
 
 /*
@@ -69,27 +139,74 @@ typedef struct _NavItem {
 DA_TYPEDEF(NavItem, NavItems);
 
 /*
- * Structure representing a translateable element of the theme
- * e.g. a tagline, powered-by, copyright notice, or similar.
+ * The navigation for a server in one language, built once rather than
+ * for every page. Items are in tree order, each page being followed by
+ * the pages whose parent it is.
+ * Pages may still be rendering with a tree after it's replaced,
+ * so it's freed when the last reference is released.
  */
-typedef struct _ThemeContentItem {
-	char* name;
-	char* value;
-} ThemeContentItem;
+typedef struct _NavTree {
+	int server_id;
+	char* language;
+	NavItems items;
+	// The server's nav_revision when the tree was built,
+	// it needs building again if that's changed
+	int revision;
+	int refs;
+} NavTree;
+
+DA_TYPEDEF(NavTree*, NavTrees);
+
+/*
+ * Navigation trees held in memory, by server and language
+ */
+typedef struct _NavCache {
+	NavTrees trees;
+	pthread_mutex_t lock;
+} NavCache;
+
+/*
+ * A theme's translateable elements in one language, e.g. a tagline,
+ * powered-by, copyright notice, or similar. Held by the theme's compiled
+ * template, with values in the order of the template's slots.
+ */
+typedef struct _ThemeContent {
+	char* language;
+	// The theme's revision when these were read, they're read again if it changes
+	int theme_revision;
+	// By slot, NULL where the theme has no such item
+	char** values;
+	int count;
+	// Pages may still be rendering with these after they're replaced
+	int refs;
+} ThemeContent;
+
+DA_TYPEDEF(ThemeContent*, ThemeContents);
 
 /*
- * Collection represting a list of theme content items
+ * Validators for a content page, used to answer conditional requests.
+ * These are derived from revision counts in the database, which are
+ * kept up to date by triggers, so they can be found without rendering
+ * the page.
  */
-DA_TYPEDEF(ThemeContentItem, ThemeContentItems);
+typedef struct _PageValidators {
+	// false if there's no such page
+	bool found;
+	// Strong entity tag, including the quotes
+	char etag[128];
+	// When the page, its navigation, or its theme last changed
+	time_t last_modified;
+} PageValidators;
 
 /* 
  * Structure containing all data required for loading a content page
  */
 typedef struct _PageData {
-	// The template page, from the current theme
-	char* template;
-	// Localizable content from the current theme
-	ThemeContentItems content_items;
+	// The current theme, which has the template for the page
+	int theme_id;
+	int theme_revision;
+	// Localizable content from the current theme, found along with the template
+	ThemeContent* theme_content;
 
 	// The title of the page
 	char* title;
@@ -97,32 +214,269 @@ typedef struct _PageData {
 	char* content;
 	char* language;
 
-	// Navigation data
-	NavItems nav_items;
-
-	// These two are used by mustach for iterating over 
-	// nav_items. Potentially they shouldn't be on this type,
-	// but on some kind of wrapper.
-	int isnav; 
-	int navix; 
+	// Navigation data, shared with the server's other pages
+	NavTree* nav;
 
 	// Error page information
 	int isnotfound;
+
+	PageValidators validators;
 } PageData;
 
+/*
+ * Kinds of instruction in a compiled template
+ */
+typedef enum _TemplateOpKind {
+	// Copy a span of the template source to the output
+	TEMPLATE_OP_LITERAL,
+	// Write a value, HTML escaped, e.g. {{ title }}
+	TEMPLATE_OP_VARIABLE,
+	// Write a value as-is, e.g. {{{ content }}} or {{& content}}
+	TEMPLATE_OP_UNESCAPED,
+	// Start of a section, e.g. {{#nav}}
+	TEMPLATE_OP_SECTION_ENTER,
+	// Start of an inverted section, e.g. {{^nav}}
+	TEMPLATE_OP_INVERTED_ENTER,
+	// End of either kind of section, e.g. {{/nav}}
+	TEMPLATE_OP_SECTION_LEAVE,
+} TemplateOpKind;
+
+/*
+ * The page data a tag refers to, resolved when the template is compiled
+ */
+typedef enum _TemplateTag {
+	TEMPLATE_TAG_TITLE,
+	TEMPLATE_TAG_CONTENT,
+	TEMPLATE_TAG_LANGUAGE,
+	TEMPLATE_TAG_NAV,
+	TEMPLATE_TAG_URL,
+	TEMPLATE_TAG_DEPTH,
+	// Anything else is looked up among the theme content items
+	TEMPLATE_TAG_THEME_ITEM,
+} TemplateTag;
+
+/*
+ * A single instruction in a compiled template
+ */
+typedef struct _TemplateOp {
+	TemplateOpKind kind;
+	// Literals: the span of the template source to copy
+	const char* text;
+	size_t length;
+	// Tags: the name used in the template, and what it refers to
+	char* name;
+	TemplateTag tag;
+	// Theme content items: index into the template's slots
+	int slot;
+	// Sections: index of the matching enter or leave instruction
+	int match;
+} TemplateOp;
+
+DA_TYPEDEF(TemplateOp, TemplateOps);
+
+/*
+ * A mustache template, compiled into a flat list of instructions
+ * so that it doesn't need parsing again for every page rendered.
+ */
+typedef struct _Template {
+	// The template source, which literal instructions point into
+	char* source;
+	TemplateOps ops;
+	// Names of the theme content items used, which tags refer to by slot
+	Strings slots;
+	// Values for the slots in each language, read as they're needed
+	ThemeContents contents;
+	pthread_mutex_t contents_lock;
+	// Pages may still be rendering with a template after its theme changes,
+	// so it's freed when the last reference is released
+	int refs;
+} Template;
+
+typedef struct _TemplateCompileResult {
+	bool success;
+	char* error_message;
+	Template* template;
+} TemplateCompileResult;
+
+/*
+ * The compiled template for a theme.
+ */
+typedef struct _ThemeTemplate {
+	int theme_id;
+	// The theme's revision it was compiled from
+	int revision;
+	// NULL if the theme's template doesn't compile
+	Template* template;
+	char* error_message;
+} ThemeTemplate;
+
+DA_TYPEDEF(ThemeTemplate, ThemeTemplates);
+
+/*
+ * Progress through rendering a page, so that it can be rendered
+ * a piece at a time as it's sent.
+ */
+typedef struct _TemplateRenderer {
+	Template* template;
+	PageData* pld;
+	// The next instruction to run
+	int op;
+	// The navigation item, while inside a #nav section
+	NavItem* nav;
+	int navix;
+	// What's left of the last literal or value, which didn't fit
+	const char* pending;
+	size_t pending_length;
+	bool pending_escaped;
+	// What's left of an entity escaping the value, which was split
+	const char* entity;
+	size_t entity_length;
+} TemplateRenderer;
+
+// How much of a page is rendered at a time
+#define PAGE_RENDER_BLOCK_SIZE (16 * 1024)
+
+/*
+ * A page rendered as it's sent, which holds everything it's rendered from,
+ * as the request's database transaction is over by then.
+ */
+typedef struct _PageStream {
+	PageData pd;
+	Template* template;
+	TemplateRenderer renderer;
+	// Time spent rendering so far, recorded once it's done
+	unsigned long render_ns;
+	size_t length;
+} PageStream;
+
+/*
+ * A part of a page sent as a list of pieces. Pieces point into the
+ * template's source, the page data, or, for values which needed escaping,
+ * at an offset into the escaped text.
+ */
+typedef struct _PagePiece {
+	const char* data;
+	size_t offset;
+	size_t length;
+} PagePiece;
+
+DA_TYPEDEF(PagePiece, PagePieces);
+
+/*
+ * A page sent as a list of pieces, without being copied into one buffer.
+ * Holds the template and page data the pieces point into.
+ */
+typedef struct _PageIovec {
+	PageData pd;
+	Template* template;
+	PagePieces pieces;
+	// Values that needed escaping, escaped
+	char* escaped;
+	size_t escaped_length;
+	size_t escaped_capacity;
+	struct MHD_IoVec* iov;
+	// Of all the pieces
+	size_t length;
+} PageIovec;
+
+/*
+ * A block of memory in an arena
+ */
+typedef struct _ArenaBlock {
+	struct _ArenaBlock* next;
+	size_t size;
+	char data[];
+} ArenaBlock;
+
+/*
+ * Memory handed out by bumping a pointer through blocks,
+ * and freed all at once.
+ */
+typedef struct _Arena {
+	// The newest block first
+	ArenaBlock* blocks;
+	// How much of the newest block is handed out
+	size_t used;
+} Arena;
+
+// Size of an arena's blocks, unless an allocation needs more
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+/*
+ * Immutable, reference counted block of memory. Lets the same data be
+ * sent in many responses at once without copying it for each one.
+ */
+typedef struct _SharedBuffer {
+	int refs;
+	size_t length;
+	char data[];
+} SharedBuffer;
+
 /*
  * Structure reprenting simple static content, e.g. images or CSS
  */
 typedef struct _StaticResource {
 	char* key;
-	void* value;
-	int value_size;
+	// Holds a reference, released by free_static_resource
+	SharedBuffer* value;
 	char* content_type;
 	bool isnotfound;
 } StaticResource;
+DA_TYPEDEF(StaticResource, StaticResources);
+
+/*
+ * Static resources read from the database, kept in memory and shared
+ * between responses until the static_resources table changes.
+ * Resources are dropped oldest first to stay within the budget.
+ */
+typedef struct _StaticResourceCache {
+	// Keys are "<host>/<key>", so lookups don't need the database
+	StaticResources resources;
+	size_t bytes;
+	size_t max_bytes;
+	// Bumped when the cache is cleared
+	unsigned long generation;
+	pthread_mutex_t lock;
+} StaticResourceCache;
 
 ///// Types for API calls /////
 
+/*
+ * A theme, which determines the look of a server's pages
+ */
+typedef struct _Theme {
+	int id;
+	// mustache template for content pages
+	char* template;
+} Theme;
+
+DA_TYPEDEF(Theme, Themes);
+
+/*
+ * Types for manipulating themes
+ */
+typedef struct _NewTheme {
+	bool valid;
+	char* template;
+} NewTheme;
+
+typedef struct _NewThemeResponse {
+	bool success;
+	char* error_message;
+	Theme theme;
+} NewThemeResponse;
+
+typedef struct _PatchTheme {
+	bool valid;
+	int id;
+	char* template;
+} PatchTheme;
+
+typedef struct _PatchThemeResponse {
+	bool success;
+	char* error_message;
+} PatchThemeResponse;
+
 /*
  * Represents a virtual host, i.e. a website 
  * hosted in the same ccms instance.
@@ -136,6 +490,18 @@ typedef struct _Server {
 
 DA_TYPEDEF(Server, Servers);
 
+/*
+ * The servers, kept in memory so that requests' Host headers can be
+ * resolved without the database. Reloaded after the server table changes.
+ */
+typedef struct _ServerSnapshot {
+	Servers servers;
+	bool loaded;
+	// Bumped when the snapshot is dropped
+	unsigned long generation;
+	pthread_mutex_t lock;
+} ServerSnapshot;
+
 /*
  * Types for manipulating servers
  */
@@ -226,6 +592,92 @@ typedef struct _PatchPageContentResponse {
 	char* error_message;
 } PatchPageContentResponse;
 
+/*
+ * Families of requests, which metrics are kept for separately
+ */
+typedef enum {
+	ROUTE_CONTENT,
+	ROUTE_STATIC,
+	ROUTE_API_PAGE,
+	ROUTE_API_PAGE_CONTENT,
+	ROUTE_API_SERVER,
+	ROUTE_API_THEME,
+	ROUTE_API_OTHER,
+	ROUTE_EDITOR,
+	ROUTE_METRICS,
+	ROUTE_COUNT,
+} Route;
+
+/*
+ * Parts of handling a request, which are timed separately
+ */
+typedef enum {
+	// Working out which server a content request's Host is for
+	STAGE_HOST,
+	// Each cached statement, from being handed out to being reset
+	STAGE_SQL,
+	STAGE_MARKDOWN,
+	STAGE_TEMPLATE,
+	// Making the response and queueing it with MHD
+	STAGE_QUEUE,
+	STAGE_COUNT,
+} Stage;
+
+// Four buckets for every doubling, from 1us up to 32s
+#define HISTOGRAM_BUCKETS 96
+
+/*
+ * Latency histogram with log-linear buckets, like HDR histograms, so
+ * every bucket is within 25% of the values in it. Updated with relaxed
+ * atomics, so recording doesn't take a lock.
+ */
+typedef struct _Histogram {
+	// By microseconds, see histogram_bucket. The last is for anything over.
+	unsigned long counts[HISTOGRAM_BUCKETS + 1];
+	unsigned long sum_ns;
+} Histogram;
+
+/*
+ * Counters and timings, served in Prometheus' text format
+ */
+typedef struct _Metrics {
+	Histogram routes[ROUTE_COUNT];
+	// Responses by route and status class, 1xx to 5xx
+	unsigned long responses[ROUTE_COUNT][5];
+	Histogram stages[STAGE_COUNT];
+} Metrics;
+
+/*
+ * Time spent in each stage by the request the current thread is
+ * handling, if it's being traced, and which request that is, for the
+ * probes
+ */
+typedef struct _RequestTrace {
+	bool active;
+	const char* host;
+	const char* path;
+	unsigned long stage_ns[STAGE_COUNT];
+	int stage_counts[STAGE_COUNT];
+} RequestTrace;
+
+/*
+ * Text being built up, e.g. the metrics page
+ */
+typedef struct _Text {
+	char* data;
+	size_t length;
+	size_t capacity;
+} Text;
+
+/*
+ * A request's body, built up as the http server hands it over
+ */
+typedef struct _RequestBody {
+	// NUL terminated, NULL if nothing's arrived
+	char* data;
+	size_t length;
+} RequestBody;
+
 /*
  * Structure to encapsulate an HTTP response,
  * agnostic of any specific web server implementation.
@@ -234,17 +686,324 @@ typedef struct _HttpResponse {
 	int status_code;
 	char* content;
 	size_t content_length;
-	char* content_type;
+	// A string literal, or allocated from the request arena
+	const char* content_type;
+	// If set, content points into this and the response holds a
+	// reference to it, rather than owning content
+	SharedBuffer* shared;
+	// If set, there's no content, it's rendered by this as it's sent.
+	// The response owns it.
+	PageStream* stream;
+	// If set, there's no content, it's sent as these pieces.
+	// The response owns it.
+	PageIovec* iovec;
+	// Validators for conditional requests, if the content has them.
+	// Either can be NULL / 0. The etag is allocated from the request arena.
+	const char* etag;
+	time_t last_modified;
+	// Which family of request this was, for metrics
+	Route route;
 } HttpResponse;
 
+/*
+ * A fully rendered content page, held in the page cache.
+ * Entries are chained per hash bucket, and also linked into
+ * a least-recently-used list for eviction.
+ */
+typedef struct _PageCacheEntry {
+	// The key; the resolved server, rather than the Host header,
+	// so that all hostnames falling back to the default server share entries
+	int server_id;
+	char* relative_path;
+	char* language;
+	uint32_t hash;
+
+	// The rendered page, shared with the responses sending it
+	SharedBuffer* html;
+	PageValidators validators;
+
+	struct _PageCacheEntry* bucket_next;
+	struct _PageCacheEntry* lru_prev;
+	struct _PageCacheEntry* lru_next;
+} PageCacheEntry;
+
+/*
+ * Bounded cache of rendered content pages, keyed by
+ * (server id, relative path, language).
+ */
+typedef struct _PageCache {
+	PageCacheEntry** buckets;
+	size_t bucket_count;
+	// Most recently used entry at the head, next to be evicted at the tail
+	PageCacheEntry* lru_head;
+	PageCacheEntry* lru_tail;
+	size_t entry_count;
+	// Bytes currently held, and the most we're allowed to hold
+	size_t bytes;
+	size_t max_bytes;
+
+	// Counters, for sizing the cache
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long invalidations;
+
+	// Bumped on every invalidation, so a page rendered from data that
+	// changed while it was rendering isn't stored
+	unsigned long generation;
+	pthread_mutex_t lock;
+} PageCache;
+
+/*
+ * Caches the writer's changes have made stale, which are emptied once
+ * they're committed, see database_update_hook
+ */
+typedef struct _DirtyCaches {
+	bool pages;
+	bool templates;
+	bool static_resources;
+	bool servers;
+} DirtyCaches;
+
+/*
+ * Background WAL checkpointing
+ */
+typedef struct _Checkpointer {
+	// Separate from the writer, so checkpoints don't hold it up
+	sqlite3* conn;
+	pthread_t thread;
+	bool running;
+	bool stopping;
+	// Pages in the WAL as of the last commit
+	int wal_pages;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} Checkpointer;
+
+/*
+ * How serious a log message is. Messages less serious than
+ * the configured level are dropped.
+ */
+typedef enum {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+} LogLevel;
+
+// Records the log's ring holds, a power of two
+#define LOG_RING_SIZE 4096
+#define LOG_MESSAGE_SIZE 240
+// Largest encoded request a capture can hold, see log_capture
+#define CAPTURE_RECORD_SIZE 480
+// Starts a capture file, followed by a version number
+#define CAPTURE_MAGIC "CCMSCAP"
+#define CAPTURE_VERSION '1'
+
+typedef enum {
+	LOG_RECORD_MESSAGE,
+	LOG_RECORD_ACCESS,
+	LOG_RECORD_CAPTURE,
+} LogRecordKind;
+
+/*
+ * An access log record, log message or captured request, waiting in
+ * the ring for the writer thread. Fixed size, so logging never allocates.
+ */
+typedef struct _LogRecord {
+	// The ring position this slot can next be claimed for, or
+	// one more than that once it's published, see log_claim
+	size_t sequence;
+	LogRecordKind kind;
+	LogLevel level;
+	// Wall clock time it was logged
+	struct timespec time;
+	union {
+		struct {
+			char method[8];
+			char host[64];
+			char path[152];
+			int status;
+			// -1 when the length isn't known up front, as for streamed pages
+			long bytes;
+			// From the request arriving to the response being queued
+			unsigned long duration_us;
+		} access;
+		char message[LOG_MESSAGE_SIZE];
+		// Already encoded, as it's written to the capture file
+		struct {
+			size_t length;
+			unsigned char data[CAPTURE_RECORD_SIZE];
+		} capture;
+	} body;
+} LogRecord;
+
+/*
+ * Log records go into a bounded lock-free ring, which any thread can
+ * push to, and are written out by a single background thread so that
+ * requests never wait on the terminal, a pipe or the disk. If the
+ * ring is full records are dropped and counted, rather than waiting.
+ */
+typedef struct _Log {
+	LogRecord* records;
+	// Next position to claim, shared by every logging thread
+	size_t head __attribute__((aligned(64)));
+	// Next position to write out, only used by the writer
+	size_t tail __attribute__((aligned(64)));
+	unsigned long dropped;
+	// Where access records go, messages go to stderr
+	FILE* access_file;
+	// Where captured requests go, if they're being captured
+	FILE* capture_file;
+	// When capturing started, which requests' times are relative to
+	struct timespec capture_started;
+	// Requests that were too large to capture
+	unsigned long capture_skipped;
+	pthread_t thread;
+	bool running;
+	bool stopping;
+} Log;
+
+/*
+ * Runtime configuration, populated from the command line.
+ */
+typedef struct _Config {
+	// Path to the sqlite database file
+	const char* database_path;
+	// Port for the http server to listen on
+	int port;
+	// Memory budget for the rendered page cache, 0 disables it
+	size_t page_cache_bytes;
+	// Memory budget for static resources kept in memory, 0 disables it
+	size_t static_cache_bytes;
+	// Size of the http server's thread pool, 0 for one per CPU.
+	// Also how many idle read-only database connections are kept.
+	int threads;
+	// Use a thread for each connection rather than a pool
+	bool thread_per_connection;
+	// sqlite's synchronous setting: off, normal, full or extra
+	const char* synchronous;
+	// Checkpoint the WAL in the background once it has this many pages,
+	// 0 leaves it to sqlite's automatic checkpoints on commit
+	int checkpoint_pages;
+	// Check the query plans of the page queries and exit
+	bool check_plans;
+	// Send pages that aren't cached as a list of pieces, rather than
+	// streaming them as they're rendered
+	bool iovec_pages;
+	// File for the access log, - for stdout
+	const char* access_log_path;
+	// Log 1 in this many requests, 0 for none. Server errors are always logged.
+	int access_log_sample;
+	// The least serious messages to log
+	LogLevel log_level;
+	// Path metrics are served at, NULL for none
+	const char* metrics_path;
+	// Send a Server-Timing header with every response, rather than
+	// only when the request has an X-Server-Timing header
+	bool server_timing;
+	// Log requests which take at least this long, 0 for none
+	unsigned long slow_request_ms;
+	// File to capture requests to, for replaying, NULL for none
+	const char* capture_path;
+} Config;
+
 
 ///////////// Globals ////////////////
- 
+
 // The web server http_server_daemon
 static struct MHD_Daemon* http_server_daemon;
 
-// The database
-static sqlite3* db;
+// The database connection for the request the current thread is handling.
+// Content is read through a pooled read-only connection, the API uses the writer.
+static __thread Connection* connection;
+// The current connection's sqlite handle, which queries use
+static __thread sqlite3* db;
+
+// Memory for the request the current thread is handling,
+// which is all freed once the response has been queued
+static __thread Arena request_arena;
+
+// The only connection that writes, used by one request at a time
+static Connection* db_writer;
+static pthread_mutex_t db_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+// Only touched while holding the writer
+static DirtyCaches dirty_caches;
+
+// Idle read-only connections
+static Connections db_readers;
+static pthread_mutex_t db_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Checkpointer checkpointer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+// Rendered content pages
+static PageCache page_cache;
+
+// Compiled templates, by theme
+static ThemeTemplates theme_templates;
+static pthread_mutex_t theme_templates_lock = PTHREAD_MUTEX_INITIALIZER;
+// Bumped when the compiled templates are dropped
+static unsigned long theme_templates_generation;
+
+// Servers, for resolving hostnames
+static ServerSnapshot server_snapshot = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Navigation trees, shared between pages
+static NavCache nav_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Static resources, shared between responses
+static StaticResourceCache static_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Access log and messages, written out in the background
+static Log log_writer;
+// Requests the current thread has handled, for sampling the access log
+static __thread unsigned long requests_handled;
+
+// Request counts and timings
+static Metrics metrics;
+// Their labels, which captures also name routes by
+static const char* route_names[ROUTE_COUNT] = {
+	[ROUTE_CONTENT] = "content",
+	[ROUTE_STATIC] = "static",
+	[ROUTE_API_PAGE] = "api/page",
+	[ROUTE_API_PAGE_CONTENT] = "api/page_content",
+	[ROUTE_API_SERVER] = "api/server",
+	[ROUTE_API_THEME] = "api/theme",
+	[ROUTE_API_OTHER] = "api/other",
+	[ROUTE_EDITOR] = "editor.html",
+	[ROUTE_METRICS] = "metrics",
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+	[STAGE_HOST] = "host",
+	[STAGE_SQL] = "sql",
+	[STAGE_MARKDOWN] = "markdown",
+	[STAGE_TEMPLATE] = "template",
+	[STAGE_QUEUE] = "queue",
+};
+
+// Timings for the request the current thread is handling
+static __thread RequestTrace request_trace;
+
+// Configuration, with defaults
+static Config config = {
+	.database_path = "ccms.db",
+	.port = 8000,
+	.page_cache_bytes = 16 * 1024 * 1024,
+	.static_cache_bytes = 64 * 1024 * 1024,
+	.threads = 0,
+	.thread_per_connection = false,
+	// Normal is durable in WAL mode, apart from the last commits on power loss
+	.synchronous = "normal",
+	.checkpoint_pages = 1000,
+	.access_log_path = "-",
+	.access_log_sample = 1,
+	.log_level = LOG_LEVEL_INFO,
+	.metrics_path = "/metrics",
+};
 
 ///////////// Functions ///////////////
 
@@ -261,385 +1020,3580 @@ char* strdup(const char* str) {
 }
 
 /*
- * Open the database and run the initialization script.
+ * FNV-1a hash of a null-terminated string, continuing from h.
+ * Start with 2166136261 for a fresh hash.
  */
-void initialize_database(const char* database_path) {
-	sqlite_check(db, sqlite3_open(database_path, &db));
-	char* initial_script = null_terminated_resource(src_initial_sql);
-	sqlite_check(db, sqlite3_exec(db, initial_script, NULL, NULL, NULL));
-	free(initial_script);
+uint32_t hash_string(uint32_t h, const char* str) {
+	for (const unsigned char* c = (const unsigned char*)str; *c != '\0'; c++) {
+		h ^= *c;
+		h *= 16777619;
+	}
+	return h;
+}
+
+void free_strings(Strings s) {
+	for (int i=0; i<da_count(s); i++) {
+		free(da_get(s, i));
+	}
+	da_free(s);
 }
 
 /*
- * Serializes a json_object to a string and wraps it up in an 
- * HttpResponse for return to the http server library
+ * Allocates memory from an arena, aligned for any type.
+ * It's valid until the arena is reset.
  */
-HttpResponse http_json_response(struct json_object* obj, int status_code) {
-	char* jsonstr = (char*)json_object_to_json_string(obj);
-	HttpResponse ret = {
-		.content = strdup(jsonstr),
-		.content_length = strlen(jsonstr),
-		.content_type = strdup("application/json"),
-		.status_code = status_code,
-	};
-	return ret;
+void* arena_alloc(Arena* a, size_t size) {
+	size = (size + 15) & ~(size_t)15;
+	if (a->blocks == NULL || a->used + size > a->blocks->size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		ArenaBlock* b = malloc(sizeof(ArenaBlock) + block_size);
+		b->next = a->blocks;
+		b->size = block_size;
+		a->blocks = b;
+		a->used = 0;
+	}
+	void* p = a->blocks->data + a->used;
+	a->used += size;
+	return p;
+}
+
+char* arena_strdup(Arena* a, const char* str) {
+	size_t len = strlen(str) + 1;
+	char* r = arena_alloc(a, len);
+	memcpy(r, str, len);
+	return r;
 }
 
 /*
- * Wraps an error message in a JSON string, i.e:
- * { "error": "your message here" }
- * Caller is responsible for freeing the string.
+ * Frees everything allocated from an arena.
  */
-HttpResponse http_error_response(char* errmsg, int status_code) {
-	struct json_object* obj = json_object_new_object();
-	json_object_object_add(obj, "error", json_object_new_string(errmsg));
-	HttpResponse ret = http_json_response(obj, status_code);
-	json_object_put(obj);
-	return ret;
+void arena_free(Arena* a) {
+	while (a->blocks != NULL) {
+		ArenaBlock* next = a->blocks->next;
+		free(a->blocks);
+		a->blocks = next;
+	}
+	a->used = 0;
 }
 
-
-///////////// Content /////////////////
+/*
+ * Frees everything allocated from an arena, keeping a block for
+ * reuse. If more than one block was needed, they're replaced with one
+ * big enough for all of it, so that the next use needn't allocate.
+ */
+void arena_reset(Arena* a) {
+	if (a->blocks != NULL && a->blocks->next != NULL) {
+		size_t total = 0;
+		for (ArenaBlock* b = a->blocks; b != NULL; b = b->next) {
+			total += b->size;
+		}
+		arena_free(a);
+		arena_alloc(a, total);
+	}
+	a->used = 0;
+}
 
 /*
- * Finds the page contents, given a particular host, path, and language.
+ * Allocates a shared buffer with one reference, for the caller.
+ * The contents are uninitialized.
  */
-PageData find_page_data(const char* host, 
-		const char* path, 
-		const char* lang) {
-	printf("Looking for page with host %s path %s lang %s\n",
-			host, 
-			path,
-			lang);
-	sqlite3_stmt* stmt;
-	int v;
+SharedBuffer* shared_buffer_new(size_t length) {
+	SharedBuffer* b = malloc(sizeof(SharedBuffer) + length);
+	b->refs = 1;
+	b->length = length;
+	return b;
+}
 
-	// Populate page data
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-			"select t.template, t.id, pc.title, pc.content, pc.language "
-			"from server s "
-			"left outer join page p "
-				"on s.id = p.server_id "
-				"and p.relative_path = ? "
-			"left outer join page_content pc "
-				"on pc.page_id = p.id "
-				"and pc.language = 'en' "
-			"join theme t on t.id = s.theme_id "
-			"where (s.hostname = ? or s.is_default) "
-			"order by s.is_default ", -1, &stmt, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 1, path, -1, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 2, host, -1, NULL));
-	v  = sqlite3_step(stmt);
-	if (v == SQLITE_DONE) {
-		printf("Couldn't find default server OOPS!\n");
-		raise(SIGTERM);
-	} else if (v != SQLITE_ROW) {
-		sqlite_check(db, v);
-	}
-	const char* template = (const char*)sqlite3_column_text(stmt, 0);
-	int theme_id = sqlite3_column_int(stmt, 1);
-	const char* title = (const char*)sqlite3_column_text(stmt, 2);
-	const char* content = (const char*)sqlite3_column_text(stmt, 3);
-	const char* language = (const char*)sqlite3_column_text(stmt, 4);
-
-	// Render content with markdown
-	// The returned string is our own, we will free it later
-	char* rendered_content = NULL;
-	if (content != NULL) {
-		rendered_content = cmark_markdown_to_html(content, strlen(content), 0);
-	} else {
-		rendered_content = strdup("Not found!"); // TODO customizable error page
+SharedBuffer* shared_buffer_retain(SharedBuffer* b) {
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void shared_buffer_release(SharedBuffer* b) {
+	if (b != NULL && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(b);
 	}
+}
 
-	// Construct the PageData
-	ThemeContentItems tci = {0};
-	NavItems ni = {0};
-	PageData pl = {
-		.template = strdup(template),
-		.content_items= tci,
-		.title = strdup(title != NULL ? title : "Not Found!"),
-		.content = rendered_content,
-		.nav_items = ni,
-		.navix = 0,
-		.isnav = 0,
-		.language = strdup(language != NULL ? language : "en"), // Possibly should be server default language
-		.isnotfound = content == NULL,
-	};
-	sqlite_check(db, sqlite3_finalize(stmt));
+/*
+ * MHD free callback for responses made from a shared buffer's data.
+ */
+void shared_buffer_release_data(void* data) {
+	shared_buffer_release((SharedBuffer*)((char*)data - offsetof(SharedBuffer, data)));
+}
 
-	// Fetch the theme contents
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select key, value "
-				"from theme_content "
-				"where theme_id = ? "
-				"and language = 'en'", -1, &stmt, NULL)); // TODO language selection
-	sqlite_check(db, sqlite3_bind_int(stmt, 1, theme_id));
-	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
-		ThemeContentItem tci = {
-		  .name = strdup((const char*)sqlite3_column_text(stmt, 0)),
-		  .value = strdup((const char*)sqlite3_column_text(stmt, 1)),
-		};
-		da_push(pl.content_items, tci);
+/*
+ * Nanoseconds from start until now, both from CLOCK_MONOTONIC
+ */
+unsigned long elapsed_since(struct timespec start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000000000UL + now.tv_nsec - start.tv_nsec;
+}
+
+/*
+ * The histogram bucket for a number of microseconds. Exact below 4,
+ * then each power of two is split into 4.
+ */
+int histogram_bucket(unsigned long us) {
+	if (us < 4) {
+		return us;
+	}
+	int octave = 63 - __builtin_clzl(us);
+	int bucket = (octave - 1) * 4 + ((us >> (octave - 2)) & 3);
+	return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS;
+}
+
+/*
+ * The microseconds the values in a bucket are below
+ */
+unsigned long histogram_bucket_limit(int bucket) {
+	if (bucket < 4) {
+		return bucket + 1;
+	}
+	int octave = bucket / 4 + 1;
+	return (unsigned long)(4 + bucket % 4 + 1) << (octave - 2);
+}
+
+void histogram_record(Histogram* h, unsigned long ns) {
+	__atomic_add_fetch(&h->counts[histogram_bucket(ns / 1000)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+void record_stage(Stage stage, unsigned long ns) {
+	histogram_record(&metrics.stages[stage], ns);
+	if (request_trace.active) {
+		request_trace.stage_ns[stage] += ns;
+		request_trace.stage_counts[stage]++;
+	}
+}
+
+/*
+ * Counts a response, and how long it took from the request arriving
+ */
+void record_response(Route route, int status_code, unsigned long ns) {
+	int status_class = status_code / 100 - 1;
+	if (status_class >= 0 && status_class < 5) {
+		__atomic_add_fetch(&metrics.responses[route][status_class], 1, __ATOMIC_RELAXED);
+	}
+	histogram_record(&metrics.routes[route], ns);
+}
+
+#ifdef CCMS_USDT
+/*
+ * Called by sqlite as each statement starts and finishes running, on
+ * any connection, to fire the SQL probes. Triggers are reported as
+ * starting too, as a comment naming them, but not as finishing, so
+ * they're left to count as part of their statement.
+ */
+int sql_probe_trace(unsigned event, void* cls, void* p, void* x) {
+	if (event == SQLITE_TRACE_STMT && strncmp(x, "--", 2) != 0) {
+		PROBE(sql__start, request_trace.host, request_trace.path, sqlite3_sql(p));
+	} else if (event == SQLITE_TRACE_PROFILE) {
+		PROBE(sql__done, request_trace.host, request_trace.path, sqlite3_sql(p),
+				*(sqlite3_int64*)x);
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Opens a database connection.
+ */
+Connection* open_connection(const char* database_path, int flags) {
+	Connection* c = malloc(sizeof(Connection));
+	CachedStatements statements = {0};
+	c->statements = statements;
+	c->db = NULL;
+	sqlite_check(c->db, sqlite3_open_v2(database_path, &c->db, flags, NULL));
+	// Checkpoints can briefly hold the write lock, and readers wait
+	// while the WAL index is being recovered
+	sqlite_check(c->db, sqlite3_busy_timeout(c->db, 5000));
+#ifdef CCMS_USDT
+	sqlite_check(c->db, sqlite3_trace_v2(c->db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE,
+				sql_probe_trace, NULL));
+#endif
+	return c;
+}
+
+/*
+ * Finalizes the connection's cached statements, e.g. before closing it.
+ */
+void clear_statement_cache(Connection* c) {
+	for (int i = 0; i < da_count(c->statements); i++) {
+		sqlite3_finalize(da_get(c->statements, i).stmt);
+	}
+	da_clear(c->statements);
+}
+
+void close_connection(Connection* c) {
+	clear_statement_cache(c);
+	da_free(c->statements);
+	sqlite3_close(c->db);
+	free(c);
+}
+
+/*
+ * Gets a prepared statement for sql on the current connection,
+ * preparing it the first time. sql must be a string literal (or otherwise
+ * live forever), statements are found by its address.
+ * Hand the statement back with finish_cached rather than finalizing it,
+ * and don't use it again until then.
+ */
+sqlite3_stmt* prepare_cached(const char* sql) {
+	for (int i = 0; i < da_count(connection->statements); i++) {
+		CachedStatement* cs = da_getptr(connection->statements, i);
+		if (cs->sql == sql) {
+			clock_gettime(CLOCK_MONOTONIC, &cs->started);
+			return cs->stmt;
+		}
+	}
+	CachedStatement cs = {
+		.sql = sql,
+		.stmt = NULL,
+	};
+	clock_gettime(CLOCK_MONOTONIC, &cs.started);
+	sqlite_check(db, sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &cs.stmt, NULL));
+	da_push(connection->statements, cs);
+	return cs.stmt;
+}
+
+/*
+ * Resets a cached statement for its next use. Bindings are cleared too,
+ * as they may point at memory that's about to be freed.
+ */
+void finish_cached(sqlite3_stmt* stmt) {
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	for (int i = 0; i < da_count(connection->statements); i++) {
+		CachedStatement* cs = da_getptr(connection->statements, i);
+		if (cs->stmt == stmt) {
+			record_stage(STAGE_SQL, elapsed_since(cs->started));
+			break;
+		}
 	}
+}
+
+/*
+ * Runs a statement which doesn't return rows, keeping it prepared
+ */
+void exec_cached(const char* sql) {
+	sqlite3_stmt* stmt = prepare_cached(sql);
+	int v = sqlite3_step(stmt);
 	if (v != SQLITE_DONE) {
 		sqlite_check(db, v);
 	}
-	sqlite_check(db, sqlite3_finalize(stmt));
+	finish_cached(stmt);
+}
+
+///////////// Logging /////////////////
+
+/*
+ * Claims the next record in the log's ring for the caller to fill in
+ * and then pass to log_publish. Returns NULL if the record should be
+ * dropped, because the ring is full.
+ */
+LogRecord* log_claim(size_t* position) {
+	size_t pos = __atomic_load_n(&log_writer.head, __ATOMIC_RELAXED);
+	for (;;) {
+		LogRecord* record = &log_writer.records[pos & (LOG_RING_SIZE - 1)];
+		size_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+		if (sequence == pos) {
+			// Free, as long as no one else claims it first
+			if (__atomic_compare_exchange_n(&log_writer.head, &pos, pos + 1,
+						true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*position = pos;
+				return record;
+			}
+		} else if ((ptrdiff_t)(sequence - pos) < 0) {
+			// Still holding the record from a lap ago, the writer is behind
+			__atomic_add_fetch(&log_writer.dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&log_writer.head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Hands a claimed record over to the writer
+ */
+void log_publish(LogRecord* record, size_t position) {
+	__atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies a request string into a record, truncating it, and replacing
+ * anything that could break up the log line.
+ */
+void log_copy(char* to, size_t size, const char* from) {
+	size_t i = 0;
+	for (; from != NULL && from[i] != 0 && i < size - 1; i++) {
+		unsigned char c = from[i];
+		to[i] = c < 0x20 || c == 0x7f || c == '"' ? '?' : c;
+	}
+	to[i] = 0;
+}
+
+/*
+ * Logs a message at the given level, printf style. Before the writer
+ * has started (or after it's stopped) it's written to stderr directly.
+ */
+void log_message(LogLevel level, const char* format, ...) {
+	if (level > config.log_level) {
+		return;
+	}
+	va_list args;
+	va_start(args, format);
+	if (!log_writer.running) {
+		vfprintf(stderr, format, args);
+		fputc('\n', stderr);
+	} else {
+		size_t position;
+		LogRecord* record = log_claim(&position);
+		if (record != NULL) {
+			record->kind = LOG_RECORD_MESSAGE;
+			record->level = level;
+			clock_gettime(CLOCK_REALTIME, &record->time);
+			vsnprintf(record->body.message, sizeof(record->body.message), format, args);
+			log_publish(record, position);
+		}
+	}
+	va_end(args);
+}
+
+/*
+ * Adds a request to the access log, if it's sampled
+ */
+void log_access(const char* method,
+		const char* host,
+		const char* path,
+		int status,
+		long bytes,
+		unsigned long duration_ns) {
+	if (!log_writer.running || config.access_log_sample <= 0) {
+		return;
+	}
+	requests_handled++;
+	if (status < 500 && requests_handled % config.access_log_sample != 0) {
+		return;
+	}
+	size_t position;
+	LogRecord* record = log_claim(&position);
+	if (record == NULL) {
+		return;
+	}
+	record->kind = LOG_RECORD_ACCESS;
+	record->level = LOG_LEVEL_INFO;
+	clock_gettime(CLOCK_REALTIME, &record->time);
+	log_copy(record->body.access.method, sizeof(record->body.access.method), method);
+	log_copy(record->body.access.host, sizeof(record->body.access.host), host);
+	log_copy(record->body.access.path, sizeof(record->body.access.path), path);
+	record->body.access.status = status;
+	record->body.access.bytes = bytes;
+	record->body.access.duration_us = duration_ns / 1000;
+	log_publish(record, position);
+}
+
+// Request headers that are captured, as they change what's sent back
+static const char* capture_headers[] = {
+	MHD_HTTP_HEADER_ACCEPT_LANGUAGE,
+	MHD_HTTP_HEADER_ACCEPT_ENCODING,
+	MHD_HTTP_HEADER_IF_NONE_MATCH,
+	MHD_HTTP_HEADER_IF_MODIFIED_SINCE,
+	"X-Server-Timing",
+};
+
+/*
+ * Appends an unsigned little endian number of the given number of bytes.
+ * The buffer's size is checked once the record's been put together.
+ */
+void capture_put(unsigned char* data, size_t* length, unsigned long long value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		if (*length < CAPTURE_RECORD_SIZE) {
+			data[*length] = value >> (8 * i);
+		}
+		(*length)++;
+	}
+}
+
+/*
+ * Appends a string, as a 16 bit length and its bytes
+ */
+void capture_put_string(unsigned char* data, size_t* length, const char* s) {
+	size_t n = s != NULL ? strlen(s) : 0;
+	capture_put(data, length, n, 2);
+	if (*length + n <= CAPTURE_RECORD_SIZE) {
+		memcpy(data + *length, s, n);
+	}
+	*length += n;
+}
+
+/*
+ * Adds a request to the capture file, if requests are being captured.
+ * Each is written as:
+ *   u16 length of the rest of the record
+ *   u64 microseconds from the capture starting to the request arriving
+ *   u32 microseconds taken to handle it
+ *   u16 status
+ *   u8  route, indexing the names in the file's header
+ *   u8  number of headers
+ *   string method, Host and path
+ *   string name and value for each header
+ * with numbers little endian, and strings as a u16 length then the bytes.
+ * Requests that don't fit in a record are counted and left out.
+ */
+void log_capture(struct MHD_Connection* http_connection,
+		const char* method,
+		const char* host,
+		const char* path,
+		struct timespec arrived,
+		Route route,
+		int status,
+		unsigned long duration_ns) {
+	if (!log_writer.running || log_writer.capture_file == NULL) {
+		return;
+	}
+	size_t position;
+	LogRecord* record = log_claim(&position);
+	if (record == NULL) {
+		return;
+	}
+	unsigned char* data = record->body.capture.data;
+	size_t length = 2;
+	long long offset_ns = (arrived.tv_sec - log_writer.capture_started.tv_sec) * 1000000000LL
+		+ (arrived.tv_nsec - log_writer.capture_started.tv_nsec);
+	capture_put(data, &length, offset_ns > 0 ? offset_ns / 1000 : 0, 8);
+	capture_put(data, &length, duration_ns / 1000, 4);
+	capture_put(data, &length, status, 2);
+	capture_put(data, &length, route, 1);
+	const char* values[sizeof(capture_headers) / sizeof(capture_headers[0])];
+	int header_count = 0;
+	for (size_t i = 0; i < sizeof(capture_headers) / sizeof(capture_headers[0]); i++) {
+		values[i] = MHD_lookup_connection_value(http_connection, MHD_HEADER_KIND, capture_headers[i]);
+		if (values[i] != NULL) {
+			header_count++;
+		}
+	}
+	capture_put(data, &length, header_count, 1);
+	capture_put_string(data, &length, method);
+	capture_put_string(data, &length, host);
+	capture_put_string(data, &length, path);
+	for (size_t i = 0; i < sizeof(capture_headers) / sizeof(capture_headers[0]); i++) {
+		if (values[i] != NULL) {
+			capture_put_string(data, &length, capture_headers[i]);
+			capture_put_string(data, &length, values[i]);
+		}
+	}
+	if (length > CAPTURE_RECORD_SIZE) {
+		// Published anyway, the ring can't skip a claimed record
+		__atomic_add_fetch(&log_writer.capture_skipped, 1, __ATOMIC_RELAXED);
+		length = 0;
+	} else {
+		size_t start = 0;
+		capture_put(data, &start, length - 2, 2);
+	}
+	record->kind = LOG_RECORD_CAPTURE;
+	record->body.capture.length = length;
+	log_publish(record, position);
+}
+
+/*
+ * Writes a record out, as a line in the access log or on stderr,
+ * or a captured request
+ */
+void write_log_record(LogRecord* record) {
+	if (record->kind == LOG_RECORD_CAPTURE) {
+		fwrite(record->body.capture.data, 1, record->body.capture.length, log_writer.capture_file);
+		return;
+	}
+	struct tm tm;
+	gmtime_r(&record->time.tv_sec, &tm);
+	char time[32];
+	strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &tm);
+	int ms = record->time.tv_nsec / 1000000;
+	if (record->kind == LOG_RECORD_ACCESS) {
+		char bytes[24] = "-";
+		if (record->body.access.bytes >= 0) {
+			snprintf(bytes, sizeof(bytes), "%ld", record->body.access.bytes);
+		}
+		fprintf(log_writer.access_file, "%s.%03dZ %s \"%s %s\" %d %s %luus\n",
+				time,
+				ms,
+				record->body.access.host[0] != 0 ? record->body.access.host : "-",
+				record->body.access.method,
+				record->body.access.path,
+				record->body.access.status,
+				bytes,
+				record->body.access.duration_us);
+	} else {
+		static const char* level_names[] = {"error", "warning", "info", "debug"};
+		fprintf(stderr, "%s.%03dZ %s %s\n", time, ms, level_names[record->level],
+				record->body.message);
+	}
+}
+
+/*
+ * Writes out records as they're published. Sleeps briefly
+ * when there's nothing to write, so logging never has to wake it.
+ */
+void* run_log_writer(void* arg) {
+	unsigned long dropped = 0;
+	for (;;) {
+		// Checked before draining, so nothing logged before stopping is lost
+		bool stopping = __atomic_load_n(&log_writer.stopping, __ATOMIC_ACQUIRE);
+		int written = 0;
+		for (;;) {
+			size_t tail = log_writer.tail;
+			LogRecord* record = &log_writer.records[tail & (LOG_RING_SIZE - 1)];
+			if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != tail + 1) {
+				break;
+			}
+			write_log_record(record);
+			// Free for the next lap
+			__atomic_store_n(&record->sequence, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+			log_writer.tail = tail + 1;
+			written++;
+		}
+		unsigned long now_dropped = __atomic_load_n(&log_writer.dropped, __ATOMIC_RELAXED);
+		if (now_dropped != dropped) {
+			fprintf(stderr, "Log ring full, %lu records dropped\n", now_dropped - dropped);
+			dropped = now_dropped;
+		}
+		if (written == 0) {
+			fflush(log_writer.access_file);
+			if (log_writer.capture_file != NULL) {
+				fflush(log_writer.capture_file);
+			}
+			fflush(stderr);
+			if (stopping) {
+				break;
+			}
+			struct timespec wait = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+			nanosleep(&wait, NULL);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Creates the capture file, starting with its header:
+ *   CAPTURE_MAGIC and CAPTURE_VERSION
+ *   u64 wall clock time capturing started, in microseconds since 1970
+ *   u8  number of routes, then their names as strings
+ * then requests follow as log_capture writes them.
+ */
+void start_capture() {
+	log_writer.capture_file = fopen(config.capture_path, "wb");
+	if (log_writer.capture_file == NULL) {
+		perror(config.capture_path);
+		raise(SIGTERM);
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &log_writer.capture_started);
+	unsigned char header[CAPTURE_RECORD_SIZE];
+	size_t length = 0;
+	for (const char* c = CAPTURE_MAGIC; *c != '\0'; c++) {
+		capture_put(header, &length, *c, 1);
+	}
+	capture_put(header, &length, CAPTURE_VERSION, 1);
+	capture_put(header, &length, now.tv_sec * 1000000ULL + now.tv_nsec / 1000, 8);
+	capture_put(header, &length, ROUTE_COUNT, 1);
+	for (int r = 0; r < ROUTE_COUNT; r++) {
+		capture_put_string(header, &length, route_names[r]);
+	}
+	fwrite(header, 1, length, log_writer.capture_file);
+}
+
+/*
+ * Opens the access log, and the capture file if there is one, and
+ * starts writing out log records in the background. Until then
+ * messages go straight to stderr.
+ */
+void start_log_writer() {
+	if (strcmp(config.access_log_path, "-") == 0) {
+		log_writer.access_file = stdout;
+	} else {
+		log_writer.access_file = fopen(config.access_log_path, "a");
+		if (log_writer.access_file == NULL) {
+			perror(config.access_log_path);
+			raise(SIGTERM);
+		}
+	}
+	if (config.capture_path != NULL) {
+		start_capture();
+	}
+	log_writer.records = calloc(LOG_RING_SIZE, sizeof(LogRecord));
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+		log_writer.records[i].sequence = i;
+	}
+	log_writer.head = 0;
+	log_writer.tail = 0;
+	log_writer.stopping = false;
+	pthread_create(&log_writer.thread, NULL, run_log_writer, NULL);
+	log_writer.running = true;
+}
+
+/*
+ * Writes out anything still in the ring and stops the writer.
+ * Nothing else should be logging by now.
+ */
+void stop_log_writer() {
+	if (!log_writer.running) {
+		return;
+	}
+	__atomic_store_n(&log_writer.stopping, true, __ATOMIC_RELEASE);
+	pthread_join(log_writer.thread, NULL);
+	log_writer.running = false;
+	if (log_writer.access_file != stdout) {
+		fclose(log_writer.access_file);
+	}
+	log_writer.access_file = NULL;
+	if (log_writer.capture_file != NULL) {
+		fclose(log_writer.capture_file);
+		log_writer.capture_file = NULL;
+		if (log_writer.capture_skipped > 0) {
+			fprintf(stderr, "%lu requests were too large to capture\n", log_writer.capture_skipped);
+		}
+	}
+	free(log_writer.records);
+	log_writer.records = NULL;
+}
+
+///////////// Templates /////////////////
+
+// Entities for the characters that are special in HTML. Quotes are
+// included so that values are safe inside attributes.
+static const char* const html_entities[256] = {
+	['<'] = "&lt;",
+	['>'] = "&gt;",
+	['&'] = "&amp;",
+	['"'] = "&quot;",
+	['\''] = "&#39;",
+};
+
+// Lengths of html_entities, 0 for characters that don't need escaping
+static const unsigned char html_entity_lengths[256] = {
+	['<'] = 4,
+	['>'] = 4,
+	['&'] = 5,
+	['"'] = 6,
+	['\''] = 5,
+};
+
+// Escaping makes text at most this many times longer, &quot; for "
+#define HTML_ESCAPE_MAX_EXPANSION 6
+
+/*
+ * The entity to write for a character that's special in HTML, or NULL
+ */
+const char* html_entity(char c) {
+	return html_entities[(unsigned char)c];
+}
+
+/*
+ * Writes c to out, escaped if it needs to be.
+ * Returns how much was written.
+ */
+static inline size_t html_escape_char(char* out, char c) {
+	size_t length = html_entity_lengths[(unsigned char)c];
+	if (length == 0) {
+		*out = c;
+		return 1;
+	}
+	memcpy(out, html_entities[(unsigned char)c], length);
+	return length;
+}
+
+/*
+ * Finds the first character in text which needs escaping,
+ * or returns length if there isn't one. A byte at a time.
+ */
+size_t html_escape_scan_scalar(const char* text, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		if (html_entity_lengths[(unsigned char)text[i]] != 0) {
+			return i;
+		}
+	}
+	return length;
+}
+
+/*
+ * Escapes text a byte at a time
+ */
+size_t html_escape_scalar(char* out, const char* text, size_t length) {
+	size_t n = 0;
+	for (size_t i = 0; i < length; i++) {
+		n += html_escape_char(out + n, text[i]);
+	}
+	return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * A mask of which of the 16 bytes at text need escaping
+ */
+__attribute__((target("sse2")))
+static inline int html_special_mask_sse2(const char* text) {
+	__m128i v = _mm_loadu_si128((const __m128i*)text);
+	__m128i special = _mm_or_si128(
+		_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('>'))),
+		_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+			_mm_or_si128(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')))));
+	return _mm_movemask_epi8(special);
+}
+
+/*
+ * A mask of which of the 32 bytes at text need escaping
+ */
+__attribute__((target("avx2")))
+static inline unsigned html_special_mask_avx2(const char* text) {
+	__m256i v = _mm256_loadu_si256((const __m256i*)text);
+	__m256i special = _mm256_or_si256(
+		_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>'))),
+		_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+			_mm256_or_si256(
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')))));
+	return (unsigned)_mm256_movemask_epi8(special);
+}
+
+/*
+ * html_escape_scan_scalar, 16 bytes at a time
+ */
+__attribute__((target("sse2")))
+size_t html_escape_scan_sse2(const char* text, size_t length) {
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		int mask = html_special_mask_sse2(text + i);
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + html_escape_scan_scalar(text + i, length - i);
+}
+
+/*
+ * html_escape_scalar, copying 16 bytes at a time when none need escaping
+ */
+__attribute__((target("sse2")))
+size_t html_escape_sse2(char* out, const char* text, size_t length) {
+	size_t n = 0;
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		// Copy the whole block, then escape from its first special
+		// character on. out has room, it's at least 6 times longer.
+		int mask = html_special_mask_sse2(text + i);
+		_mm_storeu_si128((__m128i*)(out + n), _mm_loadu_si128((const __m128i*)(text + i)));
+		if (mask == 0) {
+			n += 16;
+		} else {
+			size_t first = __builtin_ctz(mask);
+			n += first;
+			for (size_t j = i + first; j < i + 16; j++) {
+				n += html_escape_char(out + n, text[j]);
+			}
+		}
+	}
+	return n + html_escape_scalar(out + n, text + i, length - i);
+}
+
+/*
+ * html_escape_scan_scalar, 32 bytes at a time. The 16 byte step is
+ * compiled for AVX here too, mixing in legacy SSE code would stall.
+ */
+__attribute__((target("avx2")))
+size_t html_escape_scan_avx2(const char* text, size_t length) {
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		unsigned mask = html_special_mask_avx2(text + i);
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	if (i + 16 <= length) {
+		int mask = html_special_mask_sse2(text + i);
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+		i += 16;
+	}
+	return i + html_escape_scan_scalar(text + i, length - i);
+}
+
+/*
+ * html_escape_scalar, copying 32 bytes at a time when none need escaping
+ */
+__attribute__((target("avx2")))
+size_t html_escape_avx2(char* out, const char* text, size_t length) {
+	size_t n = 0;
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		unsigned mask = html_special_mask_avx2(text + i);
+		_mm256_storeu_si256((__m256i*)(out + n), _mm256_loadu_si256((const __m256i*)(text + i)));
+		if (mask == 0) {
+			n += 32;
+		} else {
+			size_t first = __builtin_ctz(mask);
+			n += first;
+			for (size_t j = i + first; j < i + 32; j++) {
+				n += html_escape_char(out + n, text[j]);
+			}
+		}
+	}
+	return n + html_escape_scalar(out + n, text + i, length - i);
+}
+#endif
+
+typedef struct {
+	const char* name;
+	size_t (*scan)(const char* text, size_t length);
+	size_t (*escape)(char* out, const char* text, size_t length);
+} HtmlEscaper;
+
+static const HtmlEscaper html_escapers[] = {
+	{"scalar", html_escape_scan_scalar, html_escape_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+	{"sse2", html_escape_scan_sse2, html_escape_sse2},
+	{"avx2", html_escape_scan_avx2, html_escape_avx2},
+#endif
+};
+
+// Index into html_escapers, picked on first use
+static int html_escaper = -1;
+
+/*
+ * The fastest of html_escapers this CPU can run
+ */
+const HtmlEscaper* get_html_escaper() {
+	int i = __atomic_load_n(&html_escaper, __ATOMIC_RELAXED);
+	if (i < 0) {
+		i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			i = 2;
+		} else if (__builtin_cpu_supports("sse2")) {
+			i = 1;
+		}
+#endif
+		__atomic_store_n(&html_escaper, i, __ATOMIC_RELAXED);
+	}
+	return &html_escapers[i];
+}
+
+/*
+ * Finds the first character in text which needs escaping,
+ * or returns length if there isn't one.
+ */
+size_t html_escape_scan(const char* text, size_t length) {
+	return get_html_escaper()->scan(text, length);
+}
+
+/*
+ * Escapes text into out, which must have room for
+ * HTML_ESCAPE_MAX_EXPANSION times its length.
+ * Returns how much was written.
+ */
+size_t html_escape(char* out, const char* text, size_t length) {
+	return get_html_escaper()->escape(out, text, length);
+}
+
+/*
+ * Works out which part of the page data a tag name refers to.
+ */
+TemplateTag template_tag(const char* name) {
+	if (strcmp(name, "title") == 0) {
+		return TEMPLATE_TAG_TITLE;
+	} else if (strcmp(name, "content") == 0) {
+		return TEMPLATE_TAG_CONTENT;
+	} else if (strcmp(name, "language") == 0) {
+		return TEMPLATE_TAG_LANGUAGE;
+	} else if (strcmp(name, "nav") == 0) {
+		return TEMPLATE_TAG_NAV;
+	} else if (strcmp(name, "url") == 0) {
+		return TEMPLATE_TAG_URL;
+	} else if (strcmp(name, "depth") == 0) {
+		return TEMPLATE_TAG_DEPTH;
+	}
+	return TEMPLATE_TAG_THEME_ITEM;
+}
+
+void release_theme_content(ThemeContent* tc) {
+	if (tc == NULL || __atomic_sub_fetch(&tc->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	for (int i=0; i<tc->count; i++) {
+		free(tc->values[i]);
+	}
+	free(tc->values);
+	free(tc->language);
+	free(tc);
+}
+
+void free_template(Template* t) {
+	for (int i=0; i<da_count(t->ops); i++) {
+		free(da_get(t->ops, i).name);
+	}
+	da_free(t->ops);
+	free_strings(t->slots);
+	for (int i=0; i<da_count(t->contents); i++) {
+		release_theme_content(da_get(t->contents, i));
+	}
+	da_free(t->contents);
+	pthread_mutex_destroy(&t->contents_lock);
+	free(t->source);
+	free(t);
+}
+
+/*
+ * Finds the slot for a theme content item, or -1 if the template doesn't use it
+ */
+int template_find_slot(Template* t, const char* name) {
+	for (int i=0; i<da_count(t->slots); i++) {
+		if (strcmp(da_get(t->slots, i), name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+Template* retain_template(Template* t) {
+	__atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+	return t;
+}
+
+void release_template(Template* t) {
+	if (t != NULL && __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free_template(t);
+	}
+}
+
+/*
+ * Fails a compilation, with the line number the problem was found on.
+ */
+TemplateCompileResult template_compile_error(Template* t,
+		const char* at,
+		const char* message) {
+	int line = 1;
+	for (const char* c = t->source; c < at; c++) {
+		if (*c == '\n') {
+			line++;
+		}
+	}
+	size_t len = strlen(message) + 32;
+	TemplateCompileResult r = {
+		.success = false,
+		.error_message = malloc(len),
+		.template = NULL,
+	};
+	snprintf(r.error_message, len, "line %d: %s", line, message);
+	free_template(t);
+	return r;
+}
+
+/*
+ * Parses mustache template source into a list of instructions.
+ * Supports the same syntax as mustach: variables, unescaped variables,
+ * sections, inverted sections, comments and changing delimiters.
+ * Partials aren't supported, there's nowhere to fetch them from.
+ */
+TemplateCompileResult template_compile(const char* source) {
+	Template* t = malloc(sizeof(Template));
+	TemplateOps ops = {0};
+	Strings slots = {0};
+	ThemeContents contents = {0};
+	t->source = strdup(source);
+	t->ops = ops;
+	t->slots = slots;
+	t->contents = contents;
+	pthread_mutex_init(&t->contents_lock, NULL);
+	t->refs = 1;
+
+	// Indexes of the section enter instructions we're currently inside
+	Ints sections = {0};
+
+	char open[16] = "{{";
+	char close[16] = "}}";
+	const char* pos = t->source;
+	for (;;) {
+		const char* begin = strstr(pos, open);
+		const char* literal_end = begin != NULL ? begin : pos + strlen(pos);
+		if (literal_end != pos) {
+			TemplateOp op = {
+				.kind = TEMPLATE_OP_LITERAL,
+				.text = pos,
+				.length = literal_end - pos,
+				.name = NULL,
+				.slot = -1,
+				.match = -1,
+			};
+			da_push(t->ops, op);
+		}
+		if (begin == NULL) {
+			break;
+		}
+		const char* tag_start = begin;
+		begin += strlen(open);
+		const char* end = strstr(begin, close);
+		if (end == NULL) {
+			da_free(sections);
+			return template_compile_error(t, tag_start, "unterminated tag");
+		}
+		pos = end + strlen(close);
+		size_t len = end - begin;
+		char kind = *begin;
+		switch (kind) {
+		case '!':
+			// Comment, ignore
+			continue;
+		case '=': {
+			// Change of delimiters, e.g. {{=<% %>=}}
+			if (len < 5 || begin[len-1] != '=') {
+				da_free(sections);
+				return template_compile_error(t, tag_start, "bad delimiters");
+			}
+			const char* d = begin + 1;
+			const char* d_end = begin + len - 1;
+			size_t open_len = 0;
+			while (d + open_len < d_end && !isspace((unsigned char)d[open_len]))
+				open_len++;
+			const char* c = d + open_len;
+			while (c < d_end && isspace((unsigned char)*c))
+				c++;
+			size_t close_len = d_end - c;
+			if (open_len == 0 || close_len == 0
+					|| open_len >= sizeof(open) || close_len >= sizeof(close)) {
+				da_free(sections);
+				return template_compile_error(t, tag_start, "bad delimiters");
+			}
+			memcpy(open, d, open_len);
+			open[open_len] = '\0';
+			memcpy(close, c, close_len);
+			close[close_len] = '\0';
+			continue;
+		}
+		case '{': {
+			// Triple mustache, {{{ name }}}
+			size_t l = 0;
+			while (close[l] == '}')
+				l++;
+			if (close[l] != '\0') {
+				if (len == 0 || begin[len-1] != '}') {
+					da_free(sections);
+					return template_compile_error(t, tag_start, "bad unescape tag");
+				}
+				len--;
+			} else {
+				if (end[l] != '}') {
+					da_free(sections);
+					return template_compile_error(t, tag_start, "bad unescape tag");
+				}
+				pos++;
+			}
+			kind = '&';
+			begin++;
+			len--;
+			break;
+		}
+		case '#':
+		case '^':
+		case '/':
+		case '&':
+		case '>':
+		case ':':
+			begin++;
+			len--;
+			break;
+		default:
+			break;
+		}
+		while (len > 0 && isspace((unsigned char)begin[0])) {
+			begin++;
+			len--;
+		}
+		while (len > 0 && isspace((unsigned char)begin[len-1])) {
+			len--;
+		}
+		if (len == 0) {
+			da_free(sections);
+			return template_compile_error(t, tag_start, "empty tag");
+		}
+		char* name = malloc(len + 1);
+		memcpy(name, begin, len);
+		name[len] = '\0';
+		TemplateOp op = {
+			.kind = TEMPLATE_OP_VARIABLE,
+			.text = NULL,
+			.length = 0,
+			.name = name,
+			.tag = template_tag(name),
+			.slot = -1,
+			.match = -1,
+		};
+		if (op.tag == TEMPLATE_TAG_THEME_ITEM) {
+			// Resolved to a slot now, so rendering doesn't look names up
+			op.slot = template_find_slot(t, name);
+			if (op.slot < 0) {
+				op.slot = da_count(t->slots);
+				da_push(t->slots, strdup(name));
+			}
+		}
+		switch (kind) {
+		case '#':
+		case '^':
+			op.kind = kind == '#' ? TEMPLATE_OP_SECTION_ENTER : TEMPLATE_OP_INVERTED_ENTER;
+			da_push(sections, da_count(t->ops));
+			break;
+		case '/':
+			if (da_empty(sections)
+					|| strcmp(da_get(t->ops, da_last(sections)).name, name) != 0) {
+				free(name);
+				da_free(sections);
+				return template_compile_error(t, tag_start, "closing tag doesn't match an open section");
+			}
+			op.kind = TEMPLATE_OP_SECTION_LEAVE;
+			op.match = da_pop(sections);
+			da_getptr(t->ops, op.match)->match = da_count(t->ops);
+			break;
+		case '>':
+			free(name);
+			da_free(sections);
+			return template_compile_error(t, tag_start, "partials are not supported");
+		case '&':
+			op.kind = TEMPLATE_OP_UNESCAPED;
+			break;
+		default:
+			break;
+		}
+		da_push(t->ops, op);
+	}
+	if (!da_empty(sections)) {
+		const char* at = t->source + strlen(t->source);
+		da_free(sections);
+		return template_compile_error(t, at, "unclosed section");
+	}
+	da_free(sections);
+	TemplateCompileResult r = {
+		.success = true,
+		.error_message = NULL,
+		.template = t,
+	};
+	return r;
+}
+
+/*
+ * Finds the value for a tag.
+ * tags 'title', 'content' and 'language' are supported, along with any user defined theme content items.
+ * Inside a '#nav' section, 'title', 'url' and 'depth' come from the current navigation item instead.
+ */
+const char* template_value(PageData* pld, TemplateOp* op, NavItem* nav) {
+	if (nav != NULL) {
+		// TODO highlighting the currently selected nav item
+		switch (op->tag) {
+		case TEMPLATE_TAG_TITLE:
+			return nav->title;
+		case TEMPLATE_TAG_URL:
+			return nav->url;
+		case TEMPLATE_TAG_DEPTH:
+			return nav->depth;
+		default:
+			return "";
+		}
+	}
+	switch (op->tag) {
+	case TEMPLATE_TAG_TITLE:
+		return pld->title;
+	case TEMPLATE_TAG_CONTENT:
+		return pld->content;
+	case TEMPLATE_TAG_LANGUAGE:
+		return pld->language;
+	default: {
+		// Theme content items, by the slot given to the tag when compiled
+		const char* v = NULL;
+		if (op->slot >= 0 && pld->theme_content != NULL) {
+			v = pld->theme_content->values[op->slot];
+		}
+		return v != NULL ? v : "";
+	}
+	}
+}
+
+/*
+ * Starts rendering page data into a compiled template, from the beginning
+ */
+void template_renderer_init(TemplateRenderer* r, Template* t, PageData* pld) {
+	r->template = t;
+	r->pld = pld;
+	r->op = 0;
+	r->nav = NULL;
+	r->navix = 0;
+	r->pending = NULL;
+	r->pending_length = 0;
+	r->pending_escaped = false;
+	r->entity = NULL;
+	r->entity_length = 0;
+}
+
+bool template_render_done(TemplateRenderer* r) {
+	return r->pending_length == 0 && r->entity_length == 0
+		&& r->op >= da_count(r->template->ops);
+}
+
+/*
+ * Writes as much of the current value as fits into out, escaping it if
+ * it needs to be. An entity that doesn't fit is split, and the rest of
+ * it written first on the next call, so that a small out still gets
+ * something written.
+ * Returns how much was written.
+ */
+size_t template_render_pending(TemplateRenderer* r, char* out, size_t max) {
+	size_t n = 0;
+	if (r->entity_length > 0) {
+		n = r->entity_length < max ? r->entity_length : max;
+		memcpy(out, r->entity, n);
+		r->entity += n;
+		r->entity_length -= n;
+		if (r->entity_length > 0) {
+			return n;
+		}
+	}
+	if (!r->pending_escaped) {
+		size_t length = r->pending_length < max - n ? r->pending_length : max - n;
+		memcpy(out + n, r->pending, length);
+		r->pending += length;
+		r->pending_length -= length;
+		return n + length;
+	}
+	while (r->pending_length > 0 && n < max) {
+		// Copy up to the next character that needs escaping
+		size_t limit = r->pending_length < max - n ? r->pending_length : max - n;
+		size_t run = html_escape_scan(r->pending, limit);
+		memcpy(out + n, r->pending, run);
+		n += run;
+		r->pending += run;
+		r->pending_length -= run;
+		if (run == limit) {
+			continue;
+		}
+		const char* entity = html_entity(*r->pending);
+		size_t length = strlen(entity);
+		r->pending++;
+		r->pending_length--;
+		if (n + length > max) {
+			r->entity = entity + (max - n);
+			r->entity_length = length - (max - n);
+			length = max - n;
+		}
+		memcpy(out + n, entity, length);
+		n += length;
+	}
+	return n;
+}
+
+/*
+ * Moves on to the next piece of output, a literal or a value, following
+ * sections. It becomes the renderer's pending output.
+ * Returns false once the page is finished.
+ */
+bool template_step(TemplateRenderer* r) {
+	TemplateOps* ops = &r->template->ops;
+	NavItems* nav_items = &r->pld->nav->items;
+	while (r->op < da_count(*ops)) {
+		TemplateOp* op = da_getptr(*ops, r->op);
+		r->op++;
+		switch (op->kind) {
+		case TEMPLATE_OP_LITERAL:
+			r->pending = op->text;
+			r->pending_length = op->length;
+			r->pending_escaped = false;
+			return true;
+		case TEMPLATE_OP_VARIABLE:
+		case TEMPLATE_OP_UNESCAPED:
+			r->pending = template_value(r->pld, op, r->nav);
+			r->pending_length = strlen(r->pending);
+			r->pending_escaped = op->kind == TEMPLATE_OP_VARIABLE;
+			return true;
+		case TEMPLATE_OP_SECTION_ENTER:
+			// nav is the only thing that can be iterated
+			if (op->tag == TEMPLATE_TAG_NAV && r->nav == NULL && !da_empty(*nav_items)) {
+				r->navix = 0;
+				r->nav = da_getptr(*nav_items, r->navix);
+			} else {
+				r->op = op->match + 1;
+			}
+			break;
+		case TEMPLATE_OP_INVERTED_ENTER:
+			if (op->tag == TEMPLATE_TAG_NAV && r->nav == NULL && !da_empty(*nav_items)) {
+				r->op = op->match + 1;
+			}
+			break;
+		case TEMPLATE_OP_SECTION_LEAVE: {
+			TemplateOp* enter = da_getptr(*ops, op->match);
+			if (enter->kind == TEMPLATE_OP_SECTION_ENTER && r->nav != NULL) {
+				r->navix++;
+				if (r->navix < da_count(*nav_items)) {
+					r->nav = da_getptr(*nav_items, r->navix);
+					r->op = op->match + 1;
+				} else {
+					r->nav = NULL;
+				}
+			}
+			break;
+		}
+		}
+	}
+	return false;
+}
+
+/*
+ * Renders the next part of a page, up to max bytes, into out.
+ * Returns how much was written, which is less than max only when the page
+ * is finished.
+ */
+size_t template_render_some(TemplateRenderer* r, char* out, size_t max) {
+	size_t n = 0;
+	for (;;) {
+		n += template_render_pending(r, out + n, max - n);
+		if (r->pending_length > 0 || r->entity_length > 0 || !template_step(r)) {
+			return n;
+		}
+	}
+}
+
+/*
+ * Renders page data into a compiled template, all at once.
+ * Returns a new shared buffer with one reference, for the caller.
+ */
+SharedBuffer* template_render(Template* t, PageData* pld) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t capacity = PAGE_RENDER_BLOCK_SIZE;
+	SharedBuffer* b = shared_buffer_new(capacity);
+	size_t length = 0;
+	TemplateRenderer r;
+	template_renderer_init(&r, t, pld);
+	for (;;) {
+		length += template_render_some(&r, b->data + length, capacity - length);
+		if (template_render_done(&r)) {
+			break;
+		}
+		capacity *= 2;
+		b = realloc(b, sizeof(SharedBuffer) + capacity);
+	}
+	// Pages are kept in the cache, don't keep the spare space too
+	b = realloc(b, sizeof(SharedBuffer) + length);
+	b->length = length;
+	unsigned long ns = elapsed_since(start);
+	record_stage(STAGE_TEMPLATE, ns);
+	PROBE(template__done, request_trace.host, request_trace.path, length, ns);
+	return b;
+}
+
+/*
+ * Compiles the template for a theme, at the given revision, which
+ * must have been read in the same transaction
+ */
+ThemeTemplate load_theme_template(int theme_id, int revision) {
+	ThemeTemplate tt = {
+		.theme_id = theme_id,
+		.revision = revision,
+		.template = NULL,
+		.error_message = NULL,
+	};
+	sqlite3_stmt* stmt = prepare_cached("select template from theme where id = ?");
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, theme_id));
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		TemplateCompileResult r = template_compile((const char*)sqlite3_column_text(stmt, 0));
+		tt.template = r.template;
+		tt.error_message = r.error_message;
+	} else if (v == SQLITE_DONE) {
+		tt.error_message = strdup("no such theme");
+	} else {
+		sqlite_check(db, v);
+	}
+	finish_cached(stmt);
+	if (tt.error_message != NULL) {
+		log_message(LOG_LEVEL_ERROR, "Error in template for theme %d: %s", theme_id, tt.error_message);
+	}
+	return tt;
+}
+
+/*
+ * Finds the compiled template for a theme at the revision read in the
+ * current transaction, compiling it the first time it's needed.
+ * A template compiled from an older revision is replaced, e.g. by a
+ * reader which started before the theme changed but cached it after.
+ * The template is retained for the caller, who must release it.
+ * The error message is only for logging here, it's not the caller's.
+ */
+ThemeTemplate find_theme_template(int theme_id, int revision) {
+	pthread_mutex_lock(&theme_templates_lock);
+	for (int i=0; i<da_count(theme_templates); i++) {
+		ThemeTemplate tt = da_get(theme_templates, i);
+		if (tt.theme_id == theme_id && tt.revision == revision) {
+			if (tt.template != NULL) {
+				retain_template(tt.template);
+			}
+			tt.error_message = NULL;
+			pthread_mutex_unlock(&theme_templates_lock);
+			return tt;
+		}
+	}
+	unsigned long generation = theme_templates_generation;
+	pthread_mutex_unlock(&theme_templates_lock);
+
+	// Compiled without holding the lock, so pages using other themes
+	// aren't held up.
+	ThemeTemplate tt = load_theme_template(theme_id, revision);
+	pthread_mutex_lock(&theme_templates_lock);
+	bool stale = generation != theme_templates_generation;
+	int replacing = -1;
+	for (int i=0; i<da_count(theme_templates) && !stale; i++) {
+		ThemeTemplate cached = da_get(theme_templates, i);
+		if (cached.theme_id == theme_id) {
+			// Another thread got there first, or has a newer revision
+			stale = cached.revision >= revision;
+			replacing = i;
+		}
+	}
+	if (!stale) {
+		if (replacing >= 0) {
+			ThemeTemplate old = da_get(theme_templates, replacing);
+			release_template(old.template);
+			free(old.error_message);
+			da_set(theme_templates, replacing, tt);
+		} else {
+			da_push(theme_templates, tt);
+		}
+		if (tt.template != NULL) {
+			retain_template(tt.template);
+		}
+	}
+	pthread_mutex_unlock(&theme_templates_lock);
+	if (stale) {
+		// Not cached, the caller has the only reference
+		free(tt.error_message);
+	}
+	tt.error_message = NULL;
+	return tt;
+}
+
+// Binds ?1 theme id, ?2 language
+static const char* theme_content_sql =
+	"select key, value from theme_content "
+	"where theme_id = ?1 and language = ?2";
+
+/*
+ * Reads a theme's content in a language, as values for a template's slots.
+ * Items the template doesn't use are left out.
+ */
+ThemeContent* load_theme_content(Template* t,
+		int theme_id,
+		const char* lang,
+		int theme_revision) {
+	ThemeContent* tc = malloc(sizeof(ThemeContent));
+	tc->language = strdup(lang);
+	tc->theme_revision = theme_revision;
+	tc->count = da_count(t->slots);
+	tc->values = calloc(tc->count + 1, sizeof(char*));
+	tc->refs = 1;
+	sqlite3_stmt* stmt = prepare_cached(theme_content_sql);
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, theme_id));
+	sqlite_check(db, sqlite3_bind_text(stmt, 2, lang, -1, NULL));
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		int slot = template_find_slot(t, (const char*)sqlite3_column_text(stmt, 0));
+		if (slot >= 0 && tc->values[slot] == NULL) {
+			tc->values[slot] = strdup((const char*)sqlite3_column_text(stmt, 1));
+		}
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	finish_cached(stmt);
+	return tc;
+}
+
+/*
+ * Finds the theme's content in a language for rendering with a template,
+ * reading it the first time it's needed and whenever the theme's revision,
+ * which comes from the caller's transaction, has changed.
+ * The caller must release the result.
+ */
+ThemeContent* template_theme_content(Template* t,
+		int theme_id,
+		const char* lang,
+		int theme_revision) {
+	pthread_mutex_lock(&t->contents_lock);
+	for (int i=0; i<da_count(t->contents); i++) {
+		ThemeContent* tc = da_get(t->contents, i);
+		if (tc->theme_revision == theme_revision && strcmp(tc->language, lang) == 0) {
+			__atomic_add_fetch(&tc->refs, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&t->contents_lock);
+			return tc;
+		}
+	}
+	pthread_mutex_unlock(&t->contents_lock);
+	// Not holding the lock while reading, like find_theme_template
+	ThemeContent* loaded = load_theme_content(t, theme_id, lang, theme_revision);
+	__atomic_add_fetch(&loaded->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&t->contents_lock);
+	bool replaced = false;
+	for (int i=0; i<da_count(t->contents) && !replaced; i++) {
+		ThemeContent* tc = da_get(t->contents, i);
+		if (strcmp(tc->language, lang) == 0) {
+			release_theme_content(tc);
+			da_set(t->contents, i, loaded);
+			replaced = true;
+		}
+	}
+	if (!replaced) {
+		da_push(t->contents, loaded);
+	}
+	pthread_mutex_unlock(&t->contents_lock);
+	return loaded;
+}
+
+/*
+ * Compiles all installed themes up front,
+ * so that broken templates are reported at startup.
+ */
+void load_theme_templates() {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, sqlite3_prepare_v2(db, "select id, revision from theme", -1, &stmt, NULL));
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		release_template(find_theme_template(sqlite3_column_int(stmt, 0),
+					sqlite3_column_int(stmt, 1)).template);
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	sqlite3_finalize(stmt);
+}
+
+/*
+ * Drops all compiled templates, they'll be recompiled as required.
+ */
+void free_theme_templates() {
+	pthread_mutex_lock(&theme_templates_lock);
+	for (int i=0; i<da_count(theme_templates); i++) {
+		ThemeTemplate tt = da_get(theme_templates, i);
+		release_template(tt.template);
+		free(tt.error_message);
+	}
+	da_clear(theme_templates);
+	theme_templates_generation++;
+	pthread_mutex_unlock(&theme_templates_lock);
+}
+
+///////////// Static resources /////////////////
+
+/*
+ * Find some static content from static_resource table.
+ * Static resources are served from the /static path, 
+ * and are attached to a particular virtual host.
+ * The value is read straight into a shared buffer with sqlite's
+ * blob I/O, so it's only copied once.
+ */
+StaticResource find_static_resource(const char* host, const char* subpath) {
+	log_debug("Looking for static resource host %s subpath %s", host, subpath);
+	sqlite3_stmt* stmt = prepare_cached(
+		"select sr.id, sr.content_type "
+		"from static_resources sr "
+		"join server s on s.id = sr.server_id "
+		"where sr.key = ? "
+		"and s.hostname = ? ");
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, subpath, -1, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 2, host, -1, NULL));
+	StaticResource r = {
+		.key = NULL,
+		.value = NULL,
+		.content_type = NULL,
+		.isnotfound = true,
+	};
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_DONE) {
+		finish_cached(stmt);
+		return r;
+	} else if (v != SQLITE_ROW) {
+		sqlite_check(db, v);
+	}
+	sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+	r.content_type = strdup((const char*)sqlite3_column_text(stmt, 1));
+	finish_cached(stmt);
+
+	sqlite3_blob* blob;
+	sqlite_check(db, sqlite3_blob_open(db, "main", "static_resources", "value", id, 0, &blob));
+	// In bytes, unlike length() which counts characters for text values
+	int sz = sqlite3_blob_bytes(blob);
+	r.value = shared_buffer_new(sz);
+	sqlite_check(db, sqlite3_blob_read(blob, r.value->data, sz, 0));
+	sqlite_check(db, sqlite3_blob_close(blob));
+	r.key = strdup(subpath);
+	r.isnotfound = false;
+	return r;
+}
+
+void free_static_resource(StaticResource r) {
+	free(r.key);
+	shared_buffer_release(r.value);
+	free(r.content_type);
+}
+
+/*
+ * Looks up a static resource in memory, falling back to the database.
+ * The result holds its own reference to the value, the caller must free it.
+ */
+StaticResource static_cache_get(const char* host, const char* subpath) {
+	size_t key_length = strlen(host) + strlen(subpath) + 2;
+	char* key = arena_alloc(&request_arena, key_length);
+	snprintf(key, key_length, "%s/%s", host, subpath);
+	pthread_mutex_lock(&static_cache.lock);
+	for (int i = 0; i < da_count(static_cache.resources); i++) {
+		StaticResource* sr = da_getptr(static_cache.resources, i);
+		if (strcmp(sr->key, key) == 0) {
+			StaticResource r = {
+				.key = strdup(subpath),
+				.value = shared_buffer_retain(sr->value),
+				.content_type = strdup(sr->content_type),
+				.isnotfound = false,
+			};
+			pthread_mutex_unlock(&static_cache.lock);
+			PROBE(cache__hit, "static", host, subpath, r.value->length);
+			return r;
+		}
+	}
+	unsigned long generation = static_cache.generation;
+	pthread_mutex_unlock(&static_cache.lock);
+	PROBE(cache__miss, "static", host, subpath);
+
+	// Not holding the lock while reading, so other resources can still be served.
+	// Another thread may read the same resource at the same time, which is harmless.
+	StaticResource r = find_static_resource(host, subpath);
+	if (r.isnotfound || static_cache.max_bytes == 0 
+			|| r.value->length > static_cache.max_bytes) {
+		return r;
+	}
+	pthread_mutex_lock(&static_cache.lock);
+	bool cached = false;
+	for (int i = 0; i < da_count(static_cache.resources); i++) {
+		cached = cached || strcmp(da_get(static_cache.resources, i).key, key) == 0;
+	}
+	// Don't cache what we read if it was changed while we were reading it
+	if (cached || generation != static_cache.generation) {
+		pthread_mutex_unlock(&static_cache.lock);
+		return r;
+	}
+	while (static_cache.bytes + r.value->length > static_cache.max_bytes) {
+		StaticResource oldest = da_get(static_cache.resources, 0);
+		static_cache.bytes -= oldest.value->length;
+		free_static_resource(oldest);
+		da_delete(static_cache.resources, 0);
+	}
+	StaticResource entry = {
+		.key = strdup(key),
+		.value = shared_buffer_retain(r.value),
+		.content_type = strdup(r.content_type),
+		.isnotfound = false,
+	};
+	da_push(static_cache.resources, entry);
+	static_cache.bytes += r.value->length;
+	pthread_mutex_unlock(&static_cache.lock);
+	return r;
+}
+
+/*
+ * Drops all static resources held in memory. Responses still being
+ * sent keep their own references.
+ */
+void static_cache_clear() {
+	pthread_mutex_lock(&static_cache.lock);
+	for (int i = 0; i < da_count(static_cache.resources); i++) {
+		free_static_resource(da_get(static_cache.resources, i));
+	}
+	da_clear(static_cache.resources);
+	static_cache.bytes = 0;
+	static_cache.generation++;
+	pthread_mutex_unlock(&static_cache.lock);
+}
+
+///////////// Servers /////////////////
+
+Servers get_servers() {
+	sqlite3_stmt* stmt = prepare_cached(
+				"select id, hostname, theme_id, is_default "
+				"from server");
+	int v;
+	Servers s = {0};
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		Server sv = {
+			.id = sqlite3_column_int(stmt, 0),
+			.hostname = strdup((const char*)sqlite3_column_text(stmt, 1)),
+			.theme_id = sqlite3_column_int(stmt, 2),
+			.is_default = sqlite3_column_int(stmt, 3),
+		};
+		da_push(s, sv);
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	finish_cached(stmt);
+	return s;
+}
+
+void free_server(Server s) {
+	free(s.hostname);
+}
+
+void free_servers(Servers s) {
+	for (int i=0;i<da_count(s); i++) {
+		free_server(da_get(s, i));
+	}
+	da_free(s);
+}
+
+/*
+ * The server for a hostname, or the default server if none match.
+ */
+int match_server(Servers servers, const char* host) {
+	int default_id = -1;
+	for (int i=0; i<da_count(servers); i++) {
+		Server sv = da_get(servers, i);
+		if (host != NULL && strcmp(sv.hostname, host) == 0) {
+			return sv.id;
+		}
+		if (sv.is_default) {
+			default_id = sv.id;
+		}
+	}
+	if (default_id < 0) {
+		fprintf(stderr, "Couldn't find default server OOPS!\n");
+		raise(SIGTERM);
+	}
+	return default_id;
+}
+
+/*
+ * Finds the server which should handle requests for a host,
+ * falling back to the default server.
+ */
+int find_server_id(const char* host) {
+	pthread_mutex_lock(&server_snapshot.lock);
+	if (!server_snapshot.loaded) {
+		unsigned long generation = server_snapshot.generation;
+		pthread_mutex_unlock(&server_snapshot.lock);
+		// Not holding the lock while reading, like find_theme_template
+		Servers servers = get_servers();
+		pthread_mutex_lock(&server_snapshot.lock);
+		if (server_snapshot.loaded || generation != server_snapshot.generation) {
+			// Someone else loaded it first, or it's already out of date.
+			// Either way what we read is still right for this request.
+			pthread_mutex_unlock(&server_snapshot.lock);
+			int server_id = match_server(servers, host);
+			free_servers(servers);
+			return server_id;
+		}
+		server_snapshot.servers = servers;
+		server_snapshot.loaded = true;
+	}
+	int server_id = match_server(server_snapshot.servers, host);
+	pthread_mutex_unlock(&server_snapshot.lock);
+	return server_id;
+}
+
+/*
+ * Drops the servers held in memory, they'll be read again when next needed.
+ */
+void clear_server_snapshot() {
+	pthread_mutex_lock(&server_snapshot.lock);
+	free_servers(server_snapshot.servers);
+	Servers empty = {0};
+	server_snapshot.servers = empty;
+	server_snapshot.loaded = false;
+	server_snapshot.generation++;
+	pthread_mutex_unlock(&server_snapshot.lock);
+}
+
+///////////// Navigation /////////////////
+
+/*
+ * Every page on a server with content in a language, for the navigation.
+ * Binds ?1 server id, ?2 language.
+ */
+static const char* nav_sql =
+	"select p.id, p.parent_page_id, p.relative_path, pc.title "
+	"from page p "
+	"join page_content pc "
+		"on pc.page_id = p.id "
+		"and pc.language = ?2 "
+	"where p.server_id = ?1 "
+	"order by p.id";
+
+void release_nav_tree(NavTree* nt) {
+	if (nt == NULL || __atomic_sub_fetch(&nt->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	for (int i=0; i<da_count(nt->items); i++) {
+		NavItem ni = da_get(nt->items, i);
+		free(ni.title);
+		free(ni.url);
+	}
+	da_free(nt->items);
+	free(nt->language);
+	free(nt);
+}
+
+/*
+ * Finds a page's position among rows sorted by page id, or -1
+ */
+int find_nav_row(Ints ids, int page_id) {
+	int low = 0;
+	int high = da_count(ids) - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (da_get(ids, mid) < page_id) {
+			low = mid + 1;
+		} else if (da_get(ids, mid) > page_id) {
+			high = mid - 1;
+		} else {
+			return mid;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Builds the navigation for a server in a language, with one reference
+ * for the caller. Pages come after their parent, in page id order.
+ * A page whose parent has no content in the language is shown at the
+ * top level, as are pages in a loop of parents.
+ */
+NavTree* load_nav_tree(int server_id, const char* lang, int revision) {
+	sqlite3_stmt* stmt = prepare_cached(nav_sql);
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, server_id));
+	sqlite_check(db, sqlite3_bind_text(stmt, 2, lang, -1, NULL));
+	Ints ids = {0};
+	Ints parent_ids = {0};
+	NavItems rows = {0};
+	int v;
+	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+		da_push(ids, sqlite3_column_int(stmt, 0));
+		da_push(parent_ids, sqlite3_column_type(stmt, 1) == SQLITE_NULL
+				? -1 : sqlite3_column_int(stmt, 1));
+		NavItem ni = {
+			.url = strdup((const char*)sqlite3_column_text(stmt, 2)),
+			.title = strdup((const char*)sqlite3_column_text(stmt, 3)),
+		};
+		da_push(rows, ni);
+	}
+	if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	finish_cached(stmt);
+
+	// Link each row to its children, keeping them in page id order
+	int n = da_count(rows);
+	int* parent = malloc(sizeof(int) * (n + 1));
+	int* first_child = malloc(sizeof(int) * (n + 1));
+	int* last_child = malloc(sizeof(int) * (n + 1));
+	int* next_sibling = malloc(sizeof(int) * (n + 1));
+	int* stack = malloc(sizeof(int) * (n + 1));
+	bool* visited = calloc(n + 1, sizeof(bool));
+	for (int i = 0; i < n; i++) {
+		first_child[i] = last_child[i] = next_sibling[i] = -1;
+	}
+	for (int i = 0; i < n; i++) {
+		parent[i] = find_nav_row(ids, da_get(parent_ids, i));
+		if (parent[i] == i) {
+			parent[i] = -1;
+		}
+		if (parent[i] < 0) {
+			continue;
+		}
+		if (first_child[parent[i]] < 0) {
+			first_child[parent[i]] = i;
+		} else {
+			next_sibling[last_child[parent[i]]] = i;
+		}
+		last_child[parent[i]] = i;
+	}
+
+	NavTree* nt = malloc(sizeof(NavTree));
+	NavItems items = {0};
+	nt->server_id = server_id;
+	nt->language = strdup(lang);
+	nt->items = items;
+	nt->revision = revision;
+	nt->refs = 1;
+	// Walk down from the top level pages, then from any pages left over,
+	// which can only be in a loop
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < n; i++) {
+			if (visited[i] || (pass == 0 && parent[i] >= 0)) {
+				continue;
+			}
+			// Depth first, stack holding the next page to visit at each depth
+			int depth = 0;
+			stack[0] = i;
+			while (depth >= 0) {
+				int row = stack[depth];
+				if (row < 0 || visited[row]) {
+					depth--;
+					continue;
+				}
+				visited[row] = true;
+				NavItem ni = da_get(rows, row);
+				snprintf(ni.depth, sizeof(ni.depth), "%d", depth);
+				da_push(nt->items, ni);
+				// Its siblings come once its children are done
+				stack[depth] = depth > 0 ? next_sibling[row] : -1;
+				stack[++depth] = first_child[row];
+			}
+		}
+	}
+	free(parent);
+	free(first_child);
+	free(last_child);
+	free(next_sibling);
+	free(stack);
+	free(visited);
+	da_free(rows);
+	da_free(ids);
+	da_free(parent_ids);
+	return nt;
+}
+
+/*
+ * Finds the navigation for a server in a language, building it if it
+ * isn't held or the server's pages have changed since it was built.
+ * revision is the server's nav_revision, read in the same transaction,
+ * so the tree returned always matches it.
+ * The caller must release the result.
+ */
+NavTree* nav_cache_get(int server_id, const char* lang, int revision) {
+	pthread_mutex_lock(&nav_cache.lock);
+	for (int i=0; i<da_count(nav_cache.trees); i++) {
+		NavTree* nt = da_get(nav_cache.trees, i);
+		if (nt->server_id == server_id
+				&& strcmp(nt->language, lang) == 0
+				&& nt->revision == revision) {
+			__atomic_add_fetch(&nt->refs, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&nav_cache.lock);
+			PROBE(cache__hit, "nav", request_trace.host, lang, 0);
+			return nt;
+		}
+	}
+	pthread_mutex_unlock(&nav_cache.lock);
+	PROBE(cache__miss, "nav", request_trace.host, lang);
+	// Not holding the lock while reading, like find_theme_template
+	NavTree* built = load_nav_tree(server_id, lang, revision);
+	__atomic_add_fetch(&built->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&nav_cache.lock);
+	bool replaced = false;
+	for (int i=0; i<da_count(nav_cache.trees); i++) {
+		NavTree* nt = da_get(nav_cache.trees, i);
+		if (nt->server_id == server_id && strcmp(nt->language, lang) == 0) {
+			release_nav_tree(nt);
+			da_set(nav_cache.trees, i, built);
+			replaced = true;
+			break;
+		}
+	}
+	if (!replaced) {
+		da_push(nav_cache.trees, built);
+	}
+	pthread_mutex_unlock(&nav_cache.lock);
+	return built;
+}
+
+/*
+ * Drops the navigation trees held in memory
+ */
+void nav_cache_clear() {
+	pthread_mutex_lock(&nav_cache.lock);
+	for (int i=0; i<da_count(nav_cache.trees); i++) {
+		release_nav_tree(da_get(nav_cache.trees, i));
+	}
+	da_free(nav_cache.trees);
+	pthread_mutex_unlock(&nav_cache.lock);
+}
+
+///////////// Page cache /////////////////
+
+/*
+ * Hash for the page cache key
+ */
+uint32_t page_cache_hash(int server_id, const char* path, const char* lang) {
+	uint32_t h = 2166136261u ^ (uint32_t)server_id;
+	h *= 16777619;
+	h = hash_string(h, path);
+	// Separator, so "/a" + "b" doesn't collide with "/ab" + ""
+	h ^= 0xff;
+	h *= 16777619;
+	return hash_string(h, lang);
+}
+
+/*
+ * Memory accounted against the cache budget for an entry
+ */
+size_t page_cache_entry_bytes(PageCacheEntry* e) {
+	return sizeof(PageCacheEntry)
+		+ sizeof(SharedBuffer) + e->html->length
+		+ strlen(e->relative_path) + 1
+		+ strlen(e->language) + 1;
+}
+
+void page_cache_init(size_t max_bytes) {
+	PageCache c = {
+		.buckets = NULL,
+		.bucket_count = 0,
+		.lru_head = NULL,
+		.lru_tail = NULL,
+		.entry_count = 0,
+		.bytes = 0,
+		.max_bytes = max_bytes,
+	};
+	page_cache = c;
+	pthread_mutex_init(&page_cache.lock, NULL);
+	if (max_bytes > 0) {
+		page_cache.bucket_count = 256;
+		page_cache.buckets = calloc(page_cache.bucket_count, sizeof(PageCacheEntry*));
+	}
+}
+
+void page_cache_lru_unlink(PageCacheEntry* e) {
+	if (e->lru_prev != NULL)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		page_cache.lru_head = e->lru_next;
+	if (e->lru_next != NULL)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		page_cache.lru_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = NULL;
+}
+
+void page_cache_lru_push_head(PageCacheEntry* e) {
+	e->lru_prev = NULL;
+	e->lru_next = page_cache.lru_head;
+	if (page_cache.lru_head != NULL)
+		page_cache.lru_head->lru_prev = e;
+	page_cache.lru_head = e;
+	if (page_cache.lru_tail == NULL)
+		page_cache.lru_tail = e;
+}
+
+/*
+ * Unlinks an entry from the cache and frees it.
+ */
+void page_cache_remove(PageCacheEntry* e) {
+	PageCacheEntry** link = &page_cache.buckets[e->hash & (page_cache.bucket_count - 1)];
+	while (*link != e) {
+		link = &(*link)->bucket_next;
+	}
+	*link = e->bucket_next;
+	page_cache_lru_unlink(e);
+	page_cache.bytes -= page_cache_entry_bytes(e);
+	page_cache.entry_count--;
+	free(e->relative_path);
+	free(e->language);
+	shared_buffer_release(e->html);
+	free(e);
+}
+
+/*
+ * Doubles the number of hash buckets, once the
+ * chains start to get long.
+ */
+void page_cache_grow() {
+	size_t new_count = page_cache.bucket_count * 2;
+	PageCacheEntry** new_buckets = calloc(new_count, sizeof(PageCacheEntry*));
+	for (size_t i=0; i<page_cache.bucket_count; i++) {
+		PageCacheEntry* e = page_cache.buckets[i];
+		while (e != NULL) {
+			PageCacheEntry* next = e->bucket_next;
+			size_t ix = e->hash & (new_count - 1);
+			e->bucket_next = new_buckets[ix];
+			new_buckets[ix] = e;
+			e = next;
+		}
+	}
+	free(page_cache.buckets);
+	page_cache.buckets = new_buckets;
+	page_cache.bucket_count = new_count;
+}
+
+PageCacheEntry* page_cache_find(int server_id, const char* path, const char* lang, uint32_t hash) {
+	PageCacheEntry* e = page_cache.buckets[hash & (page_cache.bucket_count - 1)];
+	for (; e != NULL; e = e->bucket_next) {
+		if (e->hash == hash
+				&& e->server_id == server_id
+				&& strcmp(e->relative_path, path) == 0
+				&& strcmp(e->language, lang) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Looks up a rendered page, or NULL if it isn't cached.
+ * The page is retained for the caller, who must release it.
+ */
+SharedBuffer* page_cache_get(int server_id, const char* path, const char* lang,
+		PageValidators* validators) {
+	if (page_cache.max_bytes == 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&page_cache.lock);
+	PageCacheEntry* e = page_cache_find(server_id, path, lang,
+			page_cache_hash(server_id, path, lang));
+	if (e == NULL) {
+		page_cache.misses++;
+		pthread_mutex_unlock(&page_cache.lock);
+		PROBE(cache__miss, "page", request_trace.host, path);
+		return NULL;
+	}
+	page_cache.hits++;
+	page_cache_lru_unlink(e);
+	page_cache_lru_push_head(e);
+	*validators = e->validators;
+	SharedBuffer* html = shared_buffer_retain(e->html);
+	pthread_mutex_unlock(&page_cache.lock);
+	PROBE(cache__hit, "page", request_trace.host, path, html->length);
+	return html;
+}
+
+/*
+ * The current generation, to pass to page_cache_put.
+ * Get it before reading anything the page is rendered from.
+ */
+unsigned long page_cache_generation() {
+	return __atomic_load_n(&page_cache.generation, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Stores a rendered page, evicting the least recently used pages to
+ * stay within budget. Nothing is stored if the cache has been invalidated
+ * since the generation was taken.
+ */
+void page_cache_put(int server_id, const char* path, const char* lang,
+		SharedBuffer* html, PageValidators validators, unsigned long generation) {
+	if (page_cache.max_bytes == 0) {
+		return;
+	}
+	uint32_t hash = page_cache_hash(server_id, path, lang);
+	PageCacheEntry* e = malloc(sizeof(PageCacheEntry));
+	PageCacheEntry ee = {
+		.server_id = server_id,
+		.relative_path = strdup(path),
+		.language = strdup(lang),
+		.hash = hash,
+		.html = shared_buffer_retain(html),
+		.validators = validators,
+		.bucket_next = NULL,
+		.lru_prev = NULL,
+		.lru_next = NULL,
+	};
+	*e = ee;
+	size_t bytes = page_cache_entry_bytes(e);
+	pthread_mutex_lock(&page_cache.lock);
+	if (bytes > page_cache.max_bytes || generation != page_cache.generation) {
+		// Would never fit, don't churn the whole cache trying. Or stale.
+		pthread_mutex_unlock(&page_cache.lock);
+		free(e->relative_path);
+		free(e->language);
+		shared_buffer_release(e->html);
+		free(e);
+		return;
+	}
+	PageCacheEntry* existing = page_cache_find(server_id, path, lang, hash);
+	if (existing != NULL) {
+		page_cache_remove(existing);
+	}
+	while (page_cache.bytes + bytes > page_cache.max_bytes) {
+		page_cache_remove(page_cache.lru_tail);
+		page_cache.evictions++;
+	}
+	if (page_cache.entry_count >= page_cache.bucket_count) {
+		page_cache_grow();
+	}
+	size_t ix = hash & (page_cache.bucket_count - 1);
+	e->bucket_next = page_cache.buckets[ix];
+	page_cache.buckets[ix] = e;
+	page_cache_lru_push_head(e);
+	page_cache.bytes += bytes;
+	page_cache.entry_count++;
+	pthread_mutex_unlock(&page_cache.lock);
+}
+
+/*
+ * Drops every cached page belonging to a server,
+ * e.g. because a page or its content changed, which can
+ * also affect the navigation on the server's other pages.
+ */
+void page_cache_invalidate_server(int server_id) {
+	pthread_mutex_lock(&page_cache.lock);
+	__atomic_add_fetch(&page_cache.generation, 1, __ATOMIC_RELEASE);
+	PageCacheEntry* e = page_cache.lru_head;
+	while (e != NULL) {
+		PageCacheEntry* next = e->lru_next;
+		if (e->server_id == server_id) {
+			page_cache_remove(e);
+			page_cache.invalidations++;
+		}
+		e = next;
+	}
+	pthread_mutex_unlock(&page_cache.lock);
+}
+
+/*
+ * Drops every cached page, e.g. because a theme changed.
+ */
+void page_cache_invalidate_all() {
+	pthread_mutex_lock(&page_cache.lock);
+	__atomic_add_fetch(&page_cache.generation, 1, __ATOMIC_RELEASE);
+	while (page_cache.lru_head != NULL) {
+		page_cache_remove(page_cache.lru_head);
+		page_cache.invalidations++;
+	}
+	pthread_mutex_unlock(&page_cache.lock);
+}
+
+void page_cache_free() {
+	if (page_cache.max_bytes == 0) {
+		return;
+	}
+	while (page_cache.lru_head != NULL) {
+		page_cache_remove(page_cache.lru_head);
+	}
+	free(page_cache.buckets);
+	page_cache.buckets = NULL;
+}
+
+struct json_object* page_cache_stats_to_json() {
+	pthread_mutex_lock(&page_cache.lock);
+	struct json_object* o = json_object_new_object();
+	json_object_object_add(o, "hits", json_object_new_int64(page_cache.hits));
+	json_object_object_add(o, "misses", json_object_new_int64(page_cache.misses));
+	json_object_object_add(o, "evictions", json_object_new_int64(page_cache.evictions));
+	json_object_object_add(o, "invalidations", json_object_new_int64(page_cache.invalidations));
+	json_object_object_add(o, "entries", json_object_new_int64(page_cache.entry_count));
+	json_object_object_add(o, "bytes", json_object_new_int64(page_cache.bytes));
+	json_object_object_add(o, "max_bytes", json_object_new_int64(page_cache.max_bytes));
+	pthread_mutex_unlock(&page_cache.lock);
+	return o;
+}
+
+/*
+ * Called by sqlite for every row changed through our connection.
+ * Theme changes alter every page using the theme, and there's no
+ * cheap way to get from a rowid back to the affected servers,
+ * so just start again.
+ * This runs while the change is still being made, and a reader that
+ * started now would see the data from before it and cache that again,
+ * so the caches are only marked here, and emptied by
+ * flush_dirty_caches once it's been committed.
+ * Changes to pages and their content are handled more precisely
+ * where they're made.
+ */
+void database_update_hook(void* cls,
+		int operation,
+		const char* database,
+		const char* table,
+		sqlite3_int64 rowid) {
+	if (strcmp(table, "theme") == 0
+			|| strcmp(table, "theme_content") == 0
+			|| strcmp(table, "server") == 0) {
+		dirty_caches.pages = true;
+	}
+	if (strcmp(table, "theme") == 0) {
+		dirty_caches.templates = true;
+	}
+	if (strcmp(table, "static_resources") == 0
+			|| strcmp(table, "server") == 0) {
+		dirty_caches.static_resources = true;
+	}
+	if (strcmp(table, "server") == 0) {
+		dirty_caches.servers = true;
+	}
+}
+
+/*
+ * Empties the caches the writer's changes made stale. Call once they're
+ * committed, so that anything read before that, which would be
+ * stale, is refused by the caches' generations, and anything read
+ * after is current.
+ */
+void flush_dirty_caches() {
+	if (dirty_caches.pages) {
+		page_cache_invalidate_all();
+	}
+	if (dirty_caches.templates) {
+		free_theme_templates();
+	}
+	if (dirty_caches.static_resources) {
+		static_cache_clear();
+	}
+	if (dirty_caches.servers) {
+		clear_server_snapshot();
+		nav_cache_clear();
+	}
+	DirtyCaches clean = {0};
+	dirty_caches = clean;
+}
+
+/*
+ * Renders markdown content to HTML.
+ * Caller is responsible for freeing the result.
+ */
+char* render_markdown(const char* markdown) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t length = strlen(markdown);
+	char* html = cmark_markdown_to_html(markdown, length, CMARK_OPT_DEFAULT);
+	unsigned long ns = elapsed_since(start);
+	record_stage(STAGE_MARKDOWN, ns);
+	PROBE(markdown__done, request_trace.host, request_trace.path, length, ns);
+	return html;
+}
+
+/*
+ * SQL function markdown_to_html(text), so that content can be
+ * rendered from within SQL statements.
+ */
+void sqlite_markdown_to_html(sqlite3_context* context,
+		int argc,
+		sqlite3_value** argv) {
+	const char* markdown = (const char*)sqlite3_value_text(argv[0]);
+	if (markdown == NULL) {
+		sqlite3_result_null(context);
+		return;
+	}
+	sqlite3_result_text(context, render_markdown(markdown), -1, free);
+}
+
+/*
+ * Schema changes since initial.sql was first released, in order.
+ * The database's user_version is the number that have been applied.
+ * Only ever add to the end of this list.
+ */
+static const char* migrations[] = {
+	// 1: page content pre-rendered to HTML, so pages don't need markdown rendering
+	// when they're served. Existing rows are filled in by migrate_database.
+	"alter table page_content add column content_html text;",
+
+	// 2: revision counts for ETags, bumped by triggers whenever a page, its content,
+	// or a theme changes. page.last_modified is a unix timestamp as initial.sql
+	// says, not the text that current_timestamp gives.
+	"alter table page add column revision int not null default 0;"
+	"alter table theme add column revision int not null default 0;"
+	"alter table theme add column last_modified int not null default 0;"
+	"update page "
+		"set last_modified = cast(strftime('%s', last_modified) as integer) "
+		"where typeof(last_modified) = 'text';"
+	// Answers 'has anything in this server's navigation changed' from the index alone
+	"create index page_server_id_revision_idx on page (server_id, revision, last_modified);"
+	"create trigger page_revision after update of "
+			"server_id, parent_page_id, relative_path, replacement_page_id, purge on page "
+		"begin "
+			"update page "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = new.id; "
+		"end;"
+	"create trigger page_content_insert_revision after insert on page_content "
+		"begin "
+			"update page "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = new.page_id; "
+		"end;"
+	"create trigger page_content_update_revision after update on page_content "
+		"begin "
+			"update page "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id in (old.page_id, new.page_id); "
+		"end;"
+	"create trigger page_content_delete_revision after delete on page_content "
+		"begin "
+			"update page "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = old.page_id; "
+		"end;"
+	"create trigger theme_revision after update of template on theme "
+		"begin "
+			"update theme "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = new.id; "
+		"end;"
+	"create trigger theme_content_insert_revision after insert on theme_content "
+		"begin "
+			"update theme "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = new.theme_id; "
+		"end;"
+	"create trigger theme_content_update_revision after update on theme_content "
+		"begin "
+			"update theme "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id in (old.theme_id, new.theme_id); "
+		"end;"
+	"create trigger theme_content_delete_revision after delete on theme_content "
+		"begin "
+			"update theme "
+			"set revision = revision + 1, last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = old.theme_id; "
+		"end;",
+
+	// 3: theme content is looked up by theme and language
+	"create index theme_content_theme_id_language_idx on theme_content (theme_id, language);",
+
+	// 4: a revision count for each server's navigation, bumped whenever one of its
+	// pages is added, removed or changes, so it doesn't need adding up from every page.
+	// Page content changes reach it through page_content_*_revision bumping the page.
+	"alter table server add column nav_revision int not null default 0;"
+	"alter table server add column nav_last_modified int not null default 0;"
+	"update server "
+		"set nav_last_modified = coalesce("
+			"(select max(last_modified) from page where server_id = server.id), 0);"
+	"drop index page_server_id_revision_idx;"
+	"create trigger page_insert_nav_revision after insert on page "
+		"begin "
+			"update server "
+			"set nav_revision = nav_revision + 1, "
+				"nav_last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = new.server_id; "
+		"end;"
+	"create trigger page_update_nav_revision after update of revision on page "
+		"begin "
+			"update server "
+			"set nav_revision = nav_revision + 1, "
+				"nav_last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id in (old.server_id, new.server_id); "
+		"end;"
+	"create trigger page_delete_nav_revision after delete on page "
+		"begin "
+			"update server "
+			"set nav_revision = nav_revision + 1, "
+				"nav_last_modified = cast(strftime('%s', 'now') as integer) "
+			"where id = old.server_id; "
+		"end;",
+};
+
+/*
+ * Brings the database schema up to date.
+ */
+void migrate_database() {
+	sqlite3_stmt* stmt;
+	sqlite_check(db, sqlite3_prepare_v2(db, "pragma user_version", -1, &stmt, NULL));
+	int v = sqlite3_step(stmt);
+	if (v != SQLITE_ROW) {
+		sqlite_check(db, v);
+	}
+	int version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	int count = sizeof(migrations) / sizeof(migrations[0]);
+	for (; version < count; version++) {
+		log_message(LOG_LEVEL_INFO, "Migrating database to version %d", version + 1);
+		char set_version[64];
+		snprintf(set_version, sizeof(set_version), "pragma user_version = %d;", version + 1);
+		sqlite_check(db, sqlite3_exec(db, "begin;", NULL, NULL, NULL));
+		sqlite_check(db, sqlite3_exec(db, migrations[version], NULL, NULL, NULL));
+		sqlite_check(db, sqlite3_exec(db, set_version, NULL, NULL, NULL));
+		sqlite_check(db, sqlite3_exec(db, "commit;", NULL, NULL, NULL));
+	}
+
+	// Content written before content_html existed, or by something
+	// other than ccms (e.g. the testing data in initial.sql), won't
+	// have been rendered yet.
+	sqlite_check(db, sqlite3_exec(db,
+				"update page_content "
+				"set content_html = markdown_to_html(content) "
+				"where content_html is null", NULL, NULL, NULL));
+}
+
+/*
+ * Opens the writer connection, and sets up or migrates the schema.
+ * The writer is also the current thread's connection afterwards.
+ */
+void initialize_database(const char* database_path) {
+	db_writer = open_connection(database_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+	connection = db_writer;
+	db = db_writer->db;
+
+	// Write-ahead logging, so readers see the last commit rather than
+	// waiting for a write to finish, and writes don't wait for readers
+	sqlite3_stmt* stmt;
+	sqlite_check(db, sqlite3_prepare_v2(db, "pragma journal_mode = wal", -1, &stmt, NULL));
+	int v = sqlite3_step(stmt);
+	if (v != SQLITE_ROW) {
+		sqlite_check(db, v);
+	}
+	if (strcmp((const char*)sqlite3_column_text(stmt, 0), "wal") != 0) {
+		fprintf(stderr, "Couldn't enable write-ahead logging, journal mode is %s\n",
+				sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+	char pragma[64];
+	snprintf(pragma, sizeof(pragma), "pragma synchronous = %s", config.synchronous);
+	sqlite_check(db, sqlite3_exec(db, pragma, NULL, NULL, NULL));
+	if (config.checkpoint_pages > 0) {
+		// The checkpointer thread does this instead, see start_checkpointer
+		sqlite_check(db, sqlite3_exec(db, "pragma wal_autocheckpoint = 0", NULL, NULL, NULL));
+	}
+	sqlite_check(db, sqlite3_create_function(db, "markdown_to_html", 1,
+				SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+				sqlite_markdown_to_html, NULL, NULL));
+	char* initial_script = null_terminated_resource(src_initial_sql);
+	sqlite_check(db, sqlite3_exec(db, initial_script, NULL, NULL, NULL));
+	free(initial_script);
+	migrate_database();
+	sqlite3_update_hook(db, database_update_hook, NULL);
+}
+
+/*
+ * Makes a pooled read-only connection the current thread's connection,
+ * opening one if none are idle.
+ */
+void acquire_reader() {
+	pthread_mutex_lock(&db_readers_lock);
+	connection = da_empty(db_readers) ? NULL : da_pop(db_readers);
+	pthread_mutex_unlock(&db_readers_lock);
+	if (connection == NULL) {
+		connection = open_connection(config.database_path,
+				SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX);
+	}
+	db = connection->db;
+}
+
+/*
+ * Returns the current thread's read-only connection to the pool.
+ * Keeps one per worker thread, any more are closed.
+ */
+void release_reader() {
+	pthread_mutex_lock(&db_readers_lock);
+	if (da_count(db_readers) < config.threads) {
+		da_push(db_readers, connection);
+		connection = NULL;
+	}
+	pthread_mutex_unlock(&db_readers_lock);
+	if (connection != NULL) {
+		close_connection(connection);
+		connection = NULL;
+	}
+	db = NULL;
+}
+
+/*
+ * Makes the writer the current thread's connection, waiting
+ * for any other thread using it to finish.
+ */
+void acquire_writer() {
+	pthread_mutex_lock(&db_writer_lock);
+	connection = db_writer;
+	db = db_writer->db;
+}
+
+/*
+ * Hands the writer back. Its statements are run outside of explicit
+ * transactions, so everything it changed has been committed by now.
+ */
+void release_writer() {
+	flush_dirty_caches();
+	connection = NULL;
+	db = NULL;
+	pthread_mutex_unlock(&db_writer_lock);
+}
+
+/*
+ * Called by sqlite after each commit on the writer, with the number
+ * of pages in the WAL. Wakes the checkpointer once it's big enough.
+ */
+int database_wal_hook(void* cls, sqlite3* conn, const char* database, int pages) {
+	pthread_mutex_lock(&checkpointer.lock);
+	checkpointer.wal_pages = pages;
+	if (pages >= config.checkpoint_pages) {
+		pthread_cond_signal(&checkpointer.wake);
+	}
+	pthread_mutex_unlock(&checkpointer.lock);
+	return SQLITE_OK;
+}
+
+/*
+ * Checkpoints the WAL into the database whenever the writer has
+ * grown it past the threshold. Uses its own connection, so neither
+ * readers nor the writer wait for it.
+ */
+void* run_checkpointer(void* arg) {
+	pthread_mutex_lock(&checkpointer.lock);
+	while (!checkpointer.stopping) {
+		if (checkpointer.wal_pages < config.checkpoint_pages) {
+			pthread_cond_wait(&checkpointer.wake, &checkpointer.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&checkpointer.lock);
+		int log_pages = 0;
+		int checkpointed_pages = 0;
+		// Passive doesn't wait for anyone, but can't copy pages that readers'
+		// snapshots still need, or reset the WAL while they're using it
+		int v = sqlite3_wal_checkpoint_v2(checkpointer.conn, NULL,
+				SQLITE_CHECKPOINT_PASSIVE, &log_pages, &checkpointed_pages);
+		if (v == SQLITE_OK && log_pages >= 4 * config.checkpoint_pages) {
+			// Readers are keeping the WAL from being reused. They're short lived,
+			// so wait for them (briefly blocking the writer) and truncate it.
+			v = sqlite3_wal_checkpoint_v2(checkpointer.conn, NULL,
+					SQLITE_CHECKPOINT_TRUNCATE, &log_pages, &checkpointed_pages);
+		}
+		if (v != SQLITE_OK && v != SQLITE_BUSY) {
+			log_message(LOG_LEVEL_ERROR, "Checkpoint failed: %s", sqlite3_errmsg(checkpointer.conn));
+		}
+		pthread_mutex_lock(&checkpointer.lock);
+		// Until the next commit tells us otherwise. If some pages couldn't be
+		// checkpointed they'll be tried again then.
+		checkpointer.wal_pages = 0;
+	}
+	pthread_mutex_unlock(&checkpointer.lock);
+	return NULL;
+}
+
+/*
+ * Starts checkpointing in the background, if it's enabled.
+ */
+void start_checkpointer() {
+	if (config.checkpoint_pages <= 0) {
+		return;
+	}
+	sqlite_check(checkpointer.conn, sqlite3_open_v2(config.database_path, &checkpointer.conn,
+				SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL));
+	sqlite_check(checkpointer.conn, sqlite3_busy_timeout(checkpointer.conn, 5000));
+	// A connection doesn't find out it's in WAL mode until it first reads,
+	// and checkpoints do nothing until then
+	sqlite_check(checkpointer.conn, sqlite3_exec(checkpointer.conn,
+				"select count(*) from sqlite_master", NULL, NULL, NULL));
+	sqlite3_wal_hook(db_writer->db, database_wal_hook, NULL);
+	pthread_create(&checkpointer.thread, NULL, run_checkpointer, NULL);
+	checkpointer.running = true;
+}
+
+void stop_checkpointer() {
+	if (!checkpointer.running) {
+		return;
+	}
+	pthread_mutex_lock(&checkpointer.lock);
+	checkpointer.stopping = true;
+	pthread_cond_signal(&checkpointer.wake);
+	pthread_mutex_unlock(&checkpointer.lock);
+	pthread_join(checkpointer.thread, NULL);
+	sqlite3_close(checkpointer.conn);
+	checkpointer.running = false;
+}
+
+void close_database() {
+	stop_checkpointer();
+	for (int i = 0; i < da_count(db_readers); i++) {
+		close_connection(da_get(db_readers, i));
+	}
+	da_free(db_readers);
+	if (db_writer != NULL) {
+		close_connection(db_writer);
+		db_writer = NULL;
+	}
+}
+
+/*
+ * Serializes a json_object to a string and wraps it up in an 
+ * HttpResponse for return to the http server library
+ */
+HttpResponse http_json_response(struct json_object* obj, int status_code) {
+	char* jsonstr = (char*)json_object_to_json_string(obj);
+	HttpResponse ret = {
+		.content = strdup(jsonstr),
+		.content_length = strlen(jsonstr),
+		.content_type = "application/json",
+		.status_code = status_code,
+	};
+	return ret;
+}
+
+/*
+ * Wraps an error message in a JSON string, i.e:
+ * { "error": "your message here" }
+ * Caller is responsible for freeing the string.
+ */
+HttpResponse http_error_response(char* errmsg, int status_code) {
+	struct json_object* obj = json_object_new_object();
+	json_object_object_add(obj, "error", json_object_new_string(errmsg));
+	HttpResponse ret = http_json_response(obj, status_code);
+	json_object_put(obj);
+	return ret;
+}
+
+/*
+ * Parses a request's JSON body. Returns NULL if there wasn't a body,
+ * or it isn't JSON.
+ */
+struct json_object* parse_json_body(const char* body) {
+	return body != NULL ? json_tokener_parse(body) : NULL;
+}
+
+
+///////////// Metrics /////////////////
+
+/*
+ * Appends to the text, printf style
+ */
+void text_printf(Text* t, const char* format, ...) {
+	for (;;) {
+		va_list args;
+		va_start(args, format);
+		int n = vsnprintf(t->data + t->length, t->capacity - t->length, format, args);
+		va_end(args);
+		if (t->length + n < t->capacity) {
+			t->length += n;
+			return;
+		}
+		t->capacity = (t->capacity + n + 1) * 2;
+		t->data = realloc(t->data, t->capacity);
+	}
+}
+
+/*
+ * Writes a histogram's series, labelled, e.g. route="content".
+ * The count is taken from the buckets, so they always agree.
+ * Nothing is written until something's been recorded.
+ */
+void write_histogram(Text* t, const char* name, const char* labels, Histogram* h) {
+	unsigned long counts[HISTOGRAM_BUCKETS + 1];
+	bool empty = true;
+	for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+		counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+		empty = empty && counts[i] == 0;
+	}
+	if (empty) {
+		return;
+	}
+	unsigned long count = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		count += counts[i];
+		text_printf(t, "%s_bucket{%s,le=\"%g\"} %lu\n",
+				name, labels, histogram_bucket_limit(i) / 1e6, count);
+	}
+	count += counts[HISTOGRAM_BUCKETS];
+	text_printf(t, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, count);
+	text_printf(t, "%s_sum{%s} %.9f\n", name, labels,
+			__atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+	text_printf(t, "%s_count{%s} %lu\n", name, labels, count);
+}
+
+/*
+ * Appends the process's memory and file descriptor use, where the
+ * system makes them available, as a long running server's leaks
+ * show up there first
+ */
+void process_metrics_to_text(Text* t) {
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		unsigned long size, resident;
+		if (fscanf(statm, "%lu %lu", &size, &resident) == 2) {
+			text_printf(t, "# TYPE process_resident_memory_bytes gauge\n"
+					"process_resident_memory_bytes %lu\n",
+					resident * sysconf(_SC_PAGESIZE));
+		}
+		fclose(statm);
+	}
+	DIR* fds = opendir("/proc/self/fd");
+	if (fds != NULL) {
+		int count = 0;
+		struct dirent* entry;
+		while ((entry = readdir(fds)) != NULL) {
+			if (entry->d_name[0] != '.') {
+				count++;
+			}
+		}
+		closedir(fds);
+		// Not counting the one reading the directory
+		text_printf(t, "# TYPE process_open_fds gauge\n"
+				"process_open_fds %d\n", count - 1);
+	}
+#ifdef HAVE_MALLINFO2
+	struct mallinfo2 mi = mallinfo2();
+	text_printf(t, "# HELP ccms_heap_allocated_bytes Bytes allocated with malloc and not yet freed.\n"
+			"# TYPE ccms_heap_allocated_bytes gauge\n"
+			"ccms_heap_allocated_bytes %zu\n"
+			"# HELP ccms_heap_free_bytes Bytes malloc holds on to that aren't allocated.\n"
+			"# TYPE ccms_heap_free_bytes gauge\n"
+			"ccms_heap_free_bytes %zu\n",
+			mi.uordblks + mi.hblkhd,
+			mi.fordblks);
+#endif
+}
+
+/*
+ * All the metrics, in Prometheus' text format
+ */
+Text metrics_to_text() {
+	Text t = {0};
+	char labels[64];
+	text_printf(&t, "# HELP ccms_responses_total Responses sent, by route and status class.\n"
+			"# TYPE ccms_responses_total counter\n");
+	for (int r = 0; r < ROUTE_COUNT; r++) {
+		for (int c = 0; c < 5; c++) {
+			text_printf(&t, "ccms_responses_total{route=\"%s\",code=\"%dxx\"} %lu\n",
+					route_names[r], c + 1,
+					__atomic_load_n(&metrics.responses[r][c], __ATOMIC_RELAXED));
+		}
+	}
+	text_printf(&t, "# HELP ccms_request_duration_seconds Time from a request arriving to its response being queued.\n"
+			"# TYPE ccms_request_duration_seconds histogram\n");
+	for (int r = 0; r < ROUTE_COUNT; r++) {
+		snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+		write_histogram(&t, "ccms_request_duration_seconds", labels, &metrics.routes[r]);
+	}
+	text_printf(&t, "# HELP ccms_stage_duration_seconds Time spent in each stage of handling requests.\n"
+			"# TYPE ccms_stage_duration_seconds histogram\n");
+	for (int s = 0; s < STAGE_COUNT; s++) {
+		snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[s]);
+		write_histogram(&t, "ccms_stage_duration_seconds", labels, &metrics.stages[s]);
+	}
+	pthread_mutex_lock(&page_cache.lock);
+	text_printf(&t, "# TYPE ccms_page_cache_hits_total counter\n"
+			"ccms_page_cache_hits_total %lu\n"
+			"# TYPE ccms_page_cache_misses_total counter\n"
+			"ccms_page_cache_misses_total %lu\n"
+			"# TYPE ccms_page_cache_evictions_total counter\n"
+			"ccms_page_cache_evictions_total %lu\n"
+			"# TYPE ccms_page_cache_invalidations_total counter\n"
+			"ccms_page_cache_invalidations_total %lu\n"
+			"# TYPE ccms_page_cache_entries gauge\n"
+			"ccms_page_cache_entries %zu\n"
+			"# TYPE ccms_page_cache_bytes gauge\n"
+			"ccms_page_cache_bytes %zu\n",
+			page_cache.hits,
+			page_cache.misses,
+			page_cache.evictions,
+			page_cache.invalidations,
+			page_cache.entry_count,
+			page_cache.bytes);
+	pthread_mutex_unlock(&page_cache.lock);
+	text_printf(&t, "# TYPE ccms_log_records_dropped_total counter\n"
+			"ccms_log_records_dropped_total %lu\n",
+			__atomic_load_n(&log_writer.dropped, __ATOMIC_RELAXED));
+	process_metrics_to_text(&t);
+	return t;
+}
+
+HttpResponse handle_metrics(const char* method) {
+	if (strcmp("GET", method) != 0) {
+		return http_error_response("Method not allowed", 405);
+	}
+	Text t = metrics_to_text();
+	HttpResponse r = {
+		.status_code = 200,
+		.content = t.data,
+		.content_length = t.length,
+		.content_type = "text/plain; version=0.0.4",
+	};
+	return r;
+}
+
+/*
+ * Starts timing the stages of the current thread's next request,
+ * or stops if it isn't to be traced.
+ */
+void request_trace_begin(bool active, const char* host, const char* path) {
+	memset(&request_trace, 0, sizeof(request_trace));
+	request_trace.active = active;
+	request_trace.host = host;
+	request_trace.path = path;
+}
+
+/*
+ * Formats the traced stages as a Server-Timing header, in milliseconds.
+ * handled_ns is how long the request took up to its response being made.
+ */
+void format_server_timing(char* out, size_t size, unsigned long handled_ns) {
+	size_t n = 0;
+	out[0] = 0;
+	for (int s = 0; s < STAGE_COUNT && n < size; s++) {
+		if (request_trace.stage_counts[s] == 0) {
+			continue;
+		}
+		n += snprintf(out + n, size - n, "%s;dur=%.3f",
+				stage_names[s],
+				request_trace.stage_ns[s] / 1e6);
+		if (s == STAGE_SQL && n < size) {
+			n += snprintf(out + n, size - n, ";desc=\"%d statements\"",
+					request_trace.stage_counts[s]);
+		}
+		if (n < size) {
+			n += snprintf(out + n, size - n, ", ");
+		}
+	}
+	if (n < size) {
+		snprintf(out + n, size - n, "total;dur=%.3f", handled_ns / 1e6);
+	}
+}
+
+/*
+ * Logs the current request with the time spent in each stage
+ */
+void log_slow_request(const char* method, const char* host, const char* path, unsigned long ns) {
+	char stages[160];
+	size_t n = 0;
+	stages[0] = 0;
+	for (int s = 0; s < STAGE_COUNT && n < sizeof(stages); s++) {
+		if (request_trace.stage_counts[s] == 0) {
+			continue;
+		}
+		n += snprintf(stages + n, sizeof(stages) - n, " %s=%.3fms/%d",
+				stage_names[s],
+				request_trace.stage_ns[s] / 1e6,
+				request_trace.stage_counts[s]);
+	}
+	log_message(LOG_LEVEL_WARNING, "Slow request %.3fms%s: %s %s %s",
+			ns / 1e6, stages, method, host != NULL ? host : "-", path);
+}
+
+///////////// Content /////////////////
+
+/*
+ * Reads page validators from a row with the columns
+ * pc.id, p.id, p.revision, p.last_modified, t.id, t.revision, t.last_modified,
+ * s.nav_revision, s.nav_last_modified starting at column.
+ * The ETag covers everything the rendered page is made from: the page and
+ * its content, the theme and its content, and the server's other pages
+ * (which make up the navigation), so any change to them changes the tag.
+ */
+PageValidators read_page_validators(sqlite3_stmt* stmt, int column, const char* lang) {
+	PageValidators pv = {0};
+	pv.found = sqlite3_column_type(stmt, column) != SQLITE_NULL;
+	if (!pv.found) {
+		return pv;
+	}
+	snprintf(pv.etag, sizeof(pv.etag), "\"%d.%d-%d.%d-%d-%08x\"",
+			sqlite3_column_int(stmt, column + 1),
+			sqlite3_column_int(stmt, column + 2),
+			sqlite3_column_int(stmt, column + 4),
+			sqlite3_column_int(stmt, column + 5),
+			sqlite3_column_int(stmt, column + 7),
+			(unsigned)hash_string(2166136261u, lang));
+	sqlite3_int64 times[] = {
+		sqlite3_column_int64(stmt, column + 3),
+		sqlite3_column_int64(stmt, column + 6),
+		sqlite3_column_int64(stmt, column + 8),
+	};
+	for (int i = 0; i < 3; i++) {
+		if (times[i] > pv.last_modified) {
+			pv.last_modified = (time_t)times[i];
+		}
+	}
+	return pv;
+}
+
+/*
+ * Just the validators for a page (see read_page_validators), all from the
+ * server, theme and page rows without reading the page's content, so a
+ * conditional request is answered from three index lookups.
+ * Binds ?1 path, ?2 language, ?3 server id.
+ */
+static const char* page_validators_sql =
+	"select pc.id, p.id, p.revision, p.last_modified, "
+		"t.id, t.revision, t.last_modified, "
+		"s.nav_revision, s.nav_last_modified "
+	"from server s "
+	"join theme t on t.id = s.theme_id "
+	"left outer join page p "
+		"on p.server_id = s.id "
+		"and p.relative_path = ?1 "
+	"left outer join page_content pc "
+		"on pc.page_id = p.id "
+		"and pc.language = ?2 "
+	"where s.id = ?3";
+
+/*
+ * Everything about a page needed from the database to render it, in one row:
+ * its validators (see read_page_validators), then its title, content and
+ * language. The theme's content and the navigation are held in memory.
+ * Binds ?1 path, ?2 language, ?3 server id.
+ */
+static const char* page_data_sql =
+	"select pc.id, p.id, p.revision, p.last_modified, "
+		"t.id, t.revision, t.last_modified, "
+		"s.nav_revision, s.nav_last_modified, "
+		"pc.title, pc.content_html, pc.language "
+	"from server s "
+	"join theme t on t.id = s.theme_id "
+	"left outer join page p "
+		"on p.server_id = s.id "
+		"and p.relative_path = ?1 "
+	"left outer join page_content pc "
+		"on pc.page_id = p.id "
+		"and pc.language = ?2 "
+	"where s.id = ?3";
+
+/*
+ * Whether a plan's SCAN of name is reading the page table, either by name
+ * or by an alias the query gives it
+ */
+bool plan_scans_page(const char* query, const char* name) {
+	if (strcmp(name, "page") == 0) {
+		return true;
+	}
+	const char* forms[] = {"from page %s ", "join page %s "};
+	for (int i = 0; i < sizeof(forms) / sizeof(forms[0]); i++) {
+		char aliased[96];
+		snprintf(aliased, sizeof(aliased), forms[i], name);
+		if (strstr(query, aliased) != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Checks the page queries are answered from indexes, without scanning
+ * page, page_content or any other table, as that gets slower with every page
+ * added. page is never to be scanned at all, not even inside a subquery, as
+ * the navigation's revision is kept on the server row to avoid just that.
+ * Reports any that do and returns false.
+ */
+bool check_query_plans() {
+	const char* queries[] = {page_validators_sql, page_data_sql, nav_sql, theme_content_sql};
+	bool ok = true;
+	for (int q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+		size_t length = strlen(queries[q]) + 32;
+		char explain[length];
+		snprintf(explain, length, "explain query plan %s", queries[q]);
+		sqlite3_stmt* stmt;
+		sqlite_check(db, sqlite3_prepare_v2(db, explain, -1, &stmt, NULL));
+		// Scanning a subquery's results is fine, they've been filtered already
+		Strings subqueries = {0};
+		int v;
+		for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
+			const char* detail = (const char*)sqlite3_column_text(stmt, 3);
+			char name[64] = "";
+			if (sscanf(detail, "MATERIALIZE %63s", name) == 1
+					|| sscanf(detail, "CO-ROUTINE %63s", name) == 1) {
+				da_push(subqueries, strdup(name));
+			} else if (sscanf(detail, "SCAN %63s", name) == 1
+					&& plan_scans_page(queries[q], name)) {
+				fprintf(stderr, "Query plan scans page (%s) for: %s\n", detail, queries[q]);
+				ok = false;
+			} else if (sscanf(detail, "SCAN %63s", name) == 1
+					&& strcmp(name, "CONSTANT") != 0
+					&& strcmp(name, "SUBQUERY") != 0) {
+				bool is_subquery = false;
+				for (int i = 0; i < da_count(subqueries); i++) {
+					is_subquery = is_subquery || strcmp(da_get(subqueries, i), name) == 0;
+				}
+				if (!is_subquery) {
+					fprintf(stderr, "Query plan has a full scan (%s) for: %s\n", detail, queries[q]);
+					ok = false;
+				}
+			}
+		}
+		if (v != SQLITE_DONE) {
+			sqlite_check(db, v);
+		}
+		sqlite3_finalize(stmt);
+		free_strings(subqueries);
+	}
+	return ok;
+}
+
+/*
+ * Finds the validators for a page without loading or rendering it.
+ */
+PageValidators find_page_validators(int server_id,
+		const char* path,
+		const char* lang) {
+	sqlite3_stmt* stmt = prepare_cached(page_validators_sql);
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, path, -1, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 2, lang, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 3, server_id));
+	PageValidators pv = {0};
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		pv = read_page_validators(stmt, 0, lang);
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	finish_cached(stmt);
+	return pv;
+}
+
+/*
+ * Finds the page contents, given a particular server, path, and language.
+ */
+PageData find_page_data(int server_id,
+		const char* path, 
+		const char* lang) {
+	log_debug("Looking for page with server %d path %s lang %s",
+			server_id, 
+			path,
+			lang);
+	PageData pl = {
+		.theme_id = 0,
+		.theme_revision = 0,
+		.theme_content = NULL,
+		.title = NULL,
+		.content = NULL,
+		.nav = NULL,
+		.language = NULL,
+		.isnotfound = true,
+	};
 
-	// Fetch navigation data
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select p.relative_path, pc.title "
-				"from server s "
-				"join page p "
-				  "on p.server_id = s.id "
-				"join page_content pc "
-				  "on pc.page_id = p.id "
-				"where s.id = "
-				  "(select max(id) "
-				    "from server s2 "
-				    "where (s2.hostname = ? or s2.is_default)) "
-				"and pc.language = 'en'", -1, &stmt, NULL)); // TODO language selection
+	sqlite3_stmt* stmt = prepare_cached(page_data_sql);
 	sqlite_check(db, sqlite3_bind_text(stmt, 1, path, -1, NULL));
-	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
-		NavItem nn = {
-		  .url = strdup((const char*)sqlite3_column_text(stmt, 0)),
-		  .title = strdup((const char*)sqlite3_column_text(stmt, 1)),
-		};
-		da_push(pl.nav_items, nn);
-	}
-	if (v != SQLITE_DONE) {
+	sqlite_check(db, sqlite3_bind_text(stmt, 2, lang, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 3, server_id));
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_DONE) {
+		fprintf(stderr, "Couldn't find server %d OOPS!\n", server_id);
+		raise(SIGTERM);
+	} else if (v != SQLITE_ROW) {
 		sqlite_check(db, v);
 	}
-	sqlite3_finalize(stmt);
+	pl.theme_id = sqlite3_column_int(stmt, 4);
+	pl.theme_revision = sqlite3_column_int(stmt, 5);
+	int nav_revision = sqlite3_column_int(stmt, 7);
+	pl.validators = read_page_validators(stmt, 0, lang);
+	pl.isnotfound = !pl.validators.found;
+	const char* title = (const char*)sqlite3_column_text(stmt, 9);
+	const char* content = (const char*)sqlite3_column_text(stmt, 10);
+	const char* language = (const char*)sqlite3_column_text(stmt, 11);
+	if (pl.validators.found) {
+		pl.title = strdup(title);
+		// Already rendered from markdown when the content was saved
+		pl.content = strdup(content != NULL ? content : "");
+	} else {
+		pl.title = strdup("Not Found!");
+		pl.content = strdup("Not found!"); // TODO customizable error page
+	}
+	pl.language = strdup(language != NULL ? language : "en"); // Possibly should be server default language
+	finish_cached(stmt);
+	pl.nav = nav_cache_get(server_id, lang, nav_revision);
 	return pl;
 }
 
 void free_page_data(PageData pld) {
 	free(pld.content);
 	free(pld.title);
-	free(pld.template);
-	for (int i=0; i<da_count(pld.nav_items); i++) {
-		NavItem ni = da_get(pld.nav_items, i);
-		free(ni.title);
-		free(ni.url);
-	}
-	da_free(pld.nav_items);
+	release_nav_tree(pld.nav);
 	free(pld.language);
-	for (int i=0; i<da_count(pld.content_items); i++) {
-		ThemeContentItem tci = da_get(pld.content_items, i);
-		free(tci.name);
-		free(tci.value);
-	}
-	da_free(pld.content_items);
+	release_theme_content(pld.theme_content);
 }
 
-/* 
- * Imlementation for fetching mustach template values from the PageData.
- * tags 'title' and 'content' are supported, along with any user defined theme content items.
- * iterable '#nav' is supported, with 'title' and 'url' members to provide a site navigation.
- */
-int mustache_get(void* cls, const char* name, struct mustach_sbuf* sbuf) {
-	PageData* pld = (PageData*)cls;
-	sbuf->value = "";
-	sbuf->freecb = NULL;
-	if (pld->isnav) {
-		// If we're iterating inside a #nav block, 
-		// then title and url are valid names
-		NavItem ni = da_get(pld->nav_items, pld->navix);
-		if (strcmp(name, "title") == 0) {
-			sbuf->value = ni.title;
-		} else if (strcmp(name, "url") == 0) {
-			sbuf->value = ni.url;
-		} 
-		// TODO highlighting the currently selected nav item
-	} else if (strcmp(name, "title") == 0) {
-		sbuf->value = pld->title;
-	} else if (strcmp(name, "content") == 0) {
-		sbuf->value = pld->content;
-	} else if (strcmp(name, "language") == 0) {
-		sbuf->value = pld->language;
-	} else {
-		// Fall back to looking among the theme content items
-		for (int i=0; i<da_count(pld->content_items); i++) {
-			ThemeContentItem tci = da_get(pld->content_items, i);
-			if (strcmp(name, tci.name) == 0) {
-				sbuf->value = tci.value;
-			}
-		}
-	}
-	return MUSTACH_OK;
+/*
+ * Sets up a page to be rendered as it's sent.
+ * Takes ownership of the page data and the reference to the template.
+ */
+PageStream* page_stream_new(Template* t, PageData pd) {
+	PageStream* s = malloc(sizeof(PageStream));
+	s->pd = pd;
+	s->template = t;
+	s->render_ns = 0;
+	s->length = 0;
+	template_renderer_init(&s->renderer, t, &s->pd);
+	return s;
 }
-int mustache_enter(void *closure, const char *name) {
-	PageData* pld = (PageData*)closure;
-	if (strcmp(name, "nav") == 0) {
-		pld->isnav = 1;
-		pld->navix = 0;
-		return 1;
-	} 
-	return 0;	
+
+/*
+ * Called by the http server for the next part of a streamed page
+ */
+ssize_t page_stream_read(void* cls, uint64_t pos, char* buf, size_t max) {
+	PageStream* s = cls;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t n = template_render_some(&s->renderer, buf, max);
+	s->render_ns += elapsed_since(start);
+	s->length += n;
+	if (n == 0 && template_render_done(&s->renderer)) {
+		return MHD_CONTENT_READER_END_OF_STREAM;
+	}
+	return n;
 }
-int mustache_next(void *closure) {
-	PageData* pld = (PageData*)closure;
-	if (pld->isnav) {
-		if (pld->navix < (da_count(pld->nav_items)-1)) {
-			pld->navix++;
-			return 1;
-		}
-	} 
-	return 0;
+
+/*
+ * Called by the http server once a streamed page is finished with
+ */
+void page_stream_free(void* cls) {
+	PageStream* s = cls;
+	record_stage(STAGE_TEMPLATE, s->render_ns);
+	// After the request, which the host and path went with
+	PROBE(template__done, NULL, NULL, s->length, s->render_ns);
+	free_page_data(s->pd);
+	release_template(s->template);
+	free(s);
 }
-int mustache_leave(void *closure) {
-	PageData* pld = (PageData*)closure;
-	pld->isnav = 0;
-	return MUSTACH_OK;	
+
+/*
+ * Adds a value that needs escaping to a page sent as pieces
+ */
+void page_iovec_add_escaped(PageIovec* p, const char* value, size_t length) {
+	size_t needed = p->escaped_length + length * HTML_ESCAPE_MAX_EXPANSION;
+	if (needed > p->escaped_capacity) {
+		p->escaped_capacity = needed > p->escaped_capacity * 2 ? needed : p->escaped_capacity * 2;
+		p->escaped = realloc(p->escaped, p->escaped_capacity);
+	}
+	PagePiece piece = {
+		.data = NULL,
+		.offset = p->escaped_length,
+		.length = 0,
+	};
+	p->escaped_length += html_escape(p->escaped + p->escaped_length, value, length);
+	piece.length = p->escaped_length - piece.offset;
+	da_push(p->pieces, piece);
 }
-static struct mustach_itf mustache_page_data_interface = {
-	.enter = mustache_enter,
-	.next = mustache_next,
-	.leave = mustache_leave,
-	.get = mustache_get,
-};
-char* mustache_render(PageData pld) {
-	char* result;
-	size_t discard;
-	int v = mustach(pld.template, &mustache_page_data_interface, &pld, &result, &discard);
-	if (v != MUSTACH_OK) {
-		printf("Error with mustache %d\n", v);
-		raise(SIGTERM);
+
+/*
+ * Sets up a page to be sent as a list of pieces: the template's literal
+ * text and the page's values, where they don't need escaping, are sent
+ * from where they are rather than being copied together.
+ * Takes ownership of the page data and the reference to the template.
+ */
+PageIovec* page_iovec_new(Template* t, PageData pd) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	PageIovec* p = calloc(1, sizeof(PageIovec));
+	p->pd = pd;
+	p->template = t;
+	TemplateRenderer r;
+	template_renderer_init(&r, t, &p->pd);
+	while (template_step(&r)) {
+		if (r.pending_length == 0) {
+			continue;
+		}
+		if (r.pending_escaped
+				&& html_escape_scan(r.pending, r.pending_length) < r.pending_length) {
+			page_iovec_add_escaped(p, r.pending, r.pending_length);
+		} else {
+			PagePiece piece = {
+				.data = r.pending,
+				.offset = 0,
+				.length = r.pending_length,
+			};
+			da_push(p->pieces, piece);
+		}
 	}
-	return result;
+	// The escaped text has stopped moving, so its pieces can be pointed at
+	p->iov = malloc(sizeof(struct MHD_IoVec) * (da_count(p->pieces) + 1));
+	for (int i = 0; i < da_count(p->pieces); i++) {
+		PagePiece piece = da_get(p->pieces, i);
+		p->iov[i].iov_base = (piece.data != NULL ? piece.data : p->escaped) + piece.offset;
+		p->iov[i].iov_len = piece.length;
+		p->length += piece.length;
+	}
+	unsigned long ns = elapsed_since(start);
+	record_stage(STAGE_TEMPLATE, ns);
+	PROBE(template__done, request_trace.host, request_trace.path, p->length, ns);
+	return p;
 }
 
 /*
- * Find some static content from static_resource table.
- * Static resources are served from the /static path, 
- * and are attached to a particular virtual host.
+ * Called by the http server once a page sent as pieces is finished with
  */
-StaticResource find_static_resource(const char* host, const char* subpath) {
-	printf("Looking for static resource host %s subpath %s\n", host, subpath);
+void page_iovec_free(void* cls) {
+	PageIovec* p = cls;
+	free_page_data(p->pd);
+	release_template(p->template);
+	da_free(p->pieces);
+	free(p->escaped);
+	free(p->iov);
+	free(p);
+}
+
+//////////// API ///////////
+
+NewServer parse_new_server(struct json_object* o) {
+	NewServer s = {
+		.valid = 0,
+		.hostname = NULL,
+		.theme_id = -1,
+	};
+	if (o == NULL || !json_object_is_type(o, json_type_object)) {
+		return s;
+	}
+	struct json_object* hno = json_object_object_get(o, "hostname");
+	if (hno == NULL || !json_object_is_type(hno, json_type_string)) {
+		return s;
+	}
+	struct json_object* to = json_object_object_get(o, "theme_id");
+	if (to == NULL || !json_object_is_type(to, json_type_int)) {
+		return s;
+	}
+	s.valid = true;
+	s.hostname = strdup(json_object_get_string(hno));
+	s.theme_id = json_object_get_int(to);
+	return s;
+}
+
+void free_new_server(NewServer s) {
+	if (s.hostname != NULL)
+		free(s.hostname);
+}
+
+NewServerResponse create_server(NewServer ns) {
+	NewServerResponse r = {
+		.success = false,
+		.error_message = NULL
+	};
 	sqlite3_stmt* stmt;
 	sqlite_check(db, sqlite3_prepare_v2(db, 
-		"select sr.key, sr.value, sr.content_type "
-		"from static_resources sr "
-		"join server s on s.id = sr.server_id "
-		"where sr.key = ? "
-		"and s.hostname = ? ", -1, &stmt, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 1, subpath, -1, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 2, host, -1, NULL));
-	StaticResource r = {
-		.key = NULL,
-		.value = NULL,
-		.value_size = 0,
-		.content_type = NULL,
-		.isnotfound = true,
-	};
+			"insert into server (hostname, theme_id, default_language) "
+			"values (?, ?, ?)", -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, ns.hostname, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, ns.theme_id));
+	sqlite_check(db, sqlite3_bind_text(stmt, 3, "en", -1, NULL));
 	int v = sqlite3_step(stmt);
 	if (v == SQLITE_DONE) {
-		sqlite3_finalize(stmt);
-		return r;
+		Server s = {
+		  .id = sqlite3_last_insert_rowid(db),
+		  .hostname = strdup(ns.hostname),
+		};
+		r.success = true;
+		r.server = s;
+	} else {
+		r.error_message = strdup(sqlite3_errmsg(db));
 	}
-	r.key = strdup((const char*)sqlite3_column_text(stmt, 0));
-	const void* vz = sqlite3_column_blob(stmt, 1);
-	int sz = sqlite3_column_bytes(stmt, 1);
-	r.value = malloc(sz);
-	memcpy(r.value, vz, sz);
-	r.value_size = sz;
-	r.content_type = strdup((const char*)sqlite3_column_text(stmt, 2));
-	r.isnotfound = false;
 	sqlite3_finalize(stmt);
 	return r;
 }
 
-void free_static_resource(StaticResource r) {
-	free(r.key);
-	free(r.value);
-	free(r.content_type);
+void free_new_server_response(NewServerResponse n) {
+	if (n.error_message != NULL) 
+		free(n.error_message);
+	if (n.success)
+		free_server(n.server);
 }
 
-//////////// API ///////////
+struct json_object* server_to_json(Server s) {
+	struct json_object* o = json_object_new_object();
+	json_object_object_add(o, "id", json_object_new_int(s.id));
+	json_object_object_add(o, "hostname", json_object_new_string(s.hostname));
+	json_object_object_add(o, "theme_id", json_object_new_int(s.theme_id));
+	json_object_object_add(o, "is_default", json_object_new_boolean(s.is_default));
+	return o;
+}
 
-Servers get_servers() {
+struct json_object* servers_to_json(Servers s) {
+	struct json_object* v = json_object_new_array();
+	for (int i=0; i<da_count(s); i++) {
+		Server sv = da_get(s, i);
+		json_object_array_add(v, server_to_json(sv));
+	}
+	return v;
+}
+
+HttpResponse handle_api_server_path( 
+		const char* method,
+		const char* body) {
+	HttpResponse r = {
+		.status_code = 400,
+		.content = NULL,
+		.content_length = -1,
+		.content_type = NULL,
+	};
+	if (strcmp("GET", method) == 0) {
+		Servers servers = get_servers();
+		struct json_object* v = servers_to_json(servers);
+		r = http_json_response(v, 200);
+		json_object_put(v);
+		free_servers(servers);
+	} else if (strcmp("POST", method) == 0) {
+		struct json_object* json_body = parse_json_body(body);
+		NewServer ns = parse_new_server(json_body);
+		json_object_put(json_body);
+		if (ns.valid) {
+			NewServerResponse nsr = create_server(ns);
+			if (nsr.success) {
+				struct json_object* vv = server_to_json(nsr.server);
+				r = http_json_response(vv, 200);
+				json_object_put(vv);
+			} else {
+				r = http_error_response(nsr.error_message, 400);
+			}
+			free_new_server_response(nsr);
+		} else {
+			r = http_error_response("Invalid data supplied!", 400);
+		}
+		free_new_server(ns);
+	}
+	return r;
+}
+
+Themes get_themes() {
+	Themes t = {0};
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"select id, hostname, theme_id, is_default "
-				"from server", -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_prepare_v2(db, "select id, template from theme", -1, &stmt, NULL));
 	int v;
-	Servers s = {0};
 	for (v = sqlite3_step(stmt); v == SQLITE_ROW; v = sqlite3_step(stmt)) {
-		Server sv = {
+		Theme tt = {
 			.id = sqlite3_column_int(stmt, 0),
-			.hostname = strdup((const char*)sqlite3_column_text(stmt, 1)),
-			.theme_id = sqlite3_column_int(stmt, 2),
-			.is_default = sqlite3_column_int(stmt, 3),
+			.template = strdup((const char*)sqlite3_column_text(stmt, 1)),
 		};
-		da_push(s, sv);
+		da_push(t, tt);
 	}
 	if (v != SQLITE_DONE) {
 		sqlite_check(db, v);
 	}
 	sqlite3_finalize(stmt);
-	return s;
+	return t;
 }
 
-void free_server(Server s) {
-	free(s.hostname);
+void free_theme(Theme t) {
+	free(t.template);
 }
 
-void free_servers(Servers s) {
-	for (int i=0;i<da_count(s); i++) {
-		free_server(da_get(s, i));
+void free_themes(Themes t) {
+	for (int i=0; i<da_count(t); i++) {
+		free_theme(da_get(t, i));
 	}
-	da_free(s);
+	da_free(t);
 }
 
-NewServer parse_new_server(struct json_object* o) {
-	NewServer s = {
-		.valid = 0,
-		.hostname = NULL,
-		.theme_id = -1,
+struct json_object* theme_to_json(Theme t) {
+	struct json_object* o = json_object_new_object();
+	json_object_object_add(o, "id", json_object_new_int(t.id));
+	json_object_object_add(o, "template", json_object_new_string(t.template));
+	return o;
+}
+
+struct json_object* themes_to_json(Themes t) {
+	struct json_object* v = json_object_new_array();
+	for (int i=0; i<da_count(t); i++) {
+		json_object_array_add(v, theme_to_json(da_get(t, i)));
+	}
+	return v;
+}
+
+NewTheme parse_new_theme(struct json_object* o) {
+	NewTheme t = {
+		.valid = false,
+		.template = NULL,
 	};
 	if (o == NULL || !json_object_is_type(o, json_type_object)) {
-		return s;
+		return t;
 	}
-	struct json_object* hno = json_object_object_get(o, "hostname");
-	if (hno == NULL || !json_object_is_type(hno, json_type_string)) {
-		return s;
+	struct json_object* to = json_object_object_get(o, "template");
+	if (to == NULL || !json_object_is_type(to, json_type_string)) {
+		return t;
 	}
-	struct json_object* to = json_object_object_get(o, "theme_id");
-	if (to == NULL || !json_object_is_type(to, json_type_int)) {
-		return s;
+	t.valid = true;
+	t.template = strdup(json_object_get_string(to));
+	return t;
+}
+
+void free_new_theme(NewTheme t) {
+	if (t.template != NULL)
+		free(t.template);
+}
+
+/*
+ * Checks a template compiles before it's stored,
+ * so that mistakes are reported to the editor rather
+ * than when serving pages.
+ * Returns NULL if the template is OK, or an error message
+ * which the caller is responsible for freeing.
+ */
+char* validate_template(const char* template) {
+	TemplateCompileResult tcr = template_compile(template);
+	if (!tcr.success) {
+		return tcr.error_message;
+	}
+	release_template(tcr.template);
+	return NULL;
+}
+
+NewThemeResponse create_theme(NewTheme nt) {
+	NewThemeResponse r = {
+		.success = false,
+		.error_message = validate_template(nt.template),
+	};
+	if (r.error_message != NULL) {
+		return r;
+	}
+	sqlite3_stmt* stmt;
+	sqlite_check(db, sqlite3_prepare_v2(db,
+				"insert into theme (template) values (?)", -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, nt.template, -1, NULL));
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_DONE) {
+		Theme t = {
+			.id = sqlite3_last_insert_rowid(db),
+			.template = strdup(nt.template),
+		};
+		r.success = true;
+		r.theme = t;
+	} else {
+		r.error_message = strdup(sqlite3_errmsg(db));
+	}
+	sqlite3_finalize(stmt);
+	return r;
+}
+
+void free_new_theme_response(NewThemeResponse r) {
+	if (r.error_message != NULL)
+		free(r.error_message);
+	if (r.success)
+		free_theme(r.theme);
+}
+
+PatchTheme parse_patch_theme(struct json_object* v, int id) {
+	PatchTheme r = {
+		.valid = false,
+		.id = id,
+		.template = NULL,
+	};
+	if (v != NULL && json_object_is_type(v, json_type_object)) {
+		r.valid = true;
+		struct json_object* to = json_object_object_get(v, "template");
+		if (to != NULL && json_object_is_type(to, json_type_string)) {
+			r.template = strdup(json_object_get_string(to));
+		}
 	}
-	s.valid = true;
-	s.hostname = strdup(json_object_get_string(hno));
-	s.theme_id = json_object_get_int(to);
-	return s;
+	return r;
 }
 
-void free_new_server(NewServer s) {
-	if (s.hostname != NULL)
-		free(s.hostname);
+void free_patch_theme(PatchTheme pt) {
+	if (pt.template != NULL)
+		free(pt.template);
 }
 
-NewServerResponse create_server(NewServer ns) {
-	NewServerResponse r = {
+PatchThemeResponse update_theme(PatchTheme pt) {
+	PatchThemeResponse r = {
 		.success = false,
-		.error_message = NULL
+		.error_message = NULL,
 	};
+	if (pt.template == NULL) {
+		r.success = true;
+		return r;
+	}
+	r.error_message = validate_template(pt.template);
+	if (r.error_message != NULL) {
+		return r;
+	}
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, 
-			"insert into server (hostname, theme_id, default_language) "
-			"values (?, ?, ?)", -1, &stmt, NULL));
-	sqlite_check(db, sqlite3_bind_text(stmt, 1, ns.hostname, -1, NULL));
-	sqlite_check(db, sqlite3_bind_int(stmt, 2, ns.theme_id));
-	sqlite_check(db, sqlite3_bind_text(stmt, 3, "en", -1, NULL));
+	sqlite_check(db, sqlite3_prepare_v2(db,
+				"update theme set template = ? where id = ?", -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 1, pt.template, -1, NULL));
+	sqlite_check(db, sqlite3_bind_int(stmt, 2, pt.id));
 	int v = sqlite3_step(stmt);
 	if (v == SQLITE_DONE) {
-		Server s = {
-		  .id = sqlite3_last_insert_rowid(db),
-		  .hostname = strdup(ns.hostname),
-		};
 		r.success = true;
-		r.server = s;
 	} else {
 		r.error_message = strdup(sqlite3_errmsg(db));
 	}
@@ -647,72 +4601,83 @@ NewServerResponse create_server(NewServer ns) {
 	return r;
 }
 
-void free_new_server_response(NewServerResponse n) {
-	if (n.error_message != NULL) 
-		free(n.error_message);
-	if (n.success)
-		free_server(n.server);
-}
-
-struct json_object* server_to_json(Server s) {
-	struct json_object* o = json_object_new_object();
-	json_object_object_add(o, "id", json_object_new_int(s.id));
-	json_object_object_add(o, "hostname", json_object_new_string(s.hostname));
-	json_object_object_add(o, "theme_id", json_object_new_int(s.theme_id));
-	json_object_object_add(o, "is_default", json_object_new_boolean(s.is_default));
-	return o;
-}
-
-struct json_object* servers_to_json(Servers s) {
-	struct json_object* v = json_object_new_array();
-	for (int i=0; i<da_count(s); i++) {
-		Server sv = da_get(s, i);
-		json_object_array_add(v, server_to_json(sv));
-	}
-	return v;
+void free_patch_theme_response(PatchThemeResponse r) {
+	if (r.error_message != NULL)
+		free(r.error_message);
 }
 
-HttpResponse handle_api_server_path( 
-		const char* method,
-		const char* body) {
+HttpResponse handle_api_theme_path(const char* method,
+		const char* body,
+		Strings path_elements) {
 	HttpResponse r = {
 		.status_code = 400,
 		.content = NULL,
-		.content_length = -1,
+		.content_length = 0,
 		.content_type = NULL,
 	};
 	if (strcmp("GET", method) == 0) {
-		Servers servers = get_servers();
-		struct json_object* v = servers_to_json(servers);
-		r = http_json_response(v, 200);
-		json_object_put(v);
-		free_servers(servers);
+		Themes themes = get_themes();
+		struct json_object* json = themes_to_json(themes);
+		r = http_json_response(json, 200);
+		json_object_put(json);
+		free_themes(themes);
 	} else if (strcmp("POST", method) == 0) {
-		struct json_object* json_body = json_tokener_parse(body);
-		NewServer ns = parse_new_server(json_body);
-		json_object_put(json_body);
-		if (ns.valid) {
-			NewServerResponse nsr = create_server(ns);
-			if (nsr.success) {
-				struct json_object* vv = server_to_json(nsr.server);
-				r = http_json_response(vv, 200);
-				json_object_put(vv);
+		struct json_object* v = parse_json_body(body);
+		if (v != NULL) {
+			NewTheme nt = parse_new_theme(v);
+			if (nt.valid) {
+				NewThemeResponse ntr = create_theme(nt);
+				if (ntr.success) {
+					struct json_object* theme = theme_to_json(ntr.theme);
+					r = http_json_response(theme, 200);
+					json_object_put(theme);
+				} else {
+					r = http_error_response(ntr.error_message, 400);
+				}
+				free_new_theme_response(ntr);
 			} else {
-				r = http_error_response(nsr.error_message, 400);
+				r = http_error_response("supplied new_theme is not valid", 400);
 			}
-			free_new_server_response(nsr);
+			free_new_theme(nt);
 		} else {
-			r = http_error_response("Invalid data supplied!", 400);
+			r = http_error_response("Invalid JSON supplied", 400);
+		}
+		json_object_put(v);
+	} else if (strcmp("PATCH", method) == 0) {
+		// The theme id follows the resource name, e.g. theme/1
+		if (da_count(path_elements) > 1) {
+			int id = atoi(da_get(path_elements, 1));
+			struct json_object* v = parse_json_body(body);
+			if (v != NULL) {
+				PatchTheme pt = parse_patch_theme(v, id);
+				if (pt.valid) {
+					PatchThemeResponse ptr = update_theme(pt);
+					if (ptr.success) {
+						struct json_object* ok = json_object_new_object();
+						r = http_json_response(ok, 200);
+						json_object_put(ok);
+					} else {
+						r = http_error_response(ptr.error_message, 400);
+					}
+					free_patch_theme_response(ptr);
+				} else {
+					r = http_error_response("supplied patch_theme is not valid", 400);
+				}
+				free_patch_theme(pt);
+			} else {
+				r = http_error_response("Invalid JSON supplied", 400);
+			}
+			json_object_put(v);
+		} else {
+			r = http_error_response("theme id is required", 400);
 		}
-		free_new_server(ns);
 	}
 	return r;
 }
 
 Pages get_pages() {
 	Pages p = {0};
-	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, "select id, server_id, parent_page_id, relative_path from page", -1, &stmt, NULL));
+	sqlite3_stmt* stmt = prepare_cached("select id, server_id, parent_page_id, relative_path from page");
 	int v;
 	for (v = sqlite3_step(stmt); v != SQLITE_DONE; v = sqlite3_step(stmt)) {
 		Page pp = {
@@ -726,7 +4691,7 @@ Pages get_pages() {
 	if (v != SQLITE_DONE) {
 		sqlite_check(db, v);
 	}
-	sqlite3_finalize(stmt);
+	finish_cached(stmt);
 	return p;
 }
 
@@ -794,8 +4759,8 @@ NewPageResponse create_page(NewPage np) {
 		.error_message = NULL
 	};
 	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, "insert into page (server_id, parent_page_id, relative_path) "
-				"values (?,?,?)", -1, &stmt, NULL));
+	sqlite_check(db, sqlite3_prepare_v2(db, "insert into page (server_id, parent_page_id, relative_path, last_modified) "
+				"values (?,?,?,cast(strftime('%s', 'now') as integer))", -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_int(stmt, 1, np.server_id));
 	if (np.parent_page_id > -1) {
 		sqlite_check(db, sqlite3_bind_int(stmt, 2, np.parent_page_id));
@@ -813,6 +4778,7 @@ NewPageResponse create_page(NewPage np) {
 		};
 		r.success = true;
 		r.page = p;
+		page_cache_invalidate_server(np.server_id);
 	} else {
 		r.error_message = strdup(sqlite3_errmsg(db));
 	}
@@ -847,7 +4813,7 @@ HttpResponse handle_api_page_path(
 		json_object_put(json);
 		free_pages(pages);
 	} else if (strcmp("POST", method) == 0) {
-		struct json_object* v = json_tokener_parse(body);
+		struct json_object* v = parse_json_body(body);
 		if (v != NULL) {
 			NewPage np = parse_new_page(v);
 			if (np.valid) {
@@ -867,15 +4833,16 @@ HttpResponse handle_api_page_path(
 		} else {
 			r = http_error_response("Invalid JSON supplied", 400);
 		}
+		json_object_put(v);
 	}
 	return r;
 }
 
 PageContents get_page_contents() {
 	PageContents r = {0};
-	sqlite3_stmt* stmt;
-	sqlite_check(db, sqlite3_prepare_v2(db, "select id, page_id, language, title, content "
-				"from page_content", -1, &stmt, NULL));
+	sqlite3_stmt* stmt = prepare_cached(
+				"select id, page_id, language, title, content "
+				"from page_content");
 	int v;
 	for (v = sqlite3_step(stmt); v != SQLITE_DONE; v = sqlite3_step(stmt)) {
 		PageContent pc = {
@@ -887,7 +4854,7 @@ PageContents get_page_contents() {
 		};
 		da_push(r, pc);
 	}
-	sqlite3_finalize(stmt);
+	finish_cached(stmt);
 	return r;
 }
 
@@ -967,19 +4934,62 @@ void free_new_page_content(NewPageContent p) {
 		free(p.content);
 }
 
+/*
+ * Looks up the server a page belongs to,
+ * or -1 if there is no such page.
+ */
+int find_page_server_id(int page_id) {
+	sqlite3_stmt* stmt = prepare_cached("select server_id from page where id = ?");
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, page_id));
+	int server_id = -1;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		server_id = sqlite3_column_int(stmt, 0);
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	finish_cached(stmt);
+	return server_id;
+}
+
+/*
+ * Looks up the server a page_content is displayed on,
+ * or -1 if there is no such page_content.
+ */
+int find_page_content_server_id(int page_content_id) {
+	sqlite3_stmt* stmt = prepare_cached(
+				"select p.server_id "
+				"from page_content pc "
+				"join page p on p.id = pc.page_id "
+				"where pc.id = ?");
+	sqlite_check(db, sqlite3_bind_int(stmt, 1, page_content_id));
+	int server_id = -1;
+	int v = sqlite3_step(stmt);
+	if (v == SQLITE_ROW) {
+		server_id = sqlite3_column_int(stmt, 0);
+	} else if (v != SQLITE_DONE) {
+		sqlite_check(db, v);
+	}
+	finish_cached(stmt);
+	return server_id;
+}
+
 NewPageContentResponse create_page_content(NewPageContent npc) {
 	NewPageContentResponse r = {
 		.success = false,
 		.error_message = NULL
 	};
+	// Rendered here, so that it doesn't need doing whenever the page is served
+	char* content_html = render_markdown(npc.content);
 	sqlite3_stmt* stmt;
 	sqlite_check(db, sqlite3_prepare_v2(db, 
-				"insert into page_content (page_id, language, title, content) "
-				"values (?,?,?,?)", -1, &stmt, NULL));
+				"insert into page_content (page_id, language, title, content, content_html) "
+				"values (?,?,?,?,?)", -1, &stmt, NULL));
 	sqlite_check(db, sqlite3_bind_int(stmt, 1, npc.page_id));
 	sqlite_check(db, sqlite3_bind_text(stmt, 2, npc.language, -1, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 3, npc.title, -1, NULL));
 	sqlite_check(db, sqlite3_bind_text(stmt, 4, npc.content, -1, NULL));
+	sqlite_check(db, sqlite3_bind_text(stmt, 5, content_html, -1, free));
 	int v = sqlite3_step(stmt);
 	if (v == SQLITE_DONE) {
 		r.success = true;
@@ -991,6 +5001,7 @@ NewPageContentResponse create_page_content(NewPageContent npc) {
 			.content = strdup(npc.content),
 		};
 		r.content = pc;
+		page_cache_invalidate_server(find_page_server_id(npc.page_id));
 	} else {
 		r.error_message = strdup(sqlite3_errmsg(db));
 	}
@@ -1016,7 +5027,7 @@ PatchPageContent parse_patch_page_content(struct json_object* v, int id) {
 		if (to != NULL && json_object_is_type(to, json_type_string)) {
 			r.title = strdup(json_object_get_string(to));
 		}
-		struct json_object* co = json_object_object_get(v, "title");
+		struct json_object* co = json_object_object_get(v, "content");
 		if (co != NULL && json_object_is_type(co, json_type_string)) {
 			r.content = strdup(json_object_get_string(co));
 		}
@@ -1038,9 +5049,9 @@ PatchPageContentResponse update_page_content(PatchPageContent ppc) {
 	};
 	const char* sql;
 	if (ppc.content != NULL && ppc.title != NULL) {
-		sql = "update page_content set title = ?, content = ? where id = ?";
+		sql = "update page_content set title = ?, content = ?, content_html = ? where id = ?";
 	} else if (ppc.content != NULL) {
-		sql = "update page_content set content = ? where id = ?";
+		sql = "update page_content set content = ?, content_html = ? where id = ?";
 	} else if (ppc.title != NULL) {
 		sql = "update page_content set title = ? where id = ?";
 	} else {
@@ -1053,10 +5064,12 @@ PatchPageContentResponse update_page_content(PatchPageContent ppc) {
 	if (ppc.content != NULL && ppc.title != NULL) {
 		sqlite_check(db, sqlite3_bind_text(stmt, 1, ppc.title, -1, NULL));
 		sqlite_check(db, sqlite3_bind_text(stmt, 2, ppc.content, -1, NULL));
-		sqlite_check(db, sqlite3_bind_int(stmt, 3, ppc.id));
+		sqlite_check(db, sqlite3_bind_text(stmt, 3, render_markdown(ppc.content), -1, free));
+		sqlite_check(db, sqlite3_bind_int(stmt, 4, ppc.id));
 	} else if (ppc.content != NULL) {
 		sqlite_check(db, sqlite3_bind_text(stmt, 1, ppc.content, -1, NULL));
-		sqlite_check(db, sqlite3_bind_int(stmt, 2, ppc.id));
+		sqlite_check(db, sqlite3_bind_text(stmt, 2, render_markdown(ppc.content), -1, free));
+		sqlite_check(db, sqlite3_bind_int(stmt, 3, ppc.id));
 	} else if (ppc.title != NULL) {
 		sqlite_check(db, sqlite3_bind_text(stmt, 1, ppc.title, -1, NULL));
 		sqlite_check(db, sqlite3_bind_int(stmt, 2, ppc.id));
@@ -1067,6 +5080,7 @@ PatchPageContentResponse update_page_content(PatchPageContent ppc) {
 	int v = sqlite3_step(stmt);
 	if (v == SQLITE_DONE) {
 		r.success= true;
+		page_cache_invalidate_server(find_page_content_server_id(ppc.id));
 	} else {
 		r.error_message = strdup(sqlite3_errmsg(db));
 	}
@@ -1084,7 +5098,7 @@ HttpResponse handle_editor() {
 	HttpResponse r = {
 		.content = editor_html,
 		.content_length = strlen(editor_html),
-		.content_type = strdup("text/html"),
+		.content_type = "text/html",
 		.status_code = 200,
 	};
 	return r;
@@ -1106,7 +5120,7 @@ HttpResponse handle_api_page_content_path(const char* method,
 		json_object_put(json);
 		free_page_contents(page_contents);
 	} else if (strcmp("POST", method) == 0) {
-		struct json_object* v = json_tokener_parse(body);
+		struct json_object* v = parse_json_body(body);
 		if (v != NULL) {
 			NewPageContent np = parse_new_page_content(v);
 			if (np.valid) {
@@ -1128,35 +5142,72 @@ HttpResponse handle_api_page_content_path(const char* method,
 		}
 		json_object_put(v);
 	} else if (strcmp("PATCH", method) == 0) {
-		if (!da_empty(path_elements)) {
-			char* first = da_get(path_elements, 0);
-			atoi(first);
-			struct json_object* v = json_tokener_parse(body);
+		// The page_content id follows the resource name, e.g. page_content/1
+		if (da_count(path_elements) > 1) {
+			int id = atoi(da_get(path_elements, 1));
+			struct json_object* v = parse_json_body(body);
 			if (v != NULL) {
-
-				PatchPageContent ppc = parse_patch_page_content(v, 
-
+				PatchPageContent ppc = parse_patch_page_content(v, id);
+				if (ppc.valid) {
+					PatchPageContentResponse ppcr = update_page_content(ppc);
+					if (ppcr.success) {
+						struct json_object* ok = json_object_new_object();
+						r = http_json_response(ok, 200);
+						json_object_put(ok);
+					} else {
+						r = http_error_response(ppcr.error_message, 400);
+					}
+					free_patch_page_content_response(ppcr);
+				} else {
+					r = http_error_response("supplied patch_page_content is not valid", 400);
+				}
+				free_patch_page_content(ppc);
+			} else {
+				r = http_error_response("Invalid JSON supplied", 400);
 			}
 			json_object_put(v);
 		} else {
+			r = http_error_response("page_content id is required", 400);
 		}
 	}
 	return r;
 }
 
+HttpResponse handle_api_page_cache_path(const char* method) {
+	if (strcmp("GET", method) == 0) {
+		struct json_object* stats = page_cache_stats_to_json();
+		HttpResponse r = http_json_response(stats, 200);
+		json_object_put(stats);
+		return r;
+	}
+	return http_error_response("Method not allowed", 405);
+}
+
 HttpResponse handle_api(Strings path_elements, 
 		const char* method,
 		const char* body) {
 	char* resource = da_get(path_elements, 0);
+	HttpResponse r;
 	if (strcmp("page", resource) == 0) {
-		return handle_api_page_path(method, body);
+		r = handle_api_page_path(method, body);
+		r.route = ROUTE_API_PAGE;
 	} else if (strcmp("page_content", resource) == 0) {
-		return handle_api_page_content_path(method, body);
+		r = handle_api_page_content_path(method, body, path_elements);
+		r.route = ROUTE_API_PAGE_CONTENT;
 	} else if (strcmp("server", resource) == 0) {
-		return handle_api_server_path(method, body);
+		r = handle_api_server_path(method, body);
+		r.route = ROUTE_API_SERVER;
+	} else if (strcmp("theme", resource) == 0) {
+		r = handle_api_theme_path(method, body, path_elements);
+		r.route = ROUTE_API_THEME;
+	} else if (strcmp("page_cache", resource) == 0) {
+		r = handle_api_page_cache_path(method);
+		r.route = ROUTE_API_OTHER;
 	} else {
-		return http_error_response("Not found", 404);
+		r = http_error_response("Not found", 404);
+		r.route = ROUTE_API_OTHER;
 	}
+	return r;
 }
 
 HttpResponse handle_static_resources(const char* host, 
@@ -1165,41 +5216,203 @@ HttpResponse handle_static_resources(const char* host,
 	if (subpath[0] == '/') {
 		subpath = subpath + 1;
 	}
-	printf("looking for static resource host %s subpath %s\n", host, subpath);
 	HttpResponse r = {
 		.content = NULL,
 		.content_length = 0,
 		.content_type = NULL,
 		.status_code = 404,
 	};
-	
-	StaticResource sr = find_static_resource(host, subpath);
+	// HTTP/1.0 requests needn't have a Host, and no server's hostname is NULL
+	if (host == NULL) {
+		return r;
+	}
+	StaticResource sr = static_cache_get(host, subpath);
 	if (sr.isnotfound) {
 		free_static_resource(sr);
 		return r;
 	}
-	void* cc = (char*)malloc(sr.value_size);
-	memcpy(cc, sr.value, sr.value_size);
-	r.content = (char*)cc;
-	r.content_length = sr.value_size;
-	r.content_type = strdup(sr.content_type);
+	// Hand the response our reference, rather than copying the data
+	r.shared = sr.value;
+	sr.value = NULL;
+	r.content = r.shared->data;
+	r.content_length = r.shared->length;
+	r.content_type = arena_strdup(&request_arena, sr.content_type);
 	r.status_code = 200;
+	free_static_resource(sr);
 	return r;
 }
 
 /*
- * Handle a request for content page
+ * Formats a time as an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ */
+void format_http_date(time_t t, char* out, size_t size) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * Parses an HTTP date in the preferred format, returning -1 if it can't.
+ * Done by hand as strptime and timegm aren't standard.
+ */
+time_t parse_http_date(const char* date) {
+	static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	char month_name[4];
+	int day, year, hour, minute, second;
+	if (sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT",
+				&day, month_name, &year, &hour, &minute, &second) != 6) {
+		return -1;
+	}
+	int month = -1;
+	for (int i = 0; i < 12; i++) {
+		if (strcmp(month_name, months[i]) == 0) {
+			month = i + 1;
+		}
+	}
+	if (month < 0) {
+		return -1;
+	}
+	// Days since the epoch from the civil date (Howard Hinnant's algorithm)
+	int y = month <= 2 ? year - 1 : year;
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	long long days = (long long)era * 146097 + doe - 719468;
+	return (time_t)(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+/*
+ * Whether an If-None-Match header value matches the etag.
+ * Uses the weak comparison, as required for GET.
+ */
+bool etag_matches(const char* if_none_match, const char* etag) {
+	size_t etag_length = strlen(etag);
+	const char* c = if_none_match;
+	while (*c != '\0') {
+		while (*c == ' ' || *c == '\t' || *c == ',') {
+			c++;
+		}
+		if (*c == '*') {
+			return true;
+		}
+		if (strncmp(c, "W/", 2) == 0) {
+			c += 2;
+		}
+		if (strncmp(c, etag, etag_length) == 0 
+				&& (c[etag_length] == '\0' || c[etag_length] == ',' 
+					|| c[etag_length] == ' ' || c[etag_length] == '\t')) {
+			return true;
+		}
+		while (*c != '\0' && *c != ',') {
+			c++;
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether the client's copy of the page is still current, given its
+ * If-None-Match and If-Modified-Since headers (either may be NULL).
+ */
+bool is_not_modified(const PageValidators* pv,
+		const char* if_none_match,
+		const char* if_modified_since) {
+	if (!pv->found) {
+		return false;
+	}
+	// If-Modified-Since is ignored when there's an If-None-Match
+	if (if_none_match != NULL) {
+		return etag_matches(if_none_match, pv->etag);
+	}
+	if (if_modified_since != NULL) {
+		time_t since = parse_http_date(if_modified_since);
+		return since >= 0 && pv->last_modified <= since;
+	}
+	return false;
+}
+
+/*
+ * Serves a content page.
+ * If the client sent validators that still match, responds with 304 Not Modified
+ * before doing any rendering.
  */
 HttpResponse handle_content(const char* host, 
-		const char* path) {
-	PageData pd = find_page_data(host, path, "en");
-	char* content = mustache_render(pd);
+		const char* path,
+		const char* if_none_match,
+		const char* if_modified_since) {
+	const char* lang = "en"; // TODO language selection
 	HttpResponse r = {
-		.content = strdup(content),
-		.content_length = strlen(content),
-		.content_type = strdup("text/html"),
-		.status_code = pd.isnotfound ? 404: 200,
+		.content = NULL,
+		.content_length = 0,
+		.content_type = "text/html",
+		.status_code = 200,
 	};
+	// Taken before anything's read, so that a page read from before a
+	// change is refused by the cache once the change has emptied it
+	unsigned long generation = page_cache_generation();
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int server_id = find_server_id(host);
+	record_stage(STAGE_HOST, elapsed_since(start));
+	PageValidators pv = {0};
+	SharedBuffer* cached = page_cache_get(server_id, path, lang, &pv);
+	if (cached == NULL && (if_none_match != NULL || if_modified_since != NULL)) {
+		// Worth a query to see if the page can be skipped. Otherwise the
+		// validators come with the page data.
+		pv = find_page_validators(server_id, path, lang);
+	}
+	if (pv.found) {
+		r.etag = arena_strdup(&request_arena, pv.etag);
+		r.last_modified = pv.last_modified;
+	}
+	if (is_not_modified(&pv, if_none_match, if_modified_since)) {
+		shared_buffer_release(cached);
+		r.status_code = 304;
+		return r;
+	}
+	if (cached != NULL) {
+		// Sent straight from the cache, the response holds our reference
+		r.shared = cached;
+		r.content = cached->data;
+		r.content_length = cached->length;
+		return r;
+	}
+	PageData pd = find_page_data(server_id, path, lang);
+	pv = pd.validators;
+	r.etag = pv.found ? arena_strdup(&request_arena, pv.etag) : NULL;
+	r.last_modified = pv.last_modified;
+	ThemeTemplate tt = find_theme_template(pd.theme_id, pd.theme_revision);
+	if (tt.template == NULL) {
+		// Already reported when the template was compiled
+		free_page_data(pd);
+		r.etag = NULL;
+		r.last_modified = 0;
+		r.content = strdup("Internal server error");
+		r.content_length = strlen(r.content);
+		r.status_code = 500;
+		return r;
+	}
+	pd.theme_content = template_theme_content(tt.template, pd.theme_id, lang, pd.theme_revision);
+	if (pd.isnotfound || page_cache.max_bytes == 0) {
+		// Not going to be cached (not caching 404s, anyone can make up paths),
+		// so there's no need to put the whole page together. Send it as it's
+		// rendered, or in pieces from where they already are.
+		r.status_code = pd.isnotfound ? 404 : 200;
+		if (config.iovec_pages) {
+			r.iovec = page_iovec_new(tt.template, pd);
+		} else {
+			r.stream = page_stream_new(tt.template, pd);
+		}
+		return r;
+	}
+	// Rendered straight into the buffer the cache and the response share
+	r.shared = template_render(tt.template, &pd);
+	r.content = r.shared->data;
+	r.content_length = r.shared->length;
+	release_template(tt.template);
+	page_cache_put(server_id, path, lang, r.shared, pv, generation);
 	free_page_data(pd);
 	return r;
 }
@@ -1207,33 +5420,41 @@ HttpResponse handle_content(const char* host,
 /*
  * Split path by URL path element delimeter (/)
  * and return the path elements in a list. 
- * Caller is responsible for freeing the result.
+ * The list and the elements are allocated from the request arena.
  */
 Strings get_path_elements(const char* path) {
-	// strtok is destructive, take a copy before operating
-	char* path_dup = strdup(path);
+	// strtok is destructive, take a copy before operating.
+	// The elements are left where they are in the copy.
+	char* path_dup = arena_strdup(&request_arena, path);
+	// There can't be more elements than separators, plus one
+	size_t max_elements = 1;
+	for (const char* c = path; *c != '\0'; c++) {
+		if (*c == '/') {
+			max_elements++;
+		}
+	}
+	Strings path_elements;
+	da_init_external(path_elements,
+			arena_alloc(&request_arena, sizeof(char*) * max_elements),
+			max_elements);
 	// Tokenize and push into a list
-	Strings path_elements = {0};
 	char* sv;
 	char* tok = strtok_r(path_dup, "/", &sv);
 	while (tok != NULL) {
-		// Copy again to push it into the array
-		da_push(path_elements, strdup(tok));
+		da_push(path_elements, tok);
 		tok = strtok_r(NULL, "/", &sv);
 	}
-	// Get rid of the shredded string
-	free(path_dup);
 	// Empty path / is allowed, just treat is as an empty string 
 	// not a NULL
 	if (da_count(path_elements) == 0) {
-		da_push(path_elements, strdup(""));
+		da_push(path_elements, arena_strdup(&request_arena, ""));
 	}
 	return path_elements;
 }
 
 /*
  * Join path elements with URL path separator (/)
- * Caller is responsible for freeing the result.
+ * The result is allocated from the request arena.
  */
 char* join_path_elements(Strings path_elements) {
 	size_t req = 0;
@@ -1242,7 +5463,7 @@ char* join_path_elements(Strings path_elements) {
 		req += strlen(pe);
 		req += 1;
 	}
-	char* ret = malloc(req);
+	char* ret = arena_alloc(&request_arena, req);
 	memset(ret, '\0', req);
 	size_t ix = 0;
 	for (int i=0; i<da_count(path_elements); i++) {
@@ -1257,61 +5478,199 @@ char* join_path_elements(Strings path_elements) {
 		}
 		ix += 1;
 	}
-	printf("joined %s\n", ret);
+	log_debug("Joined %s", ret);
 	return ret;
 }
 
-void free_strings(Strings s) {
-	for (int i=0; i<da_count(s); i++) {
-		free(da_get(s, i));
+/*
+ * Routes a request to its handler.
+ * Anything the response refers to from the request arena is valid
+ * until the arena is reset.
+ */
+HttpResponse handle_request(const char* host,
+		const char* path,
+		const char* method,
+		const char* upload_data,
+		const char* if_none_match,
+		const char* if_modified_since) {
+	if (config.metrics_path != NULL && strcmp(path, config.metrics_path) == 0) {
+		HttpResponse r = handle_metrics(method);
+		r.route = ROUTE_METRICS;
+		return r;
 	}
-	da_free(s);
-}
-
-// HTTP handler function
-// Responsible for routing
-enum MHD_Result handle_http(void* cls, 
-		struct MHD_Connection* connection,
-                const char* path,
-                const char* method, 
-		const char* version,
-                const char* upload_data,
-                long unsigned int* upload_data_size, 
-		void** con_cls) {
 	Strings path_elements = get_path_elements(path);
 	char* first_path_element = da_get(path_elements, 0);
-
-	printf("Handling connection path %s method %s version %s\n", path, method, version);
-	const char* host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_HOST);
+	bool is_read = strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0;
 	HttpResponse r = {0};
 	if (strcmp("editor.html", first_path_element) == 0) {
 		r = handle_editor();
+		r.route = ROUTE_EDITOR;
 	} else if (strcmp("api", first_path_element) == 0) {
 		da_delete(path_elements, 0);
-		r = handle_api(path_elements, method, upload_data);
+		// Only writes need to wait for the writer, reads don't change anything
+		if (is_read) {
+			acquire_reader();
+			r = handle_api(path_elements, method, upload_data);
+			release_reader();
+		} else {
+			acquire_writer();
+			r = handle_api(path_elements, method, upload_data);
+			release_writer();
+		}
 	} else if (strcmp("static", first_path_element) == 0) {
 		da_delete(path_elements, 0);
 		char* subpath = join_path_elements(path_elements);
+		acquire_reader();
 		r = handle_static_resources(host, subpath);
-		free(subpath);
+		release_reader();
+		r.route = ROUTE_STATIC;
+	} else {
+		// Conditional requests only make sense for reads
+		acquire_reader();
+		// Read from one snapshot, so the validators match the page
+		exec_cached("begin");
+		r = handle_content(host, path,
+			is_read ? if_none_match : NULL,
+			is_read ? if_modified_since : NULL);
+		exec_cached("commit");
+		release_reader();
+		r.route = ROUTE_CONTENT;
+	}
+	return r;
+}
+
+// HTTP handler function
+enum MHD_Result handle_http(void* cls, 
+		struct MHD_Connection* connection,
+                const char* path,
+                const char* method, 
+		const char* version,
+                const char* upload_data,
+                long unsigned int* upload_data_size, 
+		void** con_cls) {
+	// Reads don't have bodies, so they're handled on the first call.
+	// Otherwise MHD calls first with just the headers, then with each part
+	// of the body, then with nothing once it's all arrived.
+	if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+		if (*con_cls == NULL) {
+			*con_cls = calloc(1, sizeof(RequestBody));
+			return MHD_YES;
+		}
+		RequestBody* body = *con_cls;
+		if (*upload_data_size > 0) {
+			body->data = realloc(body->data, body->length + *upload_data_size + 1);
+			memcpy(body->data + body->length, upload_data, *upload_data_size);
+			body->length += *upload_data_size;
+			body->data[body->length] = '\0';
+			*upload_data_size = 0;
+			return MHD_YES;
+		}
+		upload_data = body->data;
 	} else {
-		r = handle_content(host, path);
+		upload_data = NULL;
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	log_debug("Handling connection path %s method %s version %s", path, method, version);
+	const char* host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_HOST);
+	bool send_timing = config.server_timing
+		|| MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Server-Timing") != NULL;
+	request_trace_begin(send_timing || config.slow_request_ms > 0, host, path);
+	PROBE(request__start, method, host, path);
+	HttpResponse r = handle_request(host,
+		path,
+		method,
+		upload_data,
+		MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH),
+		MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_MODIFIED_SINCE));
+	struct timespec handled;
+	clock_gettime(CLOCK_MONOTONIC, &handled);
+	// API routes are only known once their handler has run
+	PROBE(route, host, path, route_names[r.route], r.status_code);
+
+	// For the access log, before MHD owns the content
+	long bytes = r.content_length;
+	if (r.stream != NULL) {
+		bytes = -1;
+	} else if (r.iovec != NULL) {
+		bytes = 0;
+		for (int i = 0; i < da_count(r.iovec->pieces); i++) {
+			bytes += r.iovec->iov[i].iov_len;
+		}
 	}
-	free_strings(path_elements);
-	
-	struct MHD_Response* response = 
-		MHD_create_response_from_buffer(r.content_length, 
+	struct MHD_Response* response;
+	if (r.stream != NULL) {
+		response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN,
+			PAGE_RENDER_BLOCK_SIZE,
+			page_stream_read,
+			r.stream,
+			page_stream_free);
+	} else if (r.iovec != NULL) {
+		response = MHD_create_response_from_iovec(r.iovec->iov,
+			da_count(r.iovec->pieces),
+			page_iovec_free,
+			r.iovec);
+	} else if (r.shared != NULL) {
+		response = MHD_create_response_from_buffer_with_free_callback(r.content_length,
+			r.content,
+			shared_buffer_release_data);
+	} else {
+		response = MHD_create_response_from_buffer(r.content_length, 
 			r.content, 
 			MHD_RESPMEM_MUST_FREE);
-	MHD_add_response_header(response, "Content-Type", r.content_type);
+	}
+	if (r.content_type != NULL && r.status_code != 304) {
+		MHD_add_response_header(response, "Content-Type", r.content_type);
+	}
+	if (r.etag != NULL) {
+		MHD_add_response_header(response, "ETag", r.etag);
+	}
+	if (r.last_modified > 0) {
+		char date[64];
+		format_http_date(r.last_modified, date, sizeof(date));
+		MHD_add_response_header(response, "Last-Modified", date);
+	}
+	if (send_timing) {
+		char timing[256];
+		format_server_timing(timing, sizeof(timing), elapsed_since(start));
+		MHD_add_response_header(response, "Server-Timing", timing);
+	}
 	int ret = MHD_queue_response(connection, r.status_code, response);
 	MHD_destroy_response(response);
-	// Free the content type, don't free the content as MHD will do that 
-	// for us once it's actually sent.
-	free(r.content_type);
+	record_stage(STAGE_QUEUE, elapsed_since(handled));
+	unsigned long duration_ns = elapsed_since(start);
+	record_response(r.route, r.status_code, duration_ns);
+	PROBE(request__done, method, host, path, r.status_code, bytes, duration_ns);
+	log_access(method, host, path, r.status_code, bytes, duration_ns);
+	log_capture(connection, method, host, path, start, r.route, r.status_code, duration_ns);
+	if (config.slow_request_ms > 0 && duration_ns >= config.slow_request_ms * 1000000) {
+		log_slow_request(method, host, path, duration_ns);
+	}
+	// The host and path are MHD's, and about to go
+	request_trace_begin(false, NULL, NULL);
+	// Headers have been copied into the response, so the request's memory
+	// can go. Don't free the content (or release the shared buffer, the
+	// stream or the pieces) as MHD will do that for us once it's actually sent.
+	arena_reset(&request_arena);
 	return ret;
 }
 
+/*
+ * Called by the http server once it's done with a request, whether or
+ * not it was answered, to free its body
+ */
+void handle_http_completed(void* cls,
+		struct MHD_Connection* connection,
+		void** con_cls,
+		enum MHD_RequestTerminationCode toe) {
+	RequestBody* body = *con_cls;
+	if (body != NULL) {
+		free(body->data);
+		free(body);
+		*con_cls = NULL;
+	}
+}
+
 /*
  * Signal handling, clean up resources we're using 
  * before allowing the program to terminate
@@ -1327,33 +5686,193 @@ void handle_term(int sig) {
 	if (http_server_daemon != NULL) {
 		MHD_stop_daemon(http_server_daemon);
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
-	}
+	stop_log_writer();
+	close_database();
+	page_cache_free();
+	free_theme_templates();
+	static_cache_clear();
+	clear_server_snapshot();
+	nav_cache_clear();
 	// Remove the signal handler and re-raise
 	signal(sig, SIG_DFL);
 	raise(sig);
 }
 
+void usage(const char* program) {
+	fprintf(stderr, "Usage: %s [options]\n"
+			"  -d <path>   database file (default %s)\n"
+			"  -p <port>   port to listen on (default %d)\n"
+			"  -c <bytes>  memory budget for rendered pages, 0 disables caching (default %zu)\n"
+			"  -s <bytes>  memory budget for static resources, 0 disables caching (default %zu)\n"
+			"  -t <n>      worker threads, 0 for one per CPU (default %d)\n"
+			"  -T          use a thread per connection instead of a pool of workers\n"
+			"  -S <mode>   sqlite synchronous setting, off|normal|full|extra (default %s)\n"
+			"  -k <pages>  checkpoint the WAL in the background at this many pages,\n"
+			"              0 to checkpoint on commit instead (default %d)\n"
+			"  -E          check the page queries use indexes, and exit\n"
+			"  -I          send pages that aren't cached in pieces from where they\n"
+			"              are held, rather than streaming them as they're rendered\n"
+			"  -l <path>   file to append the access log to, - for stdout (default %s)\n"
+			"  -L <n>      log 1 in n requests, 0 for none; server errors are\n"
+			"              always logged (default %d)\n"
+			"  -v          log debug messages too\n"
+			"  -m <path>   serve metrics in Prometheus' format at this path,\n"
+			"              - for none (default %s)\n"
+			"  -H          send a Server-Timing header with every response, not\n"
+			"              just for requests with an X-Server-Timing header\n"
+			"  -w <ms>     log requests taking at least this long, with the time\n"
+			"              spent in each stage, 0 for none (default %lu)\n"
+			"  -C <path>   capture requests to this file, to replay with bin/replay\n"
+			"  -h          show this help\n",
+			program,
+			config.database_path,
+			config.port,
+			config.page_cache_bytes,
+			config.static_cache_bytes,
+			config.threads,
+			config.synchronous,
+			config.checkpoint_pages,
+			config.access_log_path,
+			config.access_log_sample,
+			config.metrics_path,
+			config.slow_request_ms);
+}
+
+/*
+ * Populates the global config from the command line.
+ * Returns false if the program shouldn't continue.
+ */
+bool parse_config(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "d:p:c:s:t:TS:k:EIl:L:vm:Hw:C:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			config.database_path = optarg;
+			break;
+		case 'p':
+			config.port = atoi(optarg);
+			break;
+		case 'c':
+			config.page_cache_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			config.static_cache_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			config.threads = atoi(optarg);
+			break;
+		case 'T':
+			config.thread_per_connection = true;
+			break;
+		case 'S':
+			if (strcmp(optarg, "off") != 0 && strcmp(optarg, "normal") != 0
+					&& strcmp(optarg, "full") != 0 && strcmp(optarg, "extra") != 0) {
+				usage(argv[0]);
+				return false;
+			}
+			config.synchronous = optarg;
+			break;
+		case 'k':
+			config.checkpoint_pages = atoi(optarg);
+			break;
+		case 'E':
+			config.check_plans = true;
+			break;
+		case 'I':
+			config.iovec_pages = true;
+			break;
+		case 'l':
+			config.access_log_path = optarg;
+			break;
+		case 'L':
+			config.access_log_sample = atoi(optarg);
+			break;
+		case 'v':
+			config.log_level = LOG_LEVEL_DEBUG;
+			break;
+		case 'm':
+			config.metrics_path = strcmp(optarg, "-") == 0 ? NULL : optarg;
+			break;
+		case 'H':
+			config.server_timing = true;
+			break;
+		case 'w':
+			config.slow_request_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			config.capture_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Benchmarks include this file to reach its internals, and bring their own main
+#ifndef CCMS_NO_MAIN
 int main(int argc, char** argv) {
+	if (!parse_config(argc, argv)) {
+		return 1;
+	}
 	// Set globals before we setup any signal handling
 	http_server_daemon = NULL;
-	db = NULL;
+	db_writer = NULL;
+	connection = NULL;
+	if (config.threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		config.threads = cpus > 0 ? cpus : 1;
+	}
+	page_cache_init(config.page_cache_bytes);
+	static_cache.max_bytes = config.static_cache_bytes;
 	// Setup termination signal handling
 	signal(SIGINT, handle_term);
 	signal(SIGTERM, handle_term);
 	// Open the database
-	initialize_database("ccms.db");
+	initialize_database(config.database_path);
+	if (config.check_plans) {
+		bool ok = check_query_plans();
+		close_database();
+		return ok ? 0 : 1;
+	}
+	if (!check_query_plans()) {
+		fprintf(stderr, "Warning: page requests will get slower as pages are added\n");
+	}
+	load_theme_templates();
+	connection = NULL;
+	db = NULL;
+	start_log_writer();
+	start_checkpointer();
 	// Start the http server
-	http_server_daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD, 
-		  8000, 
-		  NULL, 
-		  NULL, 
-		  handle_http, 
-		  NULL, 
-		  MHD_OPTION_END);
+	if (config.thread_per_connection) {
+		http_server_daemon = MHD_start_daemon(
+			  MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_THREAD_PER_CONNECTION,
+			  config.port,
+			  NULL, 
+			  NULL, 
+			  handle_http, 
+			  NULL, 
+			  MHD_OPTION_NOTIFY_COMPLETED, handle_http_completed, NULL,
+			  MHD_OPTION_END);
+	} else {
+		http_server_daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD,
+			  config.port,
+			  NULL, 
+			  NULL, 
+			  handle_http, 
+			  NULL, 
+			  MHD_OPTION_THREAD_POOL_SIZE, (unsigned int)config.threads,
+			  MHD_OPTION_NOTIFY_COMPLETED, handle_http_completed, NULL,
+			  MHD_OPTION_END);
+	}
+	if (http_server_daemon == NULL) {
+		fprintf(stderr, "Couldn't start the http server on port %d\n", config.port);
+		raise(SIGTERM);
+	}
 	// Pause until exit
 	pause();
 	return 0;
 }
+#endif
 